@@ -0,0 +1,864 @@
+/*
+ * hcxselect - A CSS selector engine for htmlcxx
+ * Copyright (C) 2011 Jonas Gehring
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+#include <sys/time.h>
+
+#include <htmlcxx/html/ParserDom.h>
+
+#include <arena.h>
+#include <hcxselect.h>
+#include <matcher.h>
+
+using namespace std;
+
+
+// Bytes currently allocated using operator new, for measuring the memory
+// used by data structures
+static size_t allocated = 0;
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#define THROW_NOTHING noexcept
+#else
+#define THROW_BAD_ALLOC throw(std::bad_alloc)
+#define THROW_NOTHING throw()
+#endif
+
+void *operator new(size_t size) THROW_BAD_ALLOC
+{
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) throw std::bad_alloc();
+	allocated += malloc_usable_size(p);
+	return p;
+}
+
+void operator delete(void *p) THROW_NOTHING
+{
+	allocated -= malloc_usable_size(p);
+	free(p);
+}
+
+
+// Returns the current time in seconds
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Generates a document with roughly the given number of nodes
+static string generate(int nodes)
+{
+	stringstream ss;
+	ss << "<html><head><title>Benchmark</title></head><body>";
+	for (int i = 0, n = 0; n < nodes; i++) {
+		ss << "<div class=\"section s" << (i % 10) << "\" id=\"s" << i << "\">";
+		ss << "<h2>Section " << i << "</h2>";
+		for (int j = 0; j < 4; j++) {
+			ss << "<p class=\"text\">Paragraph <span class=\"em\">" << j << "</span> text</p>";
+		}
+		ss << "<ul>";
+		for (int j = 0; j < 5; j++) {
+			ss << "<li><a href=\"/page" << i << "-" << j << ".html\">Link</a></li>";
+		}
+		ss << "</ul><br></div>";
+		n += 40;
+	}
+	ss << "</body></html>";
+	return ss.str();
+}
+
+// Generates a document with roughly the given number of nodes, most of
+// which are in large inline graphics and scripts, followed by a small
+// comment section
+static string generateSparse(int nodes)
+{
+	stringstream ss;
+	ss << "<html><head><title>Benchmark</title></head><body>";
+	for (int i = 0, n = 0; n < nodes; i++) {
+		ss << "<div class=\"figure\"><svg><g>";
+		for (int j = 0; j < 10; j++) {
+			ss << "<path d=\"M" << j << " 0\"/><circle r=\"" << j << "\"/>";
+		}
+		ss << "</g></svg><script>var x = " << i << ";</script></div>";
+		n += 27;
+	}
+	ss << "<div id=\"comments\">";
+	for (int i = 0; i < 100; i++) {
+		ss << "<article class=\"comment\"><span class=\"author\">User " << i << "</span>";
+		ss << "<p class=\"body\">Comment <a href=\"/u/" << i << "\">link</a></p></article>";
+	}
+	ss << "</div></body></html>";
+	return ss.str();
+}
+
+// Generates a table with the given number of rows in a single tbody,
+// every 1000th of which is highlighted
+static string generateWide(int rows)
+{
+	stringstream ss;
+	ss << "<html><head><title>Benchmark</title></head><body><table><tbody>";
+	for (int i = 0; i < rows; i++) {
+		ss << "\n<tr" << (i % 1000 == 999 ? " class=\"highlight\"" : "") << "><td>" << i << "</td></tr>";
+	}
+	ss << "</tbody></table></body></html>";
+	return ss.str();
+}
+
+// Runs a function repeatedly and returns the average time per run
+template <typename F>
+static double measure(F f, size_t *count)
+{
+	int runs = 0;
+	double start = now(), t;
+	do {
+		*count = f();
+		++runs;
+	} while ((t = now() - start) < 0.5);
+	return t / runs;
+}
+
+
+// Compares selection on htmlcxx trees with selection on flat documents
+struct TreeSelect
+{
+	TreeSelect(const tree<htmlcxx::HTML::Node> &dom, const char *expr) : dom(dom), expr(expr) { }
+	size_t operator()() const { return hcxselect::select(dom, expr).size(); }
+	const tree<htmlcxx::HTML::Node> &dom;
+	const char *expr;
+};
+
+struct FlatSelect
+{
+	FlatSelect(const hcxselect::FlatDocument &doc, const char *expr) : doc(doc), expr(expr) { }
+	size_t operator()() const { return doc.select(expr).size(); }
+	const hcxselect::FlatDocument &doc;
+	const char *expr;
+};
+
+// Selectors used for benchmarks on generated documents
+static const char *selectors[] = {
+	"div",
+	"p.text",
+	".s3.section",
+	"#s500",
+	"div.section p span",
+	"div.s3 ul a",
+	"body > div > h2",
+	"ul > li:nth-child(2) a",
+	"li + li",
+	"h2 ~ p",
+	"a[href$=\"-3.html\"]",
+	":empty",
+	NULL
+};
+
+static int benchFlat(int size)
+{
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	double start = now();
+	hcxselect::FlatDocument doc(dom);
+	cout << doc.size() << " nodes, snapshot built in " << (now() - start) * 1000 << " ms" << endl;
+
+	cout << setw(28) << left << "selector" << right << setw(10) << "matches"
+		<< setw(12) << "tree [ms]" << setw(12) << "flat [ms]" << setw(10) << "speedup" << endl;
+	for (const char **s = selectors; *s; ++s) {
+		size_t n1, n2;
+		double t1 = measure(TreeSelect(dom, *s), &n1);
+		double t2 = measure(FlatSelect(doc, *s), &n2);
+		cout << setw(28) << left << *s << right << setw(10) << n1
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t1 / t2 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	return 0;
+}
+// Compares selection on htmlcxx trees with and without subtree summaries
+struct SummarySelect
+{
+	SummarySelect(const hcxselect::SubtreeSummary &summary, const char *expr) : summary(summary), expr(expr) { }
+	size_t operator()() const { return summary.select(expr).size(); }
+	const hcxselect::SubtreeSummary &summary;
+	const char *expr;
+};
+
+static int benchSummary(int size)
+{
+	const char *selectors[] = {
+		"article.comment",
+		"#comments p.body",
+		"span.author",
+		"article > p a[href]",
+		"svg circle",
+		NULL
+	};
+
+	string source = generateSparse(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	double start = now();
+	hcxselect::SubtreeSummary summary(dom);
+	cout << summary.size() << " nodes, summary built in " << (now() - start) * 1000 << " ms" << endl;
+
+	cout << setw(28) << left << "selector" << right << setw(10) << "matches"
+		<< setw(12) << "tree [ms]" << setw(12) << "sum. [ms]" << setw(10) << "speedup" << endl;
+	for (const char **s = selectors; *s; ++s) {
+		size_t n1, n2;
+		double t1 = measure(TreeSelect(dom, *s), &n1);
+		double t2 = measure(SummarySelect(summary, *s), &n2);
+		cout << setw(28) << left << *s << right << setw(10) << n1
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t1 / t2 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	return 0;
+}
+
+
+// Compares selectors anchored at the root element with unanchored ones
+// that have the same matches
+static int benchAnchored(int size)
+{
+	const char *selectors[][2] = {
+		{":root > head > title", "head > title"},
+		{":root > head > meta", "head > meta"},
+		{":root > body > div > h2", "body > div > h2"},
+		{":root > body > div > ul li", "body > div > ul li"},
+		{NULL, NULL}
+	};
+
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	cout << setw(28) << left << "selector" << right << setw(10) << "matches" << setw(10) << "visited"
+		<< setw(12) << "tree [ms]" << setw(12) << "other [ms]" << setw(10) << "speedup" << endl;
+	for (int i = 0; selectors[i][0]; ++i) {
+		size_t n1, n2;
+		hcxselect::Statistics stats;
+		hcxselect::select(dom, selectors[i][0], &stats);
+		double t1 = measure(TreeSelect(dom, selectors[i][0]), &n1);
+		double t2 = measure(TreeSelect(dom, selectors[i][1]), &n2);
+		cout << setw(28) << left << selectors[i][0] << right << setw(10) << n1 << setw(10) << stats.nodesVisited
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t2 / t1 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	return 0;
+}
+
+
+// Compares the fast paths for trivial selectors with equivalent selectors
+// that are matched by the general engine
+static int benchTrivial(int size)
+{
+	const char *selectors[][2] = {
+		{"#s500", "[id=s500]"},
+		{".s3", "[class~=s3]"},
+		{"p", "html p"},
+		{"p.text", "p[class~=text]"},
+		{NULL, NULL}
+	};
+
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	cout << setw(28) << left << "selector" << right << setw(10) << "matches"
+		<< setw(12) << "fast [ms]" << setw(12) << "other [ms]" << setw(10) << "speedup" << endl;
+	for (int i = 0; selectors[i][0]; ++i) {
+		size_t n1, n2;
+		double t1 = measure(TreeSelect(dom, selectors[i][0]), &n1);
+		double t2 = measure(TreeSelect(dom, selectors[i][1]), &n2);
+		cout << setw(28) << left << selectors[i][0] << right << setw(10) << n1
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t2 / t1 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	return 0;
+}
+
+
+// Shows that sibling combinators scale linearly with the number of
+// children of a container
+static int benchSiblings(int size)
+{
+	const char *selectors[] = {
+		"tr ~ tr.highlight",
+		"tr.highlight ~ tr",
+		"tr.missing ~ tr",
+		"tr.highlight + tr",
+		NULL
+	};
+
+	cout << setw(24) << left << "selector" << right << setw(10) << "rows" << setw(10) << "matches"
+		<< setw(12) << "tree [ms]" << setw(12) << "flat [ms]" << setw(14) << "tree [ns/row]" << endl;
+	for (int rows = size / 4; rows <= size; rows *= 2) {
+		string source = generateWide(rows);
+		htmlcxx::HTML::ParserDom parser;
+		tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+		hcxselect::FlatDocument doc(dom);
+		for (int i = 0; selectors[i]; ++i) {
+			size_t n1, n2;
+			double t1 = measure(TreeSelect(dom, selectors[i]), &n1);
+			double t2 = measure(FlatSelect(doc, selectors[i]), &n2);
+			cout << setw(24) << left << selectors[i] << right << setw(10) << rows << setw(10) << n1
+				<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+				<< setw(14) << t1 * 1e9 / rows << (n1 != n2 ? " MISMATCH" : "") << endl;
+		}
+	}
+	return 0;
+}
+
+
+// Simulates components of a page template that repeatedly query the same
+// document, with and without a query cache
+struct Queries
+{
+	Queries(const tree<htmlcxx::HTML::Node> &dom, const char **exprs, bool cached) : dom(dom), exprs(exprs), cached(cached) { }
+	size_t operator()() const
+	{
+		hcxselect::QueryCache cache(dom);
+		size_t n = 0;
+		for (int k = 0; k < 4; ++k) {
+			for (int i = 0; exprs[i]; ++i) {
+				n += (cached ? cache.select(exprs[i]).size() : hcxselect::select(dom, exprs[i]).size());
+			}
+		}
+		return n;
+	}
+	const tree<htmlcxx::HTML::Node> &dom;
+	const char **exprs;
+	bool cached;
+};
+
+static int benchCache(int size)
+{
+	const char *exprs[] = {
+		"div.s3", "div.s3 h2", "div.s3 p", "div.s3 p span", "div.s3 ul > li",
+		"div.s3 ul > li a", "body > div", "body > div > h2", NULL
+	};
+
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	size_t n1, n2;
+	double t1 = measure(Queries(dom, exprs, false), &n1);
+	double t2 = measure(Queries(dom, exprs, true), &n2);
+	hcxselect::QueryCache cache(dom);
+	for (int k = 0; k < 4; ++k) {
+		for (int i = 0; exprs[i]; ++i) {
+			cache.select(exprs[i]);
+		}
+	}
+	const hcxselect::QueryCache::Statistics &stats = cache.statistics();
+	cout << "4 x " << (sizeof(exprs) / sizeof(exprs[0]) - 1) << " queries, " << n1 << " matches" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	cout << fixed << setprecision(2) << "uncached: " << t1 * 1000 << " ms, cached: " << t2 * 1000 << " ms, speedup "
+		<< t1 / t2 << "x" << endl;
+	cout << "hits " << stats.hits << ", prefix hits " << stats.prefixHits << ", misses " << stats.misses
+		<< ", hit rate " << stats.hitRate() * 100 << "%, " << cache.nodes() << " cached nodes" << endl;
+	return 0;
+}
+
+
+// Compares parsing and querying documents with mapping saved documents
+struct FlatIndices
+{
+	FlatIndices(const hcxselect::FlatDocument &doc, const char *expr) : doc(doc), expr(expr) { }
+	size_t operator()() const { std::vector<int> v; doc.select(expr, &v); return v.size(); }
+	const hcxselect::FlatDocument &doc;
+	const char *expr;
+};
+
+struct MappedSelect
+{
+	MappedSelect(const hcxselect::MappedDocument &doc, const char *expr) : doc(doc), expr(expr) { }
+	size_t operator()() const { std::vector<int> v; doc.select(expr, &v); return v.size(); }
+	const hcxselect::MappedDocument &doc;
+	const char *expr;
+};
+
+static int benchMapped(int size)
+{
+	const char *path = "bench-mapped.tmp";
+	string source = generate(size);
+
+	double start = now();
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	hcxselect::FlatDocument flat(dom);
+	double parsed = now() - start;
+
+	ofstream out(path, ios::binary);
+	flat.save(out);
+	out.close();
+	start = now();
+	hcxselect::MappedDocument doc;
+	if (!doc.open(path)) {
+		cerr << "Cannot map " << path << endl;
+		return 1;
+	}
+	cout << flat.size() << " nodes, parsed and built in " << parsed * 1000
+		<< " ms, mapped in " << (now() - start) * 1000 << " ms" << endl;
+
+	cout << setw(28) << left << "selector" << right << setw(10) << "matches"
+		<< setw(12) << "flat [ms]" << setw(12) << "map. [ms]" << setw(10) << "ratio" << endl;
+	for (const char **s = selectors; *s; ++s) {
+		size_t n1, n2;
+		double t1 = measure(FlatIndices(flat, *s), &n1);
+		double t2 = measure(MappedSelect(doc, *s), &n2);
+		cout << setw(28) << left << *s << right << setw(10) << n1
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t2 / t1 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	remove(path);
+	return 0;
+}
+
+
+// Compares scans of a mapped document without indexes using selectors
+// whose type, class and id are evaluated for blocks of nodes, and
+// equivalent selectors that hide them in :is() or attribute selectors so
+// that every node is tested. Build with CXXFLAGS=-mavx2 to compare AVX2
+// with the default instructions.
+static int benchBatch(int size)
+{
+	const char *selectors[][2] = {
+		{"li", ":is(li)"},
+		{"p.text", ":is(p)[class~=text]"},
+		{".s3.section", "[class~=s3][class~=section]"},
+		{"div#s500", ":is(div)[id=s500]"},
+		{"ul > li a", "ul > li :is(a)"},
+		{"div.s3 span.em", "div.s3 :is(span)[class~=em]"},
+		{NULL, NULL}
+	};
+
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	ostringstream out;
+	hcxselect::FlatDocument(dom).save(out, false);
+	string data = out.str();
+	hcxselect::MappedDocument doc;
+	doc.open(data.data(), data.length());
+
+#if defined(__AVX2__)
+	cout << "AVX2";
+#elif defined(__SSE2__)
+	cout << "SSE2";
+#else
+	cout << "Scalar";
+#endif
+	cout << " compares, " << doc.size() << " nodes" << endl;
+	cout << setw(28) << left << "selector" << right << setw(10) << "matches"
+		<< setw(12) << "batch [ms]" << setw(12) << "nodes [ms]" << setw(10) << "speedup" << endl;
+	for (int i = 0; selectors[i][0]; ++i) {
+		size_t n1, n2;
+		double t1 = measure(MappedSelect(doc, selectors[i][0]), &n1);
+		double t2 = measure(MappedSelect(doc, selectors[i][1]), &n2);
+		cout << setw(28) << left << selectors[i][0] << right << setw(10) << n1
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t2 / t1 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	return 0;
+}
+
+// Node traits for htmlcxx trees, for comparing the templated matcher
+// with the built-in tree access
+struct HtmlTraits : hcxselect::NodeTraits<HtmlTraits, hcxselect::Node *>
+{
+	static bool valid(hcxselect::Node *n) { return n != NULL; }
+	static bool same(hcxselect::Node *a, hcxselect::Node *b) { return a == b; }
+	static hcxselect::Node *parent(hcxselect::Node *n) { return n->parent; }
+	static hcxselect::Node *firstChild(hcxselect::Node *n) { return n->first_child; }
+	static hcxselect::Node *nextSibling(hcxselect::Node *n) { return n->next_sibling; }
+	static hcxselect::Node *prevSibling(hcxselect::Node *n) { return n->prev_sibling; }
+	static bool isTag(hcxselect::Node *n) { return n->data.isTag(); }
+	static bool isComment(hcxselect::Node *n) { return n->data.isComment(); }
+	static unsigned int length(hcxselect::Node *n) { return n->data.length(); }
+	static const char *tagName(hcxselect::Node *n) { return n->data.tagName().c_str(); }
+
+	static bool attribute(hcxselect::Node *n, const string &name, const char **value, size_t *length) {
+		n->data.parseAttributes();
+		map<string, string>::const_iterator it = n->data.attributes().find(name);
+		if (it == n->data.attributes().end()) {
+			return false;
+		}
+		*value = it->second.c_str();
+		*length = it->second.length();
+		return true;
+	}
+};
+
+struct CompiledSelect
+{
+	CompiledSelect(const tree<htmlcxx::HTML::Node> &dom, const hcxselect::CompiledSelector &selector) : dom(dom), selector(selector) { }
+	size_t operator()() const { return hcxselect::select(dom, selector).size(); }
+	const tree<htmlcxx::HTML::Node> &dom;
+	const hcxselect::CompiledSelector &selector;
+};
+
+struct TraitsSelect
+{
+	TraitsSelect(hcxselect::Node *root, const hcxselect::CompiledSelector &selector) : root(root), selector(selector) { }
+	size_t operator()() const {
+		vector<hcxselect::Node *> nodes;
+		hcxselect::select<HtmlTraits>(selector, root, &nodes);
+		return nodes.size();
+	}
+	hcxselect::Node *root;
+	const hcxselect::CompiledSelector &selector;
+};
+
+static int benchTraits(int size)
+{
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	tree<htmlcxx::HTML::Node>::iterator it = dom.begin();
+	while (it != dom.end() && strcasecmp(it->tagName().c_str(), "html")) ++it;
+
+	cout << setw(28) << left << "selector" << right << setw(10) << "matches"
+		<< setw(12) << "tree [ms]" << setw(12) << "traits [ms]" << setw(10) << "ratio" << endl;
+	for (const char **s = selectors; *s; ++s) {
+		hcxselect::CompiledSelector selector(*s);
+		size_t n1, n2;
+		double t1 = measure(CompiledSelect(dom, selector), &n1);
+		double t2 = measure(TraitsSelect(it.node, selector), &n2);
+		cout << setw(28) << left << *s << right << setw(10) << n1
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t1 / t2 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	return 0;
+}
+
+// Selects nodes by text by copying the text of every candidate
+struct CopyContains
+{
+	CopyContains(const tree<htmlcxx::HTML::Node> &dom, const string &source, const char *expr, const char *text)
+		: dom(dom), source(source), expr(expr), text(text) { }
+	size_t operator()() const {
+		hcxselect::NodeSet nodes = hcxselect::select(dom, expr);
+		size_t n = 0;
+		vector<char> buffer;
+		for (hcxselect::NodeSet::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+			buffer.resize((*it)->data.length() + 1);
+			size_t len = hcxselect::text(source.c_str(), *it, &buffer[0], buffer.size());
+			n += (string(&buffer[0], len).find(text) != string::npos);
+		}
+		return n;
+	}
+	const tree<htmlcxx::HTML::Node> &dom;
+	const string &source;
+	const char *expr, *text;
+};
+
+// Compares :contains() with copying and searching the text of candidates
+static int benchContains(int size)
+{
+	const char *selectors[][3] = {
+		{"p:contains(\"Paragraph 3\")", "p", "Paragraph 3"},
+		{"p:contains(\"3 text\")", "p", "3 text"},
+		{"li:contains(Link)", "li", "Link"},
+		{"div:contains(\"Section 4242\")", "div", "Section 4242"},
+		{"div:contains(\"ion 1\")", "div", "ion 1"},
+		{"*:contains(\"Section 4242\")", "*", "Section 4242"},
+		{NULL, NULL, NULL}
+	};
+
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	cout << setw(32) << left << "selector" << right << setw(10) << "matches"
+		<< setw(12) << "copy [ms]" << setw(12) << "scan [ms]" << setw(10) << "speedup" << endl;
+	for (int i = 0; selectors[i][0]; ++i) {
+		size_t n1, n2;
+		double t1 = measure(CopyContains(dom, source, selectors[i][1], selectors[i][2]), &n1);
+		double t2 = measure(TreeSelect(dom, selectors[i][0]), &n2);
+		cout << setw(32) << left << selectors[i][0] << right << setw(10) << n2
+			<< fixed << setprecision(2) << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+			<< setw(9) << t1 / t2 << "x" << (n1 != n2 ? " MISMATCH" : "") << endl;
+	}
+	return 0;
+}
+
+// Time spent on a corpus by one kind of tree, and the memory of the
+// largest tree right after building it
+struct CorpusCost
+{
+	CorpusCost() : build(0), query(0), release(0), memory(0), matches(0) { }
+	double build, query, release;
+	size_t memory, matches;
+};
+
+// Builds, queries and destroys an htmlcxx tree
+static void domCost(const string &source, const vector<hcxselect::CompiledSelector *> &selectors, CorpusCost *cost)
+{
+	vector<hcxselect::Node *> nodes;
+	size_t before = allocated;
+	double start = now();
+	htmlcxx::HTML::ParserDom *parser = new htmlcxx::HTML::ParserDom();
+	const tree<htmlcxx::HTML::Node> &dom = parser->parseTree(source);
+	double t1 = now();
+	cost->memory = max(cost->memory, allocated - before);
+	for (size_t i = 0; i < selectors.size(); ++i) {
+		nodes.clear();
+		hcxselect::selectInto(dom, *selectors[i], &nodes);
+		cost->matches += nodes.size();
+	}
+	double t2 = now();
+	delete parser;
+	double t3 = now();
+	cost->build += t1 - start;
+	cost->query += t2 - t1;
+	cost->release += t3 - t2;
+}
+
+// Builds, queries and destroys an arena tree
+static void arenaCost(const string &source, const vector<hcxselect::CompiledSelector *> &selectors, CorpusCost *cost)
+{
+	vector<const hcxselect::ArenaNode *> nodes;
+	size_t before = allocated;
+	double start = now();
+	hcxselect::ArenaDocument *doc = new hcxselect::ArenaDocument();
+	doc->parse(source);
+	double t1 = now();
+	cost->memory = max(cost->memory, allocated - before);
+	for (size_t i = 0; i < selectors.size(); ++i) {
+		nodes.clear();
+		doc->select(*selectors[i], &nodes);
+		cost->matches += nodes.size();
+	}
+	double t2 = now();
+	delete doc;
+	double t3 = now();
+	cost->build += t1 - start;
+	cost->query += t2 - t1;
+	cost->release += t3 - t2;
+}
+
+// Compares htmlcxx trees with arena trees on a corpus of generated
+// documents of different sizes and shapes
+static int benchArena(int size)
+{
+	vector<string> corpus;
+	size_t bytes = 0;
+	for (int i = 1; i <= 10; ++i) {
+		corpus.push_back(generate(size * i / 100));
+	}
+	corpus.push_back(generateSparse(size / 4));
+	corpus.push_back(generateWide(size / 8));
+	for (size_t i = 0; i < corpus.size(); ++i) {
+		bytes += corpus[i].length();
+	}
+
+	vector<hcxselect::CompiledSelector *> compiled;
+	for (const char **s = selectors; *s; ++s) {
+		compiled.push_back(new hcxselect::CompiledSelector(*s));
+	}
+
+	CorpusCost dom, arena;
+	for (size_t i = 0; i < corpus.size(); ++i) {
+		domCost(corpus[i], compiled, &dom);
+		arenaCost(corpus[i], compiled, &arena);
+	}
+	for (size_t i = 0; i < compiled.size(); ++i) {
+		delete compiled[i];
+	}
+
+	cout << corpus.size() << " documents, " << bytes / 1024 << " KiB, " << compiled.size() << " selectors each" << endl;
+	cout << setw(12) << left << "" << right << setw(12) << "build [ms]" << setw(12) << "query [ms]"
+		<< setw(12) << "free [ms]" << setw(12) << "total [ms]" << setw(14) << "tree [KiB]" << endl;
+	const char *names[] = {"ParserDom", "arena"};
+	const CorpusCost *costs[] = {&dom, &arena};
+	for (int i = 0; i < 2; ++i) {
+		const CorpusCost &c = *costs[i];
+		cout << setw(12) << left << names[i] << right << fixed << setprecision(2)
+			<< setw(12) << c.build * 1000 << setw(12) << c.query * 1000 << setw(12) << c.release * 1000
+			<< setw(12) << (c.build + c.query + c.release) * 1000 << setw(14) << c.memory / 1024 << endl;
+	}
+	cout << "speedup " << setprecision(2) << (dom.build + dom.query + dom.release) / (arena.build + arena.query + arena.release)
+		<< "x, memory " << (double)dom.memory / arena.memory << "x less"
+		<< (dom.matches != arena.matches ? " MISMATCH" : "") << endl;
+	return 0;
+}
+
+// Generates a list of rules resembling a content filter list, of which
+// only a few match documents from generate()
+static vector<string> generateRules(int count)
+{
+	vector<string> rules;
+	for (int i = 0; i < count; i++) {
+		stringstream ss;
+		switch (i % 16) {
+			case 0:
+				if (i % 1000 == 0) ss << "div.s" << (i / 1000 % 10) << " > h2";
+				else ss << ".ad-banner-" << i;
+				break;
+			case 1: case 2: case 3: case 4: ss << ".ad-" << i; break;
+			case 5: case 6: case 7: ss << "#sponsor-" << i; break;
+			case 8: ss << "div[id^=sponsor" << i << "]"; break;
+			case 9: ss << "a[href*=\"/ads/" << i << "\"]"; break;
+			case 10: ss << "div.s" << (i % 10) << " > p.promo" << i; break;
+			case 11: ss << "ul > li.sponsored-" << i << " a"; break;
+			case 12: ss << ".section:has(> .ad" << i << ")"; break;
+			default:
+				if (i % 800 == 13) ss << "[data-ad-" << i << "]";
+				else ss << "p.text span.ad-" << i;
+				break;
+		}
+		rules.push_back(ss.str());
+	}
+	return rules;
+}
+
+// Matches a large rule set in a single walk of a document, compared with
+// selecting rules one by one, and reports the memory used per rule
+static int benchRules(int size)
+{
+	vector<string> rules = generateRules(size);
+	string source = generate(20000);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	size_t before = allocated;
+	double start = now();
+	hcxselect::RuleSet ruleSet;
+	for (size_t i = 0; i < rules.size(); ++i) {
+		ruleSet.add(rules[i]);
+	}
+	double built = now() - start;
+	size_t memory = allocated - before;
+	cout << rules.size() << " rules built in " << fixed << setprecision(2) << built * 1000 << " ms ("
+		<< built * 1e6 / rules.size() << " us per rule), " << memory / 1024 << " KiB ("
+		<< memory / rules.size() << " bytes per rule)" << endl;
+
+	vector<hcxselect::RuleMatch> matches;
+	int runs = 0;
+	start = now();
+	do {
+		ruleSet.select(dom, &matches);
+		++runs;
+	} while (now() - start < 0.5);
+	double t1 = (now() - start) / runs;
+
+	// Selecting every rule on its own takes too long, so extrapolate
+	size_t sample = std::min(rules.size(), (size_t)400), n2 = 0;
+	start = now();
+	for (size_t i = 0; i < sample; ++i) {
+		n2 += hcxselect::select(dom, rules[i]).size();
+	}
+	double t2 = (now() - start) * rules.size() / sample;
+
+	cout << dom.size() << " nodes, " << matches.size() << " matches" << endl;
+	cout << setw(28) << left << "" << right << setw(12) << "set [ms]" << setw(12) << "each [ms]"
+		<< setw(10) << "speedup" << endl;
+	cout << setw(28) << left << "select" << right << setw(12) << t1 * 1000 << setw(12) << t2 * 1000
+		<< setw(9) << t2 / t1 << "x" << endl;
+	return 0;
+}
+
+
+// Prints the query plans for flat documents
+static int benchExplain(int size)
+{
+	string source = generate(size);
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	hcxselect::FlatDocument doc(dom);
+
+	for (const char **s = selectors; *s; ++s) {
+		cout << hcxselect::explain(*s, doc) << endl;
+	}
+	return 0;
+}
+
+
+// Available benchmarks
+struct Benchmark {
+	const char *name;
+	int (*fn)(int size);
+	int size;
+} benchmarks[] = {
+	{"flat", benchFlat, 1000000},
+	{"explain", benchExplain, 100000},
+	{"summary", benchSummary, 1000000},
+	{"anchored", benchAnchored, 200000},
+	{"trivial", benchTrivial, 200000},
+	{"mapped", benchMapped, 200000},
+	{"siblings", benchSiblings, 100000},
+	{"cache", benchCache, 200000},
+	{"batch", benchBatch, 200000},
+	{"rules", benchRules, 20000},
+	{"traits", benchTraits, 200000},
+	{"arena", benchArena, 200000},
+	{"contains", benchContains, 200000},
+	{NULL, NULL, 0}
+};
+
+
+// Program entry point
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		cerr << "Usage: " << *argv << " <benchmark> [size]" << endl;
+		cerr << "Available benchmarks:";
+		for (int i = 0; benchmarks[i].name; i++) {
+			cerr << " " << benchmarks[i].name;
+		}
+		cerr << endl;
+		return 1;
+	}
+
+	for (int i = 0; benchmarks[i].name; i++) {
+		if (!strcmp(argv[1], benchmarks[i].name)) {
+			return benchmarks[i].fn(argc > 2 ? atoi(argv[2]) : benchmarks[i].size);
+		}
+	}
+
+	cerr << "Unknown benchmark '" << argv[1] << "'" << endl;
+	return 1;
+}
@@ -28,49 +28,380 @@
  */
 
 
-#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <istream>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <htmlcxx/html/ParserDom.h>
 
 #include <hcxselect.h>
+#include <pipeline.h>
 
 using namespace std;
 
 
-// Pogram entry point
-int main(int argc, char **argv)
+// Command-line options
+struct Options
 {
-	if (argc < 2) {
-		cerr << "Usage: " << *argv << " <selector>" << endl;
-		return 1;
+	Options() : jobs(1), json(false), extract(false), stats(false)
+	{
+		stages[0] = stages[1] = stages[2] = 0;
 	}
 
-	// Read HTML source from stdin
-	string source((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+	vector<string> selectors;
+	vector<string> files;
+	int jobs;
+	int stages[3]; // Reader, parser and selector threads of the pipeline
+	bool json;
+	bool extract;
+	bool stats;
+};
 
-	htmlcxx::HTML::ParserDom parser;
-	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+// Work queue shared by all worker threads
+struct Queue
+{
+	const Options *opts;
+	size_t next;
+	int errors;
+	pthread_mutex_t mutex;
+};
+
+// Read-only memory mapping of a file
+class MappedFile
+{
+public:
+	MappedFile() : m_data(NULL), m_size(0) { }
+	~MappedFile() { if (m_size) munmap(m_data, m_size); }
 
-	hcxselect::Selector s(dom);
+	bool open(const string &path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		bool ok = (fstat(fd, &st) == 0);
+		if (ok && st.st_size > 0) {
+			m_data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (m_data != MAP_FAILED) {
+				m_size = st.st_size;
+				madvise(m_data, m_size, MADV_SEQUENTIAL);
+			} else {
+				ok = false;
+			}
+		}
+		int err = errno;
+		close(fd);
+		errno = err;
+		return ok;
+	}
+
+	const char *data() const { return (m_size ? (const char *)m_data : ""); }
+	size_t size() const { return m_size; }
+
+private:
+	void *m_data;
+	size_t m_size;
+};
+
+
+// Prints usage information
+static void usage(const char *program)
+{
+	cerr << "Usage: " << program << " [options] <selector> [file|directory...]" << endl;
+	cerr << "       " << program << " [options] -e <selector> [-e <selector>...] [file|directory...]" << endl;
+	cerr << endl;
+	cerr << "Reads HTML from the given files, searching directories recursively," << endl;
+	cerr << "or from stdin if no files are given or a file is named '-'." << endl;
+	cerr << endl;
+	cerr << "Options:" << endl;
+	cerr << "  -e <selector>  Add a selector (may be given multiple times)" << endl;
+	cerr << "  -j <n>         Process files using n worker threads" << endl;
+	cerr << "  -p <r>,<p>,<s> Process files in a pipeline with r reader, p parser" << endl;
+	cerr << "                 and s selector threads, writing results in file order" << endl;
+	cerr << "                 (files are copied into memory instead of being mapped)" << endl;
+	cerr << "  -s             Print pipeline throughput and utilization to stderr" << endl;
+	cerr << "  -J             Write JSON lines even when reading from stdin" << endl;
+	cerr << "  -x             Include the matching HTML in JSON lines" << endl;
+	cerr << endl;
+	cerr << "When reading from stdin only, matching HTML is written as-is." << endl;
+	cerr << "Otherwise, every match results in a JSON line containing the file" << endl;
+	cerr << "name, the selector and the offset and length of the match." << endl;
+}
+
+// Checks a selector for syntax errors
+static bool check(const string &expr)
+{
 	try {
-		s = s.select(argv[1]);
+		hcxselect::select(hcxselect::NodeSet(), expr);
 	} catch (hcxselect::ParseException &ex) {
-		cerr << "Parse error: '" << argv[1] << "': " << ex.what() << endl;
+		cerr << "Parse error: '" << expr << "': " << ex.what() << endl;
 		cerr << "              ";
 		for (int i = 1; i < ex.position(); i++) {
 			cerr << " ";
 		}
 		cerr << "^" << endl;
-		return 1;
+		return false;
 	} catch (...) {
-		cerr << "Error parsing '" << argv[1] << "'" << endl;
-		return 1;
+		cerr << "Error parsing '" << expr << "'" << endl;
+		return false;
+	}
+	return true;
+}
+
+// Adds a file or all files below a directory to the given list, in sorted
+// order of the names within each directory
+static bool collect(const string &path, vector<string> *files)
+{
+	struct stat st;
+	if (path == "-" || (stat(path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode))) {
+		files->push_back(path);
+		return true;
+	}
+
+	DIR *dir = opendir(path.c_str());
+	if (dir == NULL) {
+		cerr << "Error opening '" << path << "': " << strerror(errno) << endl;
+		return false;
+	}
+	vector<string> names;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+			names.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	sort(names.begin(), names.end());
+	bool ok = true;
+	for (size_t i = 0; i < names.size(); i++) {
+		if (!collect(path + "/" + names[i], files)) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// Writes a string as a quoted JSON string
+static void quote(ostream &out, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	out << '"';
+	for (const char *end = str + len; str < end; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if (c == '\n') {
+			out << "\\n";
+		} else if (c == '\t') {
+			out << "\\t";
+		} else if (c < 0x20) {
+			out << "\\u00" << hex[c >> 4] << hex[c & 0x0F];
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
+}
+
+// Writes a single match
+static void output(const string &name, const string &expr, const char *data, hcxselect::Node *node, const Options &opts, ostream &out)
+{
+	hcxselect::StringRef html = hcxselect::outerHtml(data, node);
+	if (!opts.json) {
+		out.write(html.data, html.length);
+		return;
+	}
+
+	out << "{\"file\":";
+	quote(out, name.c_str(), name.length());
+	out << ",\"selector\":";
+	quote(out, expr.c_str(), expr.length());
+	out << ",\"offset\":" << (html.data - data) << ",\"length\":" << html.length;
+	if (opts.extract) {
+		out << ",\"html\":";
+		quote(out, html.data, html.length);
+	}
+	out << "}\n";
+}
+
+// Applies all selectors to a single document
+static void process(const string &name, const char *data, size_t len, const Options &opts, ostream &out)
+{
+	htmlcxx::HTML::ParserDom parser;
+	parser.parse(data, data + len);
+	const tree<htmlcxx::HTML::Node> &dom = parser.getTree();
+
+	for (size_t i = 0; i < opts.selectors.size(); i++) {
+		hcxselect::Selection s(dom, opts.selectors[i]);
+		for (hcxselect::Selection::const_iterator it = s.begin(); it != s.end(); ++it) {
+			output(name, opts.selectors[i], data, *it, opts, out);
+		}
+	}
+}
+
+// Pipeline writing the matches of all files to stdout, in file order
+class OutputPipeline : public hcxselect::Pipeline
+{
+public:
+	OutputPipeline(const Options &opts)
+		: hcxselect::Pipeline(opts.selectors, opts.stages[0], opts.stages[1], opts.stages[2]), m_opts(opts) { }
+
+protected:
+	bool read(hcxselect::PipelineDocument &doc)
+	{
+		if (doc.name != "-") {
+			return hcxselect::Pipeline::read(doc);
+		}
+		doc.source.assign((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+		return true;
 	}
 
-	for (hcxselect::Selector::const_iterator it = s.begin(); it != s.end(); ++it) {
-		cout << source.substr((*it)->data.offset(), (*it)->data.length());
+	void consume(const hcxselect::PipelineDocument &doc)
+	{
+		if (doc.error) {
+			cerr << "Error processing '" << doc.name << "'" << endl;
+			return;
+		}
+		for (size_t i = 0; i < doc.matches.size(); i++) {
+			for (size_t j = 0; j < doc.matches[i].size(); j++) {
+				output(doc.name, m_opts.selectors[i], doc.source.data(), doc.matches[i][j], m_opts, cout);
+			}
+		}
 	}
-	return 0;
+
+private:
+	const Options &m_opts;
+};
+
+// Worker thread, processing files from the queue until it is empty
+static void *work(void *arg)
+{
+	Queue *queue = (Queue *)arg;
+	const Options &opts = *queue->opts;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->mutex);
+		size_t i = queue->next++;
+		pthread_mutex_unlock(&queue->mutex);
+		if (i >= opts.files.size()) {
+			break;
+		}
+
+		const string &file = opts.files[i];
+		stringstream out;
+		if (file == "-") {
+			// Read HTML source from stdin
+			string source((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+			process(file, source.data(), source.length(), opts, out);
+		} else {
+			MappedFile map;
+			if (!map.open(file)) {
+				pthread_mutex_lock(&queue->mutex);
+				cerr << "Error reading '" << file << "': " << strerror(errno) << endl;
+				queue->errors++;
+				pthread_mutex_unlock(&queue->mutex);
+				continue;
+			}
+			process(file, map.data(), map.size(), opts, out);
+		}
+
+		pthread_mutex_lock(&queue->mutex);
+		cout << out.rdbuf() << flush;
+		pthread_mutex_unlock(&queue->mutex);
+	}
+	return NULL;
+}
+
+// Pogram entry point
+int main(int argc, char **argv)
+{
+	Options opts;
+	int c;
+	while ((c = getopt(argc, argv, "e:j:p:sJxh")) != -1) {
+		switch (c) {
+			case 'e': opts.selectors.push_back(optarg); break;
+			case 'j': opts.jobs = max(1, atoi(optarg)); break;
+			case 'p':
+				if (sscanf(optarg, "%d,%d,%d", &opts.stages[0], &opts.stages[1], &opts.stages[2]) != 3) {
+					usage(*argv);
+					return 1;
+				}
+				break;
+			case 's': opts.stats = true; break;
+			case 'J': opts.json = true; break;
+			case 'x': opts.extract = true; break;
+			default: usage(*argv); return 1;
+		}
+	}
+
+	if (opts.selectors.empty()) {
+		if (optind >= argc) {
+			usage(*argv);
+			return 1;
+		}
+		opts.selectors.push_back(argv[optind++]);
+	}
+	for (size_t i = 0; i < opts.selectors.size(); i++) {
+		if (!check(opts.selectors[i])) {
+			return 1;
+		}
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (!collect(argv[i], &opts.files)) {
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		opts.json = true;
+	} else {
+		opts.files.push_back("-");
+	}
+
+	if (opts.stages[0] > 0) {
+		OutputPipeline pipeline(opts);
+		hcxselect::Pipeline::Statistics stats;
+		bool ok = pipeline.run(opts.files, &stats);
+		cout << flush;
+		if (opts.stats) {
+			cerr << stats.describe();
+		}
+		return (ok ? 0 : 1);
+	}
+
+	Queue queue;
+	queue.opts = &opts;
+	queue.next = 0;
+	queue.errors = 0;
+	pthread_mutex_init(&queue.mutex, NULL);
+
+	// Spread files across a pool of worker threads
+	vector<pthread_t> threads(min((size_t)opts.jobs, opts.files.size()) - 1);
+	for (size_t i = 0; i < threads.size(); i++) {
+		pthread_create(&threads[i], NULL, work, &queue);
+	}
+	work(&queue);
+	for (size_t i = 0; i < threads.size(); i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&queue.mutex);
+	return (queue.errors ? 1 : 0);
 }
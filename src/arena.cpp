@@ -0,0 +1,384 @@
+/*
+ * hcxselect - A CSS selector engine for htmlcxx
+ * Copyright (C) 2011 Jonas Gehring
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <strings.h>
+
+#include <htmlcxx/html/ParserSax.h>
+
+#include "arena.h"
+
+
+namespace hcxselect
+{
+
+// Anonymous namespace for local helpers
+namespace
+{
+
+// Alignment of all allocations from an arena
+const size_t Alignment = sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double);
+
+// Checks whether a tag name equals a lower-case name, ignoring case
+inline bool equals(const StringRef &s, const char *lower, size_t len)
+{
+	return s.length == len && !::strncasecmp(s.data, lower, len);
+}
+
+// Builds an arena tree from the events of the SAX parser. Elements are
+// opened and closed the way ParserDom does: an end tag closes the nearest
+// open element of the same name together with all elements opened after
+// it, and is ignored if there is none.
+class ArenaBuilder : public htmlcxx::HTML::ParserSax
+{
+public:
+	ArenaBuilder(Arena &arena, const char *source)
+		: top(NULL), root(NULL), size(0), m_arena(arena), m_source(source), m_current(NULL) { }
+
+	ArenaNode *top, *root;
+	int size;
+
+protected:
+	void beginParsing()
+	{
+		top = m_current = create(NULL, 0, 0, ArenaNode::Tag);
+	}
+
+	void foundTag(htmlcxx::HTML::Node node, bool isEnd)
+	{
+		StringRef name = tagName(node, isEnd);
+		if (isEnd) {
+			ArenaNode *n = m_current;
+			while (n->parent && !(n->tagName.length == name.length
+					&& !::strncasecmp(n->tagName.data, name.data, name.length))) {
+				n = n->parent;
+			}
+			if (n->parent) {
+				n->length = node.offset() + node.length() - n->offset;
+				m_current = n->parent;
+			}
+			return;
+		}
+
+		ArenaNode *n = create(m_current, node.offset(), node.length(), ArenaNode::Tag);
+		n->tagName = name;
+		parseAttributes(n);
+		if (!root && equals(name, "html", 4)) {
+			root = n;
+		}
+
+		// Elements that ParserDom does not keep open
+		const char *end = m_source + node.offset() + node.length();
+		bool closed = (name.length > 0 && name.data[0] == '!') || (node.length() >= 2 && end[-2] == '/')
+			|| equals(name, "br", 2) || equals(name, "img", 3) || equals(name, "meta", 4)
+			|| equals(name, "hr", 2) || equals(name, "input", 5) || equals(name, "link", 4);
+		if (!closed) {
+			m_current = n;
+		}
+	}
+
+	void foundText(htmlcxx::HTML::Node node)
+	{
+		create(m_current, node.offset(), node.length(), 0);
+	}
+
+	void foundComment(htmlcxx::HTML::Node node)
+	{
+		create(m_current, node.offset(), node.length(), ArenaNode::Comment);
+	}
+
+private:
+	// Appends a new node to the children of parent
+	ArenaNode *create(ArenaNode *parent, unsigned int offset, unsigned int length, unsigned char flags)
+	{
+		ArenaNode *n = static_cast<ArenaNode *>(m_arena.allocate(sizeof(ArenaNode)));
+		n->parent = parent;
+		n->firstChild = n->lastChild = n->nextSibling = NULL;
+		n->prevSibling = (parent ? parent->lastChild : NULL);
+		n->tagName = StringRef(m_source + offset, 0);
+		n->attributes = NULL;
+		n->attributeCount = 0;
+		n->offset = offset;
+		n->length = length;
+		n->flags = flags;
+		if (parent) {
+			(parent->lastChild ? parent->lastChild->nextSibling : parent->firstChild) = n;
+			parent->lastChild = n;
+		}
+		++size;
+		return n;
+	}
+
+	// Returns the tag name of a node, pointing into the source if it is
+	// found there and copied into the arena otherwise
+	StringRef tagName(const htmlcxx::HTML::Node &node, bool isEnd)
+	{
+		const std::string &name = node.tagName();
+		const char *s = m_source + node.offset() + (isEnd ? 2 : 1);
+		if (node.length() >= name.length() + (isEnd ? 2 : 1) && !memcmp(s, name.data(), name.length())) {
+			return StringRef(s, name.length());
+		}
+		char *copy = static_cast<char *>(m_arena.allocate(name.length() + 1));
+		memcpy(copy, name.c_str(), name.length() + 1);
+		return StringRef(copy, name.length());
+	}
+
+	// Splits the opening tag of an element into attributes like
+	// htmlcxx::HTML::Node::parseAttributes(), without copying them
+	void parseAttributes(ArenaNode *n)
+	{
+		const char *p = m_source + n->offset, *e = p + n->length;
+		if (p < e && *p == '<') ++p;
+		while (p < e && !isspace((unsigned char)*p) && *p != '>') ++p;
+
+		m_attributes.clear();
+		for (;;) {
+			while (p < e && isspace((unsigned char)*p)) ++p;
+			if (p >= e || *p == '>' || *p == '/') break;
+
+			ArenaAttribute a;
+			const char *k = p;
+			while (p < e && !isspace((unsigned char)*p) && *p != '=' && *p != '>') ++p;
+			a.name = StringRef(k, p - k);
+			while (p < e && isspace((unsigned char)*p)) ++p;
+			a.value = StringRef(p, 0);
+			if (p < e && *p == '=') {
+				++p;
+				while (p < e && isspace((unsigned char)*p)) ++p;
+				if (p < e && (*p == '"' || *p == '\'')) {
+					char q = *p++;
+					const char *v = p;
+					while (p < e && *p != q) ++p;
+					a.value = StringRef(v, p - v);
+					if (p < e) ++p;
+				} else {
+					const char *v = p;
+					while (p < e && !isspace((unsigned char)*p) && *p != '>') ++p;
+					a.value = StringRef(v, p - v);
+				}
+			}
+			m_attributes.push_back(a);
+		}
+
+		if (!m_attributes.empty()) {
+			n->attributeCount = m_attributes.size();
+			n->attributes = static_cast<ArenaAttribute *>(m_arena.allocate(n->attributeCount * sizeof(ArenaAttribute)));
+			std::copy(m_attributes.begin(), m_attributes.end(), n->attributes);
+		}
+	}
+
+	Arena &m_arena;
+	const char *m_source;
+	ArenaNode *m_current;
+	std::vector<ArenaAttribute> m_attributes;
+};
+
+} // anonymous namespace
+
+
+// Header of a block of an arena, followed by its memory
+struct Arena::Block
+{
+	Block *next;
+	size_t size;
+};
+
+/*!
+ * Constructs an empty arena.
+ *
+ * \param blockSize The size of the blocks that are reserved when the
+ *        current block is exhausted. Larger allocations get a block of
+ *        their own.
+ */
+Arena::Arena(size_t blockSize)
+	: m_blocks(NULL), m_ptr(NULL), m_end(NULL), m_blockSize(blockSize), m_capacity(0)
+{
+}
+
+/*!
+ * Destructor, releasing all memory.
+ */
+Arena::~Arena()
+{
+	clear();
+}
+
+/*!
+ * Returns uninitialized memory that stays valid until the arena is
+ * cleared. The memory is suitably aligned for pointers and numbers.
+ *
+ * \param size Number of bytes
+ */
+void *Arena::allocate(size_t size)
+{
+	size = (size + Alignment - 1) & ~(Alignment - 1);
+	if ((size_t)(m_end - m_ptr) < size) {
+		size_t n = std::max(size, m_blockSize);
+		Block *b = static_cast<Block *>(::operator new(sizeof(Block) + Alignment + n));
+		b->next = m_blocks;
+		b->size = n;
+		m_blocks = b;
+		m_capacity += n;
+		m_ptr = reinterpret_cast<char *>(b) + ((sizeof(Block) + Alignment - 1) & ~(Alignment - 1));
+		m_end = m_ptr + n;
+	}
+	void *p = m_ptr;
+	m_ptr += size;
+	return p;
+}
+
+/*!
+ * Releases all memory of the arena.
+ */
+void Arena::clear()
+{
+	while (m_blocks) {
+		Block *b = m_blocks;
+		m_blocks = b->next;
+		::operator delete(b);
+	}
+	m_ptr = m_end = NULL;
+	m_capacity = 0;
+}
+
+
+/*!
+ * Returns the value of an attribute, or NULL if the element does not
+ * have it. As with htmlcxx, the name is expected in lower case, and the
+ * last of several attributes of the same name wins.
+ *
+ * \param name The lower-case attribute name
+ */
+const StringRef *ArenaNode::attribute(const std::string &name) const
+{
+	for (unsigned int i = attributeCount; i-- > 0; ) {
+		const StringRef &s = attributes[i].name;
+		if (s.length != name.length()) {
+			continue;
+		}
+		size_t j = 0;
+		while (j < s.length && ::tolower((unsigned char)s.data[j]) == name[j]) ++j;
+		if (j == s.length) {
+			return &attributes[i].value;
+		}
+	}
+	return NULL;
+}
+
+
+/*!
+ * Constructs an empty document.
+ */
+ArenaDocument::ArenaDocument()
+	: m_top(NULL), m_root(NULL), m_size(0)
+{
+}
+
+/*!
+ * Destructor.
+ */
+ArenaDocument::~ArenaDocument()
+{
+}
+
+/*!
+ * Parses a document, replacing the current tree.
+ *
+ * \param source The HTML source, which must outlive the tree
+ */
+void ArenaDocument::parse(const std::string &source)
+{
+	parse(source.data(), source.length());
+}
+
+/*!
+ * Parses a document, replacing the current tree.
+ *
+ * \param source The HTML source, which must outlive the tree
+ * \param length The length of the source
+ */
+void ArenaDocument::parse(const char *source, size_t length)
+{
+	clear();
+	ArenaBuilder builder(m_arena, source);
+	builder.parse(source, source + length);
+	m_top = builder.top;
+	m_root = builder.root;
+	m_size = builder.size;
+}
+
+/*!
+ * Releases the tree.
+ */
+void ArenaDocument::clear()
+{
+	m_arena.clear();
+	m_top = m_root = NULL;
+	m_size = 0;
+}
+
+/*!
+ * Appends the nodes matching a selector expression to a list, in
+ * document order. As for trees, only the first <html> element and its
+ * descendants are considered.
+ *
+ * \param expr The selector expression
+ * \param result The list of matching nodes
+ * \param stats Optional statistics for this query
+ */
+void ArenaDocument::select(const std::string &expr, std::vector<const ArenaNode *> *result, Statistics *stats) const
+{
+	select(CompiledSelector(expr), result, stats);
+}
+
+/*!
+ * Appends the nodes matching a compiled selector to a list, in document
+ * order.
+ *
+ * \param selector The compiled selector
+ * \param result The list of matching nodes
+ * \param stats Optional statistics for this query
+ */
+void ArenaDocument::select(const CompiledSelector &selector, std::vector<const ArenaNode *> *result, Statistics *stats) const
+{
+	if (m_root) {
+		hcxselect::select<ArenaTraits>(selector, m_root, result, stats);
+	} else if (stats) {
+		stats->clear();
+	}
+}
+
+} // namespace hcxselect
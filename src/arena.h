@@ -0,0 +1,215 @@
+/*
+ * hcxselect - A CSS selector engine for htmlcxx
+ * Copyright (C) 2011 Jonas Gehring
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef HCXSELECT_ARENA_H_
+#define HCXSELECT_ARENA_H_
+
+#include <string>
+#include <vector>
+
+#include "hcxselect.h"
+#include "matcher.h"
+
+
+namespace hcxselect
+{
+
+/*!
+ * Region allocator. Memory is taken from large blocks in order and is
+ * only released all at once, by clear() or by the destructor.
+ */
+class Arena
+{
+public:
+	Arena(size_t blockSize = 65536);
+	~Arena();
+
+	void *allocate(size_t size);
+	void clear();
+
+	/*!
+	 * Returns the number of bytes reserved by all blocks.
+	 */
+	size_t capacity() const { return m_capacity; }
+
+private:
+	Arena(const Arena &);
+	Arena &operator=(const Arena &);
+
+	struct Block;
+	Block *m_blocks;
+	char *m_ptr, *m_end;
+	size_t m_blockSize;
+	size_t m_capacity;
+};
+
+/*!
+ * Attribute of an ArenaNode. Name and value point into the source the
+ * document has been parsed from. The name is in its original case, and
+ * the value is the raw text between the quotes.
+ */
+struct ArenaAttribute
+{
+	StringRef name;  //!< Attribute name
+	StringRef value; //!< Attribute value, empty if there is none
+};
+
+/*!
+ * Node of an ArenaDocument. Elements, text and comments are represented
+ * like the nodes of an htmlcxx tree, including an unnamed element at the
+ * top.
+ */
+struct ArenaNode
+{
+	enum Flags
+	{
+		Tag = 0x01,    //!< Node is an element
+		Comment = 0x02 //!< Node is a comment
+	};
+
+	bool isTag() const { return flags & Tag; }
+	bool isComment() const { return flags & Comment; }
+
+	const StringRef *attribute(const std::string &name) const;
+
+	ArenaNode *parent;       //!< Parent node, or NULL
+	ArenaNode *firstChild;   //!< First child, or NULL
+	ArenaNode *lastChild;    //!< Last child, or NULL
+	ArenaNode *prevSibling;  //!< Previous sibling, or NULL
+	ArenaNode *nextSibling;  //!< Next sibling, or NULL
+	StringRef tagName;       //!< Tag name of elements, or an empty reference to the start of other nodes in the source
+	ArenaAttribute *attributes; //!< Attributes of elements, in source order
+	unsigned int attributeCount; //!< Number of attributes
+	unsigned int offset;     //!< Offset of the node in the source
+	unsigned int length;     //!< Length of the node in the source
+	unsigned char flags;     //!< Node flags (see Flags)
+};
+
+/*!
+ * HTML tree built from the events of htmlcxx's SAX parser, as an
+ * alternative to the tree of htmlcxx::HTML::ParserDom. All nodes and
+ * attribute lists are placed in an Arena owned by the document, and tag
+ * names and attributes point into the source instead of being copied, so
+ * building the tree needs few allocations and destroying it is a matter
+ * of releasing a few blocks. The source must therefore outlive the
+ * document. The tree has the same shape as the one built by ParserDom and
+ * is queried through ArenaTraits.
+ */
+class ArenaDocument
+{
+public:
+	ArenaDocument();
+	~ArenaDocument();
+
+	void parse(const std::string &source);
+	void parse(const char *source, size_t length);
+	void clear();
+
+	/*!
+	 * Returns the unnamed element at the top of the tree, or NULL if
+	 * nothing has been parsed.
+	 */
+	const ArenaNode *top() const { return m_top; }
+
+	/*!
+	 * Returns the first <html> element, or NULL.
+	 */
+	const ArenaNode *root() const { return m_root; }
+
+	/*!
+	 * Returns the number of nodes in the document.
+	 */
+	int size() const { return m_size; }
+
+	/*!
+	 * Returns the number of bytes reserved for the tree.
+	 */
+	size_t memory() const { return m_arena.capacity(); }
+
+	void select(const std::string &expr, std::vector<const ArenaNode *> *result, Statistics *stats = NULL) const;
+	void select(const CompiledSelector &selector, std::vector<const ArenaNode *> *result, Statistics *stats = NULL) const;
+
+private:
+	ArenaDocument(const ArenaDocument &);
+	ArenaDocument &operator=(const ArenaDocument &);
+
+	Arena m_arena;
+	ArenaNode *m_top;
+	ArenaNode *m_root;
+	int m_size;
+};
+
+/*!
+ * Node traits for matching selectors against an ArenaDocument, e.g.
+ * using hcxselect::matches<ArenaTraits>(). Tag and attribute names are
+ * compared in place, as htmlcxx would compare them after parsing.
+ */
+struct ArenaTraits : NodeTraits<ArenaTraits, const ArenaNode *>
+{
+	static inline bool valid(const ArenaNode *n) { return n != NULL; }
+	static inline bool same(const ArenaNode *a, const ArenaNode *b) { return a == b; }
+	static inline const ArenaNode *parent(const ArenaNode *n) { return n->parent; }
+	static inline const ArenaNode *firstChild(const ArenaNode *n) { return n->firstChild; }
+	static inline const ArenaNode *nextSibling(const ArenaNode *n) { return n->nextSibling; }
+	static inline const ArenaNode *prevSibling(const ArenaNode *n) { return n->prevSibling; }
+	static inline bool isTag(const ArenaNode *n) { return n->flags & ArenaNode::Tag; }
+	static inline bool isComment(const ArenaNode *n) { return n->flags & ArenaNode::Comment; }
+	static inline unsigned int length(const ArenaNode *n) { return n->length; }
+
+	static inline bool hasTag(const ArenaNode *n, const char *tag) {
+		size_t len = n->tagName.length;
+		return !::strncasecmp(n->tagName.data, tag, len) && tag[len] == '\0';
+	}
+
+	static inline bool sameTag(const ArenaNode *a, const ArenaNode *b) {
+		return a->tagName.length == b->tagName.length
+			&& !::strncasecmp(a->tagName.data, b->tagName.data, a->tagName.length);
+	}
+
+	static inline bool text(const ArenaNode *n, const char **text, size_t *length) {
+		*text = n->tagName.data;
+		*length = n->length;
+		return true;
+	}
+
+	static inline bool attribute(const ArenaNode *n, const std::string &name, const char **value, size_t *length) {
+		const StringRef *v = n->attribute(name);
+		if (!v) {
+			return false;
+		}
+		*value = v->data;
+		*length = v->length;
+		return true;
+	}
+};
+
+} // namespace hcxselect
+
+#endif // HCXSELECT_ARENA_H_
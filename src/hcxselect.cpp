@@ -28,11 +28,30 @@
  */
 
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <ostream>
 #include <stack>
 #include <sstream>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+ #include <immintrin.h>
+#elif defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
+
 #include "hcxselect.h"
+#include "matcher.h"
 
 extern "C" {
 	#include "lexer.h"
@@ -48,6 +67,8 @@ inline void TRACE(...) { }
 namespace hcxselect
 {
 
+using namespace detail;
+
 // Anonymous namespace for local helpers
 namespace
 {
@@ -91,15 +112,6 @@ inline bool ends_with(const std::string &str, const std::string &end)
 	return false;
 }
 
-// Delete all elements of a container
-template<typename T>
-inline void delete_all(const T &v)
-{
-	for (typename T::const_iterator it = v.begin(); it != v.end(); ++it) {
-		delete *it;
-	}
-}
-
 // String to number
 template <class T> inline bool stoi(T *t, const std::string& s)
 {
@@ -111,8 +123,8 @@ template <class T> inline bool stoi(T *t, const std::string& s)
 class Lexer
 {
 public:
-	Lexer(const std::string &str)
-		: pos(0), spos(0)
+	Lexer(const std::string &str, const Limits *limits = NULL)
+		: pos(0), spos(0), steps(0), classes(0), limits(limits), complexity(0), depth(0)
 	{
 		yylex_init(&yy);
 		yy_scan_string(str.c_str(), yy);
@@ -163,319 +175,86 @@ public:
 		return token;
 	}
 
-	yyscan_t yy;
-	int pos, spos;
-};
-
-namespace Selectors
-{
-
-// Abstract base class for selector functions
-struct SelectorFn
-{
-	typedef tree<HTMLNode>::iterator NodeIt;
-
-	virtual ~SelectorFn() { }
-	virtual bool match(const NodeIt &it) const = 0;
-
-protected:
-	inline static bool hasParent(const NodeIt &it) {
-		return (it.node->parent == NULL || strcasecmp(it->tagName(), "html"));
-	}
-};
-
-// Universal selector (*)
-struct Universal : SelectorFn
-{
-	bool match(const NodeIt &it) const
-	{
-		return it->isTag();
-	}
-};
-
-// Type selector (E)
-struct Type : SelectorFn
-{
-	Type(const std::string &type) : type(type) { }
-
-	bool match(const NodeIt &it) const
-	{
-		return (it->isTag() && !strcasecmp(it->tagName(), type));
-	}
-
-	std::string type;
-};
-
-// Attribute selector (E[foo])
-struct Attribute : SelectorFn
-{
-	Attribute(const std::string &attr) : attr(attr) { }
-
-	bool match(const NodeIt &it) const
-	{
-		if (it->attributes().empty()) it->parseAttributes();
-		return it->attribute(attr).first;
-	}
-
-	std::string attr;
-};
-
-// Attribute value, with optional comparison operator (E[foo=bar])
-struct AttributeValue : SelectorFn
-{
-	AttributeValue(const std::string &attr, const std::string &value, char c = '=')
-		: attr(attr), value(value), c(c) { }
-
-	bool match(const NodeIt &it) const
+	// Accounts for simple selectors or combinators
+	inline void count(unsigned int n)
 	{
-		if (value.empty() && c != '=') return false;
-
-		if (it->attributes().empty()) it->parseAttributes();
-		const std::string &str = it->attribute(attr).second;
-		switch (c) {
-			case '=': return !strcasecmp(str, value);
-			case '^': return starts_with(str, value);
-			case '$': return ends_with(str, value);
-			case '*': return (str.find(value) != std::string::npos);
-			case '|': return !(strcasecmp(str, value) && !starts_with(str, value + "-"));
-			case '~': {
-				// Split string by space and compare every part
-				const char *ptr = str.c_str(), *last = str.c_str();
-				const char *end = str.c_str() + str.length();
-				int l = value.length();
-				while (ptr < end) {
-					while (*ptr && !isspace(*ptr)) ++ptr;
-					if ((ptr - last) == l && !::strncasecmp(value.c_str(), last, l)) {
-						return true;
-					}
-					while (*ptr && isspace(*ptr)) ++ptr;
-					last = ptr;
-				}
-				return false;
-			}
-			default: break;
+		complexity += n;
+		if (limits && limits->maxComplexity && complexity > limits->maxComplexity) {
+			throw LimitException(LimitException::Complexity);
 		}
-		return true;
 	}
 
-	std::string attr;
-	std::string value;
-	char c;
-};
-
-// Pseudo class or element
-struct Pseudo : SelectorFn
-{
-	Pseudo(const std::string &type, int an = 0, int b = 0)
-		: type(type), an(an), b(b) { }
-
-	bool checkNum(int i) const 
+	// Enters a nested selector list
+	inline void enter()
 	{
-		if (an == 0) {
-			return (i == b);
+		++depth;
+		if (limits && limits->maxNesting && depth > limits->maxNesting) {
+			throw LimitException(LimitException::Nesting);
 		}
-		return (((i - b) % an) == 0);
 	}
 
-	bool matchs(const NodeIt &it, const std::string &type) const
-	{
-		if (type == "root") {
-			return !hasParent(it);
-		} else if (type == "first-child") {
-			if (!hasParent(it)) return false;
-			NodeIt jt(it.node->parent->first_child);
-			while (jt.node && !jt->isTag()) {
-				jt = jt.node->next_sibling;
-			}
-			return (jt.node == it.node);
-		} else if (type == "last-child") {
-			if (!hasParent(it)) return false;
-			NodeIt jt(it.node->parent->last_child);
-			while (jt.node && !jt->isTag()) {
-				jt = jt.node->prev_sibling;
-			}
-			return (jt.node == it.node);
-		} else if (type == "first-of-type") {
-			if (!hasParent(it)) return false;
-			NodeIt jt(it.node->parent->first_child);
-			while (jt.node && (!jt->isTag() || strcasecmp(jt->tagName(), it->tagName()))) {
-				jt = jt.node->next_sibling;
-			}
-			return (jt.node == it.node);
-		} else if (type == "last-of-type") {
-			if (!hasParent(it)) return false;
-			NodeIt jt(it.node->parent->last_child);
-			while (jt.node && (!jt->isTag() || strcasecmp(jt->tagName(), it->tagName()))) {
-				jt = jt.node->prev_sibling;
-			}
-			return (jt.node == it.node);
-		} else if (type == "empty") {
-			if (it->isTag()) {
-				return (it.node->first_child == NULL ||
-						(it.node->first_child->data.isComment() && it.node->first_child == it.node->last_child));
-			}
-			return (it->isComment() || it->length() == 0);
-		} else if (type == "nth-child") {
-			if (!hasParent(it)) return false;
-			int i = 1;
-			NodeIt jt(it.node->parent->first_child);
-			while (jt.node && it.node != jt.node) {
-				if (jt->isTag()) ++i;
-				jt = jt.node->next_sibling;
-			}
-			return checkNum(i);
-		} else if (type == "nth-last-child") {
-			if (!hasParent(it)) return false;
-			int i = 1;
-			NodeIt jt(it.node->parent->last_child);
-			while (jt.node && it.node != jt.node) {
-				if (jt->isTag()) ++i;
-				jt = jt.node->prev_sibling;
-			}
-			return checkNum(i);
-		} else if (type == "nth-of-type") {
-			if (!hasParent(it)) return false;
-			int i = 1;
-			NodeIt jt(it.node->parent->first_child);
-			while (jt.node && it.node != jt.node) {
-				if (jt->isTag() && !strcasecmp(jt->tagName(), it->tagName())) ++i;
-				jt = jt.node->next_sibling;
-			}
-			return checkNum(i);
-		} else if (type == "nth-last-of-type") {
-			if (!hasParent(it)) return false;
-			int i = 1;
-			NodeIt jt(it.node->parent->last_child);
-			while (jt.node && it.node != jt.node) {
-				if (jt->isTag() && !strcasecmp(jt->tagName(), it->tagName())) ++i;
-				jt = jt.node->prev_sibling;
-			}
-			return checkNum(i);
-		} else if (type == "text") {
-			return (!it->isTag() && !it->isComment());
-		} else if (type == "comment") {
-			return it->isComment();
-		}
-		return false;
-	}
+	inline void leave() { --depth; }
 
-	bool match(const NodeIt &it) const
-	{
-		if (type == "only-child") {
-			return matchs(it, "first-child") && matchs(it, "last-child");
-		} else if (type == "only-of-type") {
-			return matchs(it, "first-of-type") && matchs(it, "last-of-type");
-		}
-		return matchs(it, type);
-	}
+	yyscan_t yy;
+	int pos, spos;
+	int steps; // Number of simple selector sequences parsed so far
+	int classes; // Number of class selectors parsed so far
 
-	std::string type;
-	int an, b;
+	const Limits *limits;
+	unsigned int complexity; // Number of simple selectors and combinators
+	unsigned int depth; // Current nesting depth of selector lists
 };
 
-// Negation (:not)
-struct Negation : SelectorFn
-{
-	Negation(SelectorFn *fn) : fn(fn) { }
-	~Negation() { delete fn; }
-
-	bool match(const NodeIt &it) const
-	{
-		return !fn->match(it);
-	}
 
-	SelectorFn *fn;
-};
+SelectorFn *parseSelector(Lexer *l, int &token, std::string &s);
 
-// A simple selector sequence
-struct SimpleSequence : SelectorFn
+// Splits a parsed selector into the chain of relative selectors used by
+// :has(). The leftmost sequence is related to the anchor by c, and every
+// following sequence to the previous one by its combinator.
+Selectors::Relative *relativeChain(SelectorFn *fn, char c, Selectors::Relative *next = NULL)
 {
-	SimpleSequence(const std::vector<SelectorFn *> &fns) : fns(fns) { }
-	~SimpleSequence() { delete_all(fns); }
-
-	bool match(const NodeIt &it) const
-	{
-		std::vector<SelectorFn *>::const_iterator ft(fns.begin());
-		std::vector<SelectorFn *>::const_iterator end(fns.end());
-		while (ft != end && (*ft)->match(it)) {
-			++ft;
-		}
-		return (ft == end);
+	if (fn->variant != SelectorFn::CombinatorFn) {
+		return new Selectors::Relative(fn, c, next);
 	}
+	Selectors::Combinator *comb = static_cast<Selectors::Combinator *>(fn);
+	SelectorFn *left = comb->left;
+	next = new Selectors::Relative(comb->right, comb->c, next);
+	comb->left = comb->right = NULL;
+	delete comb;
+	return relativeChain(left, c, next);
+}
 
-	std::vector<SelectorFn *> fns;
-};
-
-// Combinator ( , >, ~, +)
-struct Combinator : SelectorFn
+// Parses a comma-separated list of selectors up to a closing parenthesis.
+// If relative is true, each selector may start with a combinator.
+SelectorFn *parseSelectorList(Lexer *l, int &token, std::string &s, bool relative)
 {
-	Combinator(SelectorFn *left, SelectorFn *right, char c) : left(left), right(right), c(c) { }
-	~Combinator() { delete left; delete right; }
-
-	bool match(const NodeIt &it) const
-	{
-		// First, check if the node matches the right side of the combinator
-		if (!right->match(it)) {
-			return false;
-		}
-
-		// Check all suitable neighbor nodes using the left selector
-		NodeIt jt;
-		switch (c) {
-			case ' ': // Descendant
-			case '*': // Greatchild or further descendant
-				if (!hasParent(it)) return false;
-				jt = it.node->parent;
-				if (c == '*' && jt.node) {
-					jt = jt.node->parent;
-				}
-				while (jt.node) {
-					if (left->match(jt)) {
-						return true;
-					}
-					jt = jt.node->parent;
-				}
-				return false;
-
-			case '>': // Child
-				if (!hasParent(it)) return false;
-				jt = it.node->parent;
-				return jt.node && left->match(jt);
-
-			case '+': // Adjacent sibling
-				if (!hasParent(it)) return false;
-				jt = it.node->prev_sibling;
-				while (jt.node && !jt->isTag()) {
-					jt = jt.node->prev_sibling;
-				}
-				return jt.node && left->match(jt);
-
-			case '~': // General sibling
-				if (!hasParent(it)) return false;
-				jt = it.node->prev_sibling;
-				while (jt.node) {
-					if (jt->isTag() && left->match(jt)) {
-						return true;
-					}
-					jt = jt.node->prev_sibling;
-				}
-				return false;
-
-			default: break;
+	std::vector<SelectorFn *> fns;
+	while (true) {
+		if (token == S) token = l->lex(&s);
+		char c = ' ';
+		if (relative) {
+			switch (token) {
+				case PLUS: c = '+'; break;
+				case GREATER: c = '>'; break;
+				case TILDE: c = '~'; break;
+				default: break;
+			}
+			if (c != ' ') token = l->lex(&s);
 		}
+		ENSURE(token != ')' && token != COMMA && token != 0, "Selector expected");
 
-		return false;
+		SelectorFn *fn = parseSelector(l, token, s);
+		fns.push_back(relative ? relativeChain(fn, c) : fn);
+		if (token != COMMA) break;
+		token = l->lex(&s);
 	}
+	ENSURE(token == ')', "')' expected");
 
-	SelectorFn *left, *right;
-	char c;
-};
-
-} // namespace Selectors
-
-using Selectors::SelectorFn;
-
-SelectorFn *parseSelector(Lexer *l, int &token, std::string &s);
+	if (fns.size() == 1) {
+		return fns[0];
+	}
+	return new Selectors::MatchesAny(fns);
+}
 
 // Tries to parse a simple selector
 SelectorFn *parseSimpleSequence(Lexer *l, int &token, std::string &s)
@@ -503,7 +282,7 @@ SelectorFn *parseSimpleSequence(Lexer *l, int &token, std::string &s)
 			token = l->lex(&s);
 			ENSURE(token == IDENT, "Identifier expected");
 			TRACE("%d: %s\n", token, s.c_str());
-			fns.push_back(new Selectors::AttributeValue("class", s, '~'));
+			fns.push_back(new Selectors::Class(s, l->classes++));
 			break;
 		case '[': {
 			token = l->lex(&s);
@@ -548,6 +327,25 @@ SelectorFn *parseSimpleSequence(Lexer *l, int &token, std::string &s)
 				fns.push_back(new Selectors::Pseudo(s));
 			} else if (token == FUNCTION) {
 				std::string f(s.substr(0, s.length()-1));
+				if (f == "is" || f == "where" || f == "has") {
+					token = l->lex(&s);
+					l->enter();
+					fns.push_back(parseSelectorList(l, token, s, f == "has"));
+					l->leave();
+					break;
+				}
+				if (f == "contains" || f == "icontains") {
+					token = l->lex(&s);
+					if (token == S) token = l->lex(&s);
+					ENSURE(token == STRING || token == IDENT, "Token is neither string nor identifier");
+					std::string v = (token == STRING ? s.substr(1, s.length()-2) : s);
+					token = l->lex(&s);
+					if (token == S) token = l->lex(&s);
+					ENSURE(token == ')', "')' expected");
+					fns.push_back(new Selectors::Pseudo(f, v));
+					break;
+				}
+
 				int an = 0, b = 0;
 				token = l->lex(&s);
 				if (token == S) token = l->lex(&s);
@@ -599,11 +397,13 @@ SelectorFn *parseSimpleSequence(Lexer *l, int &token, std::string &s)
 		}
 		case NOT: {
 			token = l->lex(&s);
+			l->enter();
 			fns.push_back(new Selectors::Negation(parseSelector(l, token, s)));
+			l->leave();
 			ENSURE(token == ')', "')' expected");
 			break;
 		}
-		case ')': // For negations
+		case ')': // For negations and selector lists
 		default: goto finish;
 		}
 
@@ -614,7 +414,8 @@ SelectorFn *parseSimpleSequence(Lexer *l, int &token, std::string &s)
 	}
 
 finish:
-	return new Selectors::SimpleSequence(fns);
+	l->count(fns.size());
+	return new Selectors::SimpleSequence(fns, l->steps++);
 }
 
 // Recursive parsing function
@@ -629,6 +430,7 @@ SelectorFn *parseSelector(Lexer *l, int &token, std::string &s)
 		if (token == S) {
 			space = true;
 			token = l->lex(&s);
+			if (token == ')') return fn;
 		}
 		TRACE("%d: %s\n", token, s.c_str());
 
@@ -656,6 +458,7 @@ SelectorFn *parseSelector(Lexer *l, int &token, std::string &s)
 			if (token == S) token = l->lex(&s);
 		}
 		TRACE("%d: %s\n", token, s.c_str());
+		l->count(1);
 		SelectorFn *fn2 = parseSimpleSequence(l, token, s);
 		fn = new Selectors::Combinator(fn, fn2, c);
 	}
@@ -664,13 +467,13 @@ SelectorFn *parseSelector(Lexer *l, int &token, std::string &s)
 }
 
 // Parses a CSS selector expression and returns a set of functions
-std::vector<SelectorFn *> parse(const std::string &expr)
+std::vector<SelectorFn *> parse(const std::string &expr, int *steps = NULL, const Limits *limits = NULL)
 {
 	std::vector<SelectorFn *> fns;
 	int token;
 	std::string s;
 
-	Lexer l(trim(expr));
+	Lexer l(trim(expr), limits);
 	while ((token = l.lex(&s))) {
 		fns.push_back(parseSelector(&l, token, s));
 		if (token != COMMA && token != 0) {
@@ -678,138 +481,3322 @@ std::vector<SelectorFn *> parse(const std::string &expr)
 		}
 	}
 
+	if (steps) {
+		*steps = l.steps;
+	}
 	return fns;
 }
 
-// Matches a set of nodes against a selector
-NodeSet match(const NodeSet &nodes, const SelectorFn *fn)
+// Returns the end of the CSS name starting at p
+inline const char *scanName(const char *p)
 {
-	std::stack<tree<HTMLNode>::iterator> stack;
-	for (NodeSet::const_iterator it(nodes.begin()); it != nodes.end(); ++it) {
-		stack.push(tree<HTMLNode>::iterator(*it));
+	while (isalnum((unsigned char)*p) || *p == '_' || *p == '-') ++p;
+	return p;
+}
+
+// Returns the end of the CSS identifier starting at p, or p if there is none
+inline const char *scanIdent(const char *p)
+{
+	const char *q = (*p == '-' ? p + 1 : p);
+	if (!isalpha((unsigned char)*q) && *q != '_') {
+		return p;
 	}
+	return scanName(q + 1);
+}
 
-	// Depth-first traversal using a stack
-	NodeSet result;
-	while (!stack.empty()) {
-		tree<HTMLNode>::iterator it = stack.top();
-		stack.pop();
+// Selector expression consisting of a single id, class, type or type and
+// class, which is recognized without the lexer and matched by a
+// specialized loop
+struct Trivial
+{
+	enum Shape { None, Id, Class, Type, TypeClass };
 
-		// Check if selector matches
-		if (fn->match(it)) {
-			result.insert(it.node);
+	Trivial() : shape(None) { }
+
+	// Recognizes the shape of a trimmed expression
+	Trivial(const std::string &expr) : shape(None)
+	{
+		const char *p = expr.c_str(), *end = p + expr.length();
+		if (*p == '#') {
+			const char *q = scanName(p + 1);
+			if (q > p + 1 && q == end) {
+				shape = Id;
+				name.assign(p + 1, q);
+			}
+			return;
 		}
 
-		// Inspect all child nodes of non-matching elements
-		tree<HTMLNode>::sibling_iterator jt;
-		for (jt = it.begin(); jt != it.end(); ++jt) {
-			stack.push(jt);
+		const char *q = scanIdent(p);
+		if (q == end) {
+			shape = (q > p ? Type : None);
+		} else if (*q == '.') {
+			const char *r = scanIdent(q + 1);
+			if (r > q + 1 && r == end) {
+				shape = (q > p ? TypeClass : Class);
+				name.assign(q + 1, r);
+			}
+		}
+		if (shape != None) {
+			type.assign(p, q);
 		}
 	}
 
-	return result;
-}
-
-} // Anonymous namespace
+	// Returns the equivalent selector function
+	SelectorFn *compile() const
+	{
+		std::vector<SelectorFn *> fns;
+		if (shape == Type || shape == TypeClass) {
+			fns.push_back(new Selectors::Type(type));
+		}
+		if (shape == Class || shape == TypeClass) {
+			fns.push_back(new Selectors::Class(name, 0));
+		}
+		if (shape == Id) {
+			fns.push_back(new Selectors::AttributeValue("id", name));
+		}
+		return new Selectors::SimpleSequence(fns, 0);
+	}
 
+	Shape shape;
+	std::string type;
+	std::string name; // Id or class
+};
 
-/*!
- * Checks if node \p a < node \p b by comparing their positions in the document.
- */
-bool NodeComp::operator()(Node *a, Node *b) const {
-	if (a == NULL || b == NULL) {
-		return a < b;
+// Returns the node following a node in document order within the
+// subtree of top, or NULL
+inline Node *following(Node *node, Node *top)
+{
+	if (node->first_child) {
+		return node->first_child;
 	}
-	return a->data.offset() < b->data.offset();
+	while (node != top && !node->next_sibling) {
+		node = node->parent;
+	}
+	return (node == top ? NULL : node->next_sibling);
 }
 
-// Applies a CSS selector expression to a document tree.
-NodeSet select(const tree<HTMLNode> &tree, const std::string &expr)
+// Matches a set of nodes against a selector
+NodeSet match(const NodeSet &nodes, const SelectorFn *fn, Context &ctx)
 {
-	// Select the <html> node from the tree and use it as the root node
-	NodeSet v;
-	::tree<HTMLNode>::iterator it;
-	for (it = tree.begin(); it != tree.end(); ++it) {
-		if (!strcasecmp(it->tagName(), "html")) {
-			v.insert(it.node);
-			break;
+	// Nodes are visited in document order, which sibling combinators
+	// rely on, and appended to the result
+	NodeSet result;
+	for (NodeSet::const_iterator it(nodes.begin()); it != nodes.end(); ++it) {
+		for (Node *node = *it; node; node = following(node, *it)) {
+			ctx.visit();
+			if (fn->match(node, ctx)) {
+				result.insert(result.end(), node);
+			}
 		}
 	}
+	return result;
+}
 
-	if (expr.empty()) {
-		return v;
+// Returns a mask of the values among the first n <= 64 values of an array
+// that are equal to v, comparing 8 (AVX2) or 4 (SSE2) values at a time
+inline unsigned long long equalMask(const int *values, int n, int v)
+{
+	unsigned long long m = 0;
+	int i = 0;
+#if defined(__AVX2__)
+	__m256i x = _mm256_set1_epi32(v);
+	for (; i + 8 <= n; i += 8) {
+		__m256i c = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(values + i)), x);
+		m |= (unsigned long long)(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(c)) << i;
+	}
+#elif defined(__SSE2__)
+	__m128i x = _mm_set1_epi32(v);
+	for (; i + 4 <= n; i += 4) {
+		__m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(values + i)), x);
+		m |= (unsigned long long)(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(c)) << i;
 	}
-	return select(v, expr);
+#endif
+	for (; i < n; ++i) {
+		if (values[i] == v) m |= (unsigned long long)1 << i;
+	}
+	return m;
 }
 
-// Applies a CSS selector expression to a set of nodes.
-NodeSet select(const NodeSet &nodes, const std::string &expr)
+// Evaluates the type, class and id selectors in the rightmost sequence of
+// a selector for blocks of up to 64 consecutive nodes of a flat or mapped
+// document at once. Tag ids are compared in columns using SIMD
+// instructions, and the class tokens and ids of the remaining nodes are
+// gathered from the document's arrays and indexes. The resulting mask is
+// a superset of the matching nodes, which still need to be tested.
+template <class D>
+class BatchFilter
 {
-	// Parse expression
-	std::vector<SelectorFn *> fns = parse(expr);
+public:
+	typedef unsigned long long Mask;
+	enum { Width = 64 };
 
-	NodeSet result;
-	std::vector<SelectorFn *>::const_iterator it;
-	for (it = fns.begin(); it != fns.end(); ++it) {
-		NodeSet v = match(nodes, *it);
-		result.insert(v.begin(), v.end());
+	BatchFilter(const D &doc, const SelectorFn *fn)
+		: m_doc(doc), m_tag(-1), m_ids(NULL), m_idsEnd(NULL), m_active(false), m_empty(false)
+	{
+		const std::vector<SelectorFn *> &fns = Selectors::rightmost(fn)->fns;
+		for (size_t i = 0; i < fns.size(); ++i) {
+			Selectors::Atom a = Selectors::atom(fns[i]);
+			int k;
+			if (a.kind == Selectors::Atom::TypeAtom) {
+				k = m_tag = doc.tagId(*a.name);
+			} else if (a.kind == Selectors::Atom::ClassAtom) {
+				k = doc.classId(*a.name);
+				m_classes.push_back(k);
+			} else if (a.kind == Selectors::Atom::IdAtom && !m_ids && Selectors::flatIndexed(&doc)) {
+				k = doc.idId(*a.name);
+				if (k >= 0) {
+					m_ids = Selectors::flatIdNodes(&doc) + doc.idBegin[k];
+					m_idsEnd = Selectors::flatIdNodes(&doc) + doc.idBegin[k+1];
+				}
+			} else {
+				continue;
+			}
+			m_active = true;
+			m_empty = (m_empty || k < 0);
+		}
 	}
 
-	delete_all(fns);
-	return result;
+	// Whether the selector has any type, class or id that can be evaluated
+	bool active() const { return m_active; }
+
+	// Whether no node of the document can match
+	bool empty() const { return m_empty; }
+
+	// Returns the mask of the nodes [begin, begin + n) that may match, for
+	// increasing values of begin
+	Mask mask(int begin, int n)
+	{
+		Mask m = (n == Width ? ~(Mask)0 : ((Mask)1 << n) - 1);
+		if (m_tag >= 0) {
+			m &= equalMask(&m_doc.tag[begin], n, m_tag);
+		}
+		if (m_ids && m) {
+			Mask ids = 0;
+			m_ids = std::lower_bound(m_ids, m_idsEnd, begin);
+			for (const int *it = m_ids; it != m_idsEnd && *it < begin + n; ++it) {
+				ids |= (Mask)1 << (*it - begin);
+			}
+			m &= ids;
+		}
+		if (!m_classes.empty()) {
+			const int *tokens = Selectors::flatClassTokens(&m_doc);
+			for (Mask left = m; left; left &= left - 1) {
+				int i = begin + __builtin_ctzll(left);
+				const int *first = tokens + m_doc.classBegin[i], *last = tokens + m_doc.classBegin[i+1];
+				for (size_t j = 0; j < m_classes.size(); ++j) {
+					if (!std::binary_search(first, last, m_classes[j])) {
+						m &= ~((Mask)1 << (i - begin));
+						break;
+					}
+				}
+			}
+		}
+		return m;
+	}
+
+private:
+	const D &m_doc;
+	int m_tag;
+	std::vector<int> m_classes;
+	const int *m_ids, *m_idsEnd;
+	bool m_active, m_empty;
+};
+
+// Creates batch filters for a set of selectors. Returns false if a
+// selector has no type, class or id, so that all nodes need to be tested.
+template <class D>
+bool batchFilters(const D &doc, const std::vector<SelectorFn *> &fns, std::vector<BatchFilter<D> > *filters)
+{
+	for (size_t j = 0; j < fns.size(); ++j) {
+		filters->push_back(BatchFilter<D>(doc, fns[j]));
+		if (!filters->back().active()) {
+			filters->clear();
+			return false;
+		}
+	}
+	return true;
 }
 
+// Tests a node of a flat or mapped document against a set of selectors
+template <class D>
+inline void test(const Selectors::FlatRefT<D> &ref, const std::vector<SelectorFn *> &fns, Context &ctx, std::vector<int> *result)
+{
+	ctx.visit();
+	++ctx.candidates;
+	for (size_t j = 0; j < fns.size(); ++j) {
+		if (fns[j]->match(ref, ctx)) {
+			result->push_back(ref.i);
+			break;
+		}
+	}
+}
 
-/*!
- * Constructs an empty selection.
- */
-Selection::Selection()
+// Matches a range of flat or mapped document nodes against a set of
+// selectors. With batch filters, only the nodes passing the filter of any
+// selector are tested.
+template <class D>
+void match(const D &doc, int begin, int end, const std::vector<SelectorFn *> &fns, std::vector<BatchFilter<D> > &filters, Context &ctx, std::vector<int> *result)
 {
+	typedef typename BatchFilter<D>::Mask Mask;
+	Selectors::FlatRefT<D> ref = { &doc, begin };
+	if (filters.empty()) {
+		for (; ref.i < end; ++ref.i) {
+			test(ref, fns, ctx, result);
+		}
+		return;
+	}
+
+	for (int b = begin; b < end; b += BatchFilter<D>::Width) {
+		int n = std::min(end - b, (int)BatchFilter<D>::Width);
+		Mask m = 0;
+		for (size_t j = 0; j < filters.size(); ++j) {
+			if (!filters[j].empty()) m |= filters[j].mask(b, n);
+		}
+		for (; m; m &= m - 1) {
+			ref.i = b + __builtin_ctzll(m);
+			test(ref, fns, ctx, result);
+		}
+	}
 }
 
-/*!
- * Constructs a selection containing a whole tree and optionally
- * applies a selector.
- *
- * \param tree The HTML tree
- * \param expr The CSS selector expression
- * \throws ParseException CSS selector parsing error
- */
-Selection::Selection(const tree<htmlcxx::HTML::Node> &tree, const std::string &expr)
+// Matches a range of flat or mapped document nodes against a set of
+// selectors
+template <class D>
+void match(const D &doc, int begin, int end, const std::vector<SelectorFn *> &fns, Context &ctx, std::vector<int> *result)
 {
-	NodeSet v = hcxselect::select(tree, expr);
-	insert(v.begin(), v.end());
+	std::vector<BatchFilter<D> > filters;
+	batchFilters(doc, fns, &filters);
+	match(doc, begin, end, fns, filters, ctx, result);
 }
 
-/*!
- * Constructs a selection from a set of nodes and optionally 
- * applies a selector.
- *
- * \param nodes The set of nodes
- * \param expr The CSS selector expression
- * \throws ParseException CSS selector parsing error
- */
-Selection::Selection(const NodeSet &nodes, const std::string &expr)
+// Strategy for matching a selector against a flat document
+struct Plan
 {
-	if (!expr.empty()) {
-		NodeSet v = hcxselect::select(nodes, expr);
-		insert(v.begin(), v.end());
-	} else {
-		insert(nodes.begin(), nodes.end());
+	enum Strategy {
+		Scan,   // Test all nodes
+		Join,   // Join the candidates of all sequences (SelectorFn::join)
+		Seed,   // Test the nodes having a type, class or id of the rightmost sequence
+		Region  // Test the descendants of nodes having a type, class or id of an earlier sequence
+	};
+
+	Plan(Strategy strategy = Scan, double candidates = 0, double cost = 0)
+		: strategy(strategy), candidates(candidates), cost(cost),
+		  sequence(0), seeds(NULL), seedsEnd(NULL) { }
+
+	Strategy strategy;
+	double candidates;           // Estimated number of examined nodes
+	double cost;                 // Estimated cost, in node tests
+	int sequence;                // Sequence of the key, counted from the right
+	std::string key;             // Type, class or id used for seeding
+	const int *seeds, *seedsEnd; // Nodes having the key
+
+	std::string describe() const
+	{
+		std::ostringstream ss;
+		switch (strategy) {
+			case Scan: ss << "scan"; break;
+			case Join: ss << "join"; break;
+			case Seed: ss << "seed from " << key; break;
+			case Region: ss << "descendants of " << key << " (sequence " << sequence << " from the right)"; break;
+		}
+		return ss.str();
+	}
+};
+
+// Returns the number of nodes within [begin, end) below the given nodes
+long coverage(const FlatDocument &doc, const int *it, const int *last, int begin, int end)
+{
+	long n = 0;
+	int covered = begin;
+	for (; it != last; ++it) {
+		int b = std::max(*it + 1, covered), e = std::min(doc.end[*it], end);
+		if (e > b) {
+			n += e - b;
+			covered = e;
+		}
 	}
+	return n;
 }
 
-/*!
- * Returns a new selection by selecting elements from this 
- * selection using the given selector expression.
- *
- * \param expr The CSS selector expression
- * \returns A new selection of elements matching the given selector
- * \throws ParseException CSS selector parsing error
- */
-Selection Selection::select(const std::string &expr)
+// Chooses the cheapest strategy for matching a selector against the nodes
+// [begin, end) of a flat document, based on the sizes of its indexes.
+// Considered plans are optionally appended to alternatives.
+Plan plan(const FlatDocument &doc, const SelectorFn *fn, int begin, int end, std::vector<Plan> *alternatives = NULL)
 {
-	return hcxselect::select(*this, expr);
+	// Split the selector into its sequences, from right to left
+	std::vector<const Selectors::SimpleSequence *> seqs;
+	std::string combinators;
+	Selectors::split(fn, &seqs, &combinators);
+
+	// Testing a node walks up to maxDepth nodes per descendant or
+	// general sibling combinator
+	int walks = 0;
+	for (size_t i = 0; i < combinators.length(); ++i) {
+		if (combinators[i] != '>' && combinators[i] != '+') ++walks;
+	}
+	double factor = 1.0 + walks * doc.maxDepth / 2.0;
+
+	std::vector<Plan> plans;
+	plans.push_back(Plan(Plan::Scan, end - begin, (end - begin) * factor));
+
+	std::string key;
+	const int *it, *last;
+	if (!combinators.empty() && combinators.find_first_of("+~") == std::string::npos) {
+		double n = 0;
+		for (size_t i = 0; i < seqs.size(); ++i) {
+			n += (seqs[i]->key(doc, &key, &it, &last) ? last - it : (i == 0 ? end - begin : end));
+		}
+		plans.push_back(Plan(Plan::Join, n, n));
+	}
+
+	if (seqs[0]->key(doc, &key, &it, &last)) {
+		plans.push_back(Plan(Plan::Seed, last - it, (last - it) * factor));
+		plans.back().sequence = 1;
+	}
+
+	for (size_t i = 1; i < seqs.size() && combinators[i-1] != '+' && combinators[i-1] != '~'; ++i) {
+		if (seqs[i]->key(doc, &key, &it, &last)) {
+			long n = coverage(doc, it, last, begin, end);
+			plans.push_back(Plan(Plan::Region, n, n * factor));
+			plans.back().sequence = i + 1;
+		}
+	}
+
+	size_t best = 0;
+	for (size_t i = 0; i < plans.size(); ++i) {
+		if (plans[i].strategy == Plan::Seed || plans[i].strategy == Plan::Region) {
+			seqs[plans[i].sequence - 1]->key(doc, &plans[i].key, &plans[i].seeds, &plans[i].seedsEnd);
+		}
+		if (plans[i].cost < plans[best].cost) {
+			best = i;
+		}
+	}
+	if (alternatives) {
+		alternatives->insert(alternatives->end(), plans.begin(), plans.end());
+	}
+	return plans[best];
+}
+
+// Matches the nodes [begin, end) of a flat document against a selector
+// using the given plan
+void execute(const FlatDocument &doc, const Plan &plan, const SelectorFn *fn, int begin, int end, Context &ctx, std::vector<int> *result)
+{
+	Selectors::FlatRef ref = { &doc, begin };
+	const int *it = plan.seeds;
+	int covered = begin;
+	std::vector<SelectorFn *> fns(1, const_cast<SelectorFn *>(fn));
+	std::vector<BatchFilter<FlatDocument> > filters;
+	switch (plan.strategy) {
+		case Plan::Scan:
+			match(doc, begin, end, fns, ctx, result);
+			break;
+
+		case Plan::Join:
+			fn->join(doc, begin, end, ctx, result);
+			break;
+
+		case Plan::Seed:
+			for (it = std::lower_bound(it, plan.seedsEnd, begin); it != plan.seedsEnd && *it < end; ++it) {
+				ref.i = *it;
+				ctx.visit();
+				++ctx.candidates;
+				if (fn->match(ref, ctx)) {
+					result->push_back(ref.i);
+				}
+			}
+			break;
+
+		case Plan::Region:
+			batchFilters(doc, fns, &filters);
+			for (; it != plan.seedsEnd; ++it) {
+				int b = std::max(*it + 1, covered), e = std::min(doc.end[*it], end);
+				if (b < e) {
+					match(doc, b, e, fns, filters, ctx, result);
+				}
+				covered = std::max(covered, e);
+			}
+			break;
+	}
+}
+
+// Returns the bit of a subtree summary for the name of a tag ('t'),
+// class ('c') or id ('i'), ignoring case
+SubtreeSummary::Bits summaryBit(char kind, const std::string &name)
+{
+	unsigned int h = 2166136261u ^ (unsigned char)kind;
+	for (size_t i = 0; i < name.length(); ++i) {
+		h = (h ^ (unsigned char)::tolower(name[i])) * 16777619u;
+	}
+	return (SubtreeSummary::Bits)1 << (h % 64);
+}
+
+// Returns the summary bits of the type, classes and id of a sequence
+SubtreeSummary::Bits sequenceMask(const Selectors::SimpleSequence *seq)
+{
+	static const char kinds[] = { 0, 't', 'c', 'i' }; // Indexed by Atom::Kind
+	SubtreeSummary::Bits mask = 0;
+	for (size_t i = 0; i < seq->fns.size(); ++i) {
+		Selectors::Atom a = Selectors::atom(seq->fns[i]);
+		if (a.kind != Selectors::Atom::None) {
+			mask |= summaryBit(kinds[a.kind], *a.name);
+		}
+	}
+	return mask;
+}
+
+// Returns the summary bits of the type, classes and id in the rightmost
+// sequence of a selector, which all subtrees containing a match have
+SubtreeSummary::Bits summaryMask(const SelectorFn *fn)
+{
+	return sequenceMask(Selectors::rightmost(fn));
+}
+
+// Returns the summary bits of the sequences of a selector that must
+// match ancestors of a matching node, i.e. those left of a descendant or
+// child combinator. Sequences left of sibling combinators match siblings
+// of ancestors or of the node, but their own ancestors are ancestors of
+// the node as well.
+SubtreeSummary::Bits ancestorMask(const SelectorFn *fn)
+{
+	std::vector<const Selectors::SimpleSequence *> seqs;
+	std::string combinators;
+	Selectors::split(fn, &seqs, &combinators);
+
+	SubtreeSummary::Bits mask = 0;
+	for (size_t i = 0; i < combinators.length(); ++i) {
+		if (combinators[i] == ' ' || combinators[i] == '>') {
+			mask |= sequenceMask(seqs[i + 1]);
+		}
+	}
+	return mask;
+}
+
+// Depth constraints of a selector whose leftmost sequence can only match the
+// root element, i.e. requires ":root", and which does not use sibling
+// combinators. Depths are relative to the root element. A type selector
+// for "html" is not enough, since nested html elements match it as well.
+struct Anchor
+{
+	Anchor() : anchored(false), root(NULL), minDepth(0), maxDepth(-1) { }
+
+	bool anchored;
+	const SelectorFn *root; // Leftmost sequence
+	std::vector<const SelectorFn *> path; // Sequences that ancestors at depth 1, 2, ... must match
+	int minDepth;
+	int maxDepth; // -1 if unbounded
+};
+
+// Derives the depth constraints of a selector
+Anchor anchor(const SelectorFn *fn)
+{
+	// Sequences and combinators from right to left
+	std::vector<const Selectors::SimpleSequence *> seqs;
+	std::string combinators;
+	Selectors::split(fn, &seqs, &combinators);
+
+	Anchor a;
+	if (combinators.find_first_of("+~") != std::string::npos) {
+		return a;
+	}
+	const std::vector<SelectorFn *> &fns = seqs.back()->fns;
+	for (size_t i = 0; i < fns.size() && !a.anchored; ++i) {
+		a.anchored = (fns[i]->variant == SelectorFn::PseudoFn
+			&& static_cast<const Selectors::Pseudo *>(fns[i])->kind == Selectors::Pseudo::Root);
+	}
+	if (!a.anchored) {
+		return a;
+	}
+
+	// Walk from left to right, the leftmost sequence being at depth 0.
+	// Ancestors must match the sequences joined by leading child combinators.
+	a.root = seqs.back();
+	bool prefix = true;
+	for (int i = (int)combinators.length() - 1; i >= 0; --i) {
+		a.minDepth += (combinators[i] == '*' ? 2 : 1);
+		prefix = (prefix && combinators[i] == '>');
+		if (prefix && i > 0) {
+			a.path.push_back(seqs[i]);
+		}
+	}
+	a.maxDepth = (prefix ? a.minDepth : -1);
+	return a;
+}
+
+// Checks whether a node is the root element of its document
+inline bool isRootElement(Node *node)
+{
+	return (node && node->data.isTag() && node->parent && !node->parent->parent
+		&& !strcasecmp(node->data.tagName(), "html"));
+}
+
+// Matches the subtree of the root element against an anchored selector,
+// descending only into nodes that satisfy its depth constraints
+NodeSet match(Node *root, const SelectorFn *fn, const Anchor &anchor, Context &ctx)
+{
+	NodeSet result;
+	ctx.visit();
+	if (!anchor.root->match(root, ctx)) {
+		return result;
+	}
+	if (anchor.minDepth == 0 && fn->match(root, ctx)) {
+		result.insert(root);
+	}
+
+	// Pre-order traversal in document order, keeping track of the depth
+	Node *node = (anchor.maxDepth != 0 ? root->first_child : NULL);
+	int depth = 1;
+	while (node) {
+		ctx.visit();
+
+		// Skip branches whose ancestor path already fails
+		bool descend = false;
+		if (depth > (int)anchor.path.size() || anchor.path[depth-1]->match(node, ctx)) {
+			if (depth >= anchor.minDepth && fn->match(node, ctx)) {
+				result.insert(result.end(), node);
+			}
+			descend = (anchor.maxDepth < 0 || depth < anchor.maxDepth);
+		}
+
+		if (descend && node->first_child) {
+			node = node->first_child;
+			++depth;
+			continue;
+		}
+		while (node != root && !node->next_sibling) {
+			node = node->parent;
+			--depth;
+		}
+		node = (node == root ? NULL : node->next_sibling);
+	}
+	return result;
+}
+
+// Builds an index of nodes by key using a counting sort, where node i has
+// the keys [offsets[i], offsets[i+1])
+void buildIndex(const std::vector<int> &offsets, const std::vector<int> &keys, size_t nkeys, std::vector<int> *begin, std::vector<int> *nodes)
+{
+	begin->assign(nkeys + 1, 0);
+	for (size_t k = 0; k < keys.size(); ++k) {
+		++(*begin)[keys[k] + 1];
+	}
+	for (size_t k = 0; k < nkeys; ++k) {
+		(*begin)[k+1] += (*begin)[k];
+	}
+	nodes->resize(keys.size());
+	std::vector<int> pos(begin->begin(), begin->end() - 1);
+	for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+		for (int k = offsets[i]; k < offsets[i+1]; ++k) {
+			(*nodes)[pos[keys[k]]++] = i;
+		}
+	}
+}
+
+// Sections of saved flat documents
+enum Section
+{
+	ParentSection, PrevElementSection, NextElementSection, EndSection,
+	DepthSection, TagSection, FlagsSection, OffsetSection, LengthSection,
+	AttrBeginSection, AttrNameSection, AttrValueSection, AttrLengthSection,
+	ClassBeginSection, ClassTokensSection, ValuesSection, StringsSection,
+	TagNamesSection, AttrNamesSection, ClassNamesSection, IdNamesSection,
+	TagBeginSection, TagNodesSection, ClassNodeBeginSection, ClassNodesSection,
+	IdBeginSection, IdNodesSection, NumSections
+};
+
+// Header of saved flat documents. The sections follow in the order above,
+// each aligned to 8 bytes.
+struct FileHeader
+{
+	char magic[4];          // "HCXF"
+	unsigned int version;
+	unsigned int byteOrder; // 0x01020304 in native byte order
+	int nodes, root, maxDepth;
+	unsigned int sections[NumSections][2]; // Offset and number of elements
+};
+
+// Returns the size of the elements of a section
+inline size_t sectionSize(int section)
+{
+	return ((section == FlagsSection || section == ValuesSection || section == StringsSection) ? 1 : 4);
+}
+
+// Returns the contents of a vector as raw bytes
+template <class T>
+inline const char *bytes(const std::vector<T> &v)
+{
+	return (v.empty() ? NULL : (const char *)&v[0]);
+}
+
+// Determines the shortest list of nodes of a mapped document that have
+// the type, a class or the id of the rightmost sequence of a selector
+bool seeds(const MappedDocument &doc, const SelectorFn *fn, const int **begin, const int **end)
+{
+	if (!doc.hasIndexes()) {
+		return false;
+	}
+
+	bool found = false;
+	const std::vector<SelectorFn *> &fns = Selectors::rightmost(fn)->fns;
+	for (size_t i = 0; i < fns.size(); ++i) {
+		Selectors::Atom a = Selectors::atom(fns[i]);
+		const int *nodes, *offsets;
+		int k;
+		if (a.kind == Selectors::Atom::TypeAtom) {
+			k = doc.tagId(*a.name);
+			nodes = doc.tagNodes;
+			offsets = doc.tagBegin;
+		} else if (a.kind == Selectors::Atom::ClassAtom) {
+			k = doc.classId(*a.name);
+			nodes = doc.classNodes;
+			offsets = doc.classNodeBegin;
+		} else if (a.kind == Selectors::Atom::IdAtom) {
+			k = doc.idId(*a.name);
+			nodes = doc.idNodes;
+			offsets = doc.idBegin;
+		} else {
+			continue;
+		}
+
+		const int *b = nodes + (k < 0 ? 0 : offsets[k]);
+		const int *e = (k < 0 ? b : nodes + offsets[k+1]);
+		if (!found || e - b < *end - *begin) {
+			*begin = b;
+			*end = e;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// Returns the <html> node of a tree, if any
+Node *findRoot(const tree<HTMLNode> &tree)
+{
+	::tree<HTMLNode>::iterator it;
+	for (it = tree.begin(); it != tree.end(); ++it) {
+		if (!strcasecmp(it->tagName(), "html")) {
+			return it.node;
+		}
+	}
+	return NULL;
+}
+
+// Returns the end of the opening tag of an element in the source
+const char *tagEnd(const char *begin, const char *end)
+{
+	char quote = 0;
+	for (const char *p = begin; p < end; ++p) {
+		if (quote) {
+			if (*p == quote) quote = 0;
+		} else if (*p == '"' || *p == '\'') {
+			quote = *p;
+		} else if (*p == '>') {
+			return p + 1;
+		}
+	}
+	return end;
+}
+
+// Checks whether a string contains another one, ignoring case
+inline bool containsNoCase(const std::string &str, const std::string &sub)
+{
+	const char *s = str.c_str(), *end = s + str.length();
+	size_t n = sub.length();
+	int first = ::tolower((unsigned char)sub[0]);
+	for (; (size_t)(end - s) >= n; ++s) {
+		if (::tolower((unsigned char)*s) == first && !::strncasecmp(s, sub.c_str(), n)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Matches a set of nodes against a trivial selector. Like the general
+// engine, matching of an id selector reports all elements having the id.
+NodeSet match(const NodeSet &nodes, const Trivial &trivial, const SelectorFn *fn, Context &ctx)
+{
+	NodeSet result;
+	const char *type = trivial.type.c_str();
+	for (NodeSet::const_iterator it(nodes.begin()); it != nodes.end(); ++it) {
+		for (Node *node = *it; node; node = following(node, *it)) {
+			ctx.visit();
+			if (trivial.shape != Trivial::Id && trivial.shape != Trivial::Class
+				&& !(node->data.isTag() && !::strcasecmp(node->data.tagName().c_str(), type))) {
+				continue;
+			}
+
+			// Since htmlcxx does not decode attribute values, a class or
+			// id can only match if the opening tag contains it. This
+			// avoids parsing the attributes of most nodes.
+			if (trivial.shape != Trivial::Type
+				&& !(containsNoCase(node->data.text(), trivial.name) && fn->match(node, ctx))) {
+				continue;
+			}
+
+			result.insert(result.end(), node);
+		}
+	}
+	return result;
+}
+
+// Passes all nodes within the subtree of root that match one of the
+// given selectors to a visitor, in document order
+void visit(Node *root, const std::vector<SelectorFn *> &fns, Context &ctx, Visitor &visitor)
+{
+	for (Node *node = root; node; node = following(node, root)) {
+		ctx.visit();
+		for (size_t i = 0; i < fns.size(); ++i) {
+			if (fns[i]->match(node, ctx)) {
+				if (!visitor.visit(node)) {
+					return;
+				}
+				break;
+			}
+		}
+	}
+}
+
+// Visitor that appends all nodes to a list
+struct Collector : Visitor
+{
+	Collector(std::vector<Node *> *out) : out(out) { }
+	bool visit(Node *node) { out->push_back(node); return true; }
+	std::vector<Node *> *out;
+};
+
+// Returns the current time in seconds
+inline double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Normalizes the whitespace of a selector expression, for use as a cache
+// key. If the expression consists of a prefix followed by a descendant or
+// child combinator and a single sequence, *split receives the position of
+// that combinator in the normalized expression, and npos otherwise.
+std::string normalize(const std::string &expr, size_t *split)
+{
+	std::string out;
+	out.reserve(expr.length());
+	*split = std::string::npos;
+	bool shared = true, space = false;
+	int parens = 0, brackets = 0;
+	char quote = 0;
+	for (size_t i = 0; i < expr.length(); ++i) {
+		char c = expr[i];
+		if (quote) {
+			out += c;
+			if (c == '\\' && i + 1 < expr.length()) {
+				out += expr[++i];
+			} else if (c == quote) {
+				quote = 0;
+			}
+			continue;
+		}
+		if (isspace((unsigned char)c)) {
+			space = true;
+			continue;
+		}
+
+		// Whitespace is only significant as a descendant combinator
+		if (space && brackets == 0 && !out.empty() && !strchr(">+~,)", c)
+				&& !strchr(">+~,(", out[out.length()-1])) {
+			if (parens == 0) {
+				*split = out.length();
+				if (c == '*') {
+					// Treated as a combinator by the parser
+					shared = false;
+				}
+			}
+			out += ' ';
+		}
+		space = false;
+
+		switch (c) {
+			case '(': ++parens; break;
+			case ')': --parens; break;
+			case '[': ++brackets; break;
+			case ']': --brackets; break;
+			case '"': case '\'': quote = c; break;
+			case '>': if (parens == 0 && brackets == 0) *split = out.length(); break;
+			case '+': case '~': case ',': if (parens == 0 && brackets == 0) shared = false; break;
+			default: break;
+		}
+		out += c;
+		if (c == '\\' && i + 1 < expr.length()) {
+			// Hexadecimal escapes may be terminated by a space
+			size_t j = i + 1;
+			while (j < expr.length() && j < i + 7 && isxdigit((unsigned char)expr[j])) ++j;
+			if (j > i + 1 && j < expr.length() && isspace((unsigned char)expr[j])) ++j;
+			out.append(expr, i + 1, std::max(j, i + 2) - (i + 1));
+			i = std::max(j, i + 2) - 1;
+		}
+	}
+	if (!shared) {
+		*split = std::string::npos;
+	}
+	return out;
+}
+
+} // Anonymous namespace
+
+
+// Shared data of compiled selectors
+struct CompiledSelector::Data
+{
+	Data(const std::string &expr, const Limits &limits = Limits())
+		: expr(expr), trivial(trim(expr)), limits(limits), features(0), scratch(NULL), refs(1)
+	{
+		if (trivial.shape != Trivial::None) {
+			if (limits.maxComplexity && limits.maxComplexity < (trivial.shape == Trivial::TypeClass ? 2u : 1u)) {
+				throw LimitException(LimitException::Complexity);
+			}
+			fns.push_back(trivial.compile());
+			steps = 1;
+		} else {
+			fns = parse(expr, &steps, &limits);
+		}
+		for (size_t i = 0; i < fns.size(); ++i) {
+			features |= fns[i]->features();
+			masks.push_back(summaryMask(fns[i]));
+			anchors.push_back(anchor(fns[i]));
+		}
+	}
+
+	~Data()
+	{
+		delete_all(fns);
+		delete scratch;
+	}
+
+	std::string expr;
+	Trivial trivial;
+	Limits limits;
+	std::vector<SelectorFn *> fns;
+	std::vector<SubtreeSummary::Bits> masks;
+	std::vector<Anchor> anchors;
+	int steps;
+	int features;
+	mutable Scratch *scratch; // Buffers of :has() and :contains() between queries
+	int refs;
+};
+
+namespace detail
+{
+
+const std::vector<SelectorFn *> &functions(const CompiledSelector &selector) { return selector.data()->fns; }
+const Limits &limits(const CompiledSelector &selector) { return selector.data()->limits; }
+int steps(const CompiledSelector &selector) { return selector.data()->steps; }
+
+// Prepares the skip table of the Horspool search: the shift for the
+// character aligned with the end of the needle
+TextSearch::TextSearch(const std::string &needle, bool nocase)
+	: m_needle(needle), m_nocase(nocase)
+{
+	size_t m = m_needle.length();
+	if (m_nocase) {
+		std::transform(m_needle.begin(), m_needle.end(), m_needle.begin(), ::tolower);
+	}
+	for (int c = 0; c < 256; ++c) {
+		m_skip[c] = (m > 0 ? m : 1);
+	}
+	for (size_t j = 0; j + 1 < m; ++j) {
+		unsigned char c = m_needle[j];
+		m_skip[c] = m - 1 - j;
+		if (m_nocase) m_skip[::toupper(c)] = m - 1 - j;
+	}
+}
+
+// Returns the first occurrence of the needle in a text, or NULL
+const char *TextSearch::find(const char *text, size_t length) const
+{
+	size_t m = m_needle.length();
+	const char *p = m_needle.data();
+	if (m == 0) {
+		return text;
+	} else if (length < m) {
+		return NULL;
+	}
+
+	size_t i = 0;
+#if defined(__SSE2__)
+	// Positions at which both the first and the last character match
+	unsigned char f = p[0], l = p[m-1];
+	__m128i f1 = _mm_set1_epi8((char)f), l1 = _mm_set1_epi8((char)l);
+	__m128i f2 = (m_nocase ? _mm_set1_epi8((char)::toupper(f)) : f1);
+	__m128i l2 = (m_nocase ? _mm_set1_epi8((char)::toupper(l)) : l1);
+	for (; i + m - 1 + 16 <= length; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(text + i + m - 1));
+		__m128i eq = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f1), _mm_cmpeq_epi8(a, f2)),
+			_mm_or_si128(_mm_cmpeq_epi8(b, l1), _mm_cmpeq_epi8(b, l2)));
+		unsigned int mask = _mm_movemask_epi8(eq);
+		while (mask) {
+			int k = __builtin_ctz(mask);
+			if (m <= 2 || equal(text + i + k + 1, 1, m - 2)) {
+				return text + i + k;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	// Horspool search of the remainder
+	while (i + m <= length) {
+		unsigned char c = text[i + m - 1];
+		if ((m_nocase ? ::tolower(c) : c) == (unsigned char)p[m-1] && equal(text + i, 0, m - 1)) {
+			return text + i;
+		}
+		i += m_skip[c];
+	}
+	return NULL;
+}
+
+} // namespace detail
+
+
+/*!
+ * Constructs a set of limits that are all disabled.
+ */
+Limits::Limits()
+	: maxNodes(0), maxPredicates(0), maxComplexity(0), maxNesting(0), token(NULL)
+{
+}
+
+
+/*!
+ * Constructs an empty set of statistics.
+ */
+Statistics::Statistics()
+{
+	clear();
+}
+
+/*!
+ * Resets all counters to zero.
+ */
+void Statistics::clear()
+{
+	nodesVisited = 0;
+	predicateCalls = 0;
+	stepCalls.clear();
+	ancestorSteps = 0;
+	siblingSteps = 0;
+	attributeParses = 0;
+	textBytes = 0;
+	time = 0.0;
+}
+
+
+/*!
+ * Checks if node \p a < node \p b by comparing their positions in the document.
+ */
+bool NodeComp::operator()(Node *a, Node *b) const {
+	if (a == NULL || b == NULL) {
+		return a < b;
+	}
+	return a->data.offset() < b->data.offset();
+}
+
+// Applies a CSS selector expression to a document tree.
+NodeSet select(const tree<HTMLNode> &tree, const std::string &expr, Statistics *stats)
+{
+	// Select the <html> node from the tree and use it as the root node
+	NodeSet v;
+	Node *root = findRoot(tree);
+	if (root) {
+		v.insert(root);
+	}
+
+	if (expr.empty()) {
+		if (stats) stats->clear();
+		return v;
+	}
+	return select(v, expr, stats);
+}
+
+// Applies a CSS selector expression to a set of nodes.
+NodeSet select(const NodeSet &nodes, const std::string &expr, Statistics *stats)
+{
+	double start = (stats ? now() : 0.0);
+	NodeSet result = select(nodes, CompiledSelector(expr), stats);
+	if (stats) {
+		stats->time = now() - start;
+	}
+	return result;
+}
+
+// Applies a compiled selector to a document tree.
+NodeSet select(const tree<HTMLNode> &tree, const CompiledSelector &selector, Statistics *stats)
+{
+	NodeSet v;
+	Node *root = findRoot(tree);
+	if (root) {
+		v.insert(root);
+	}
+	return select(v, selector, stats);
+}
+
+// Applies a compiled selector to a set of nodes.
+NodeSet select(const NodeSet &nodes, const CompiledSelector &selector, Statistics *stats)
+{
+	double start = 0.0;
+	if (stats) {
+		stats->clear();
+		stats->stepCalls.resize(selector.data()->steps, 0);
+		start = now();
+	}
+
+	Context ctx(stats, true, &selector.data()->limits, &selector.data()->scratch);
+	NodeSet result;
+	const CompiledSelector::Data *data = selector.data();
+	Node *root = (nodes.size() == 1 ? *nodes.begin() : NULL);
+	if (data->trivial.shape != Trivial::None) {
+		result = match(nodes, data->trivial, data->fns[0], ctx);
+	} else {
+		for (size_t i = 0; i < data->fns.size(); ++i) {
+			// Selectors anchored at the root element only need to visit
+			// the branches that satisfy their depth constraints
+			NodeSet v;
+			if (data->anchors[i].anchored && isRootElement(root)) {
+				v = match(root, data->fns[i], data->anchors[i], ctx);
+			} else {
+				v = match(nodes, data->fns[i], ctx);
+			}
+			result.insert(v.begin(), v.end());
+		}
+	}
+
+	if (stats) {
+		stats->time = now() - start;
+	}
+	return result;
+}
+
+
+/*!
+ * Parses a CSS selector expression.
+ *
+ * \param expr The CSS selector expression
+ * \throws ParseException CSS selector parsing error
+ */
+CompiledSelector::CompiledSelector(const std::string &expr)
+	: d(new Data(expr))
+{
+}
+
+/*!
+ * Parses a CSS selector expression, limiting its complexity and the work
+ * spent on each query using it.
+ *
+ * \param expr The CSS selector expression
+ * \param limits The limits
+ * \throws ParseException CSS selector parsing error
+ * \throws LimitException The expression exceeds the complexity or nesting
+ *         limit. Queries throw this exception as well if they exceed a
+ *         limit or are cancelled.
+ */
+CompiledSelector::CompiledSelector(const std::string &expr, const Limits &limits)
+	: d(new Data(expr, limits))
+{
+}
+
+/*!
+ * Constructs a copy of another compiled selector. Both selectors will
+ * share the same data.
+ */
+CompiledSelector::CompiledSelector(const CompiledSelector &other)
+	: d(other.d)
+{
+	__sync_add_and_fetch(&d->refs, 1);
+}
+
+/*!
+ * Destructor.
+ */
+CompiledSelector::~CompiledSelector()
+{
+	if (__sync_sub_and_fetch(&d->refs, 1) == 0) {
+		delete d;
+	}
+}
+
+/*!
+ * Assignment operator.
+ */
+CompiledSelector &CompiledSelector::operator=(const CompiledSelector &other)
+{
+	__sync_add_and_fetch(&other.d->refs, 1);
+	if (__sync_sub_and_fetch(&d->refs, 1) == 0) {
+		delete d;
+	}
+	d = other.d;
+	return *this;
+}
+
+/*!
+ * Returns the selector expression that this selector has been compiled from.
+ */
+const std::string &CompiledSelector::expression() const
+{
+	return d->expr;
+}
+
+/*!
+ * Checks whether a single node matches the selector.
+ *
+ * \param node The node
+ * \returns \p true if the node matches
+ */
+bool CompiledSelector::matches(Node *node) const
+{
+	Context ctx(NULL, false, &d->limits, &d->scratch);
+	for (size_t i = 0; i < d->fns.size(); ++i) {
+		if (d->fns[i]->match(node, ctx)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
+// Passes the nodes matching a compiled selector to a visitor.
+void select(const tree<HTMLNode> &tree, const CompiledSelector &selector, Visitor &visitor, Statistics *stats)
+{
+	double start = 0.0;
+	if (stats) {
+		stats->clear();
+		stats->stepCalls.resize(selector.data()->steps, 0);
+		start = now();
+	}
+
+	Node *root = findRoot(tree);
+	if (root) {
+		Context ctx(stats, true, &selector.data()->limits, &selector.data()->scratch);
+		visit(root, selector.data()->fns, ctx, visitor);
+	}
+
+	if (stats) {
+		stats->time = now() - start;
+	}
+}
+
+// Appends the nodes matching a compiled selector to a list.
+void selectInto(const tree<HTMLNode> &tree, const CompiledSelector &selector, std::vector<Node *> *out, Statistics *stats)
+{
+	Collector collector(out);
+	select(tree, selector, collector, stats);
+}
+
+// Returns the source of a node.
+StringRef outerHtml(const char *source, Node *node)
+{
+	return StringRef(source + node->data.offset(), node->data.length());
+}
+
+// Returns the source of the contents of an element.
+StringRef innerHtml(const char *source, Node *node)
+{
+	const char *begin = source + node->data.offset();
+	if (!node->data.isTag()) {
+		return StringRef(begin, 0);
+	}
+
+	begin = tagEnd(begin, begin + node->data.length());
+	const char *end = begin;
+	if (node->last_child) {
+		end = source + node->last_child->data.offset() + node->last_child->data.length();
+	}
+	return StringRef(begin, end - begin);
+}
+
+// Looks up the raw value of an attribute in the source.
+bool attribute(const char *source, Node *node, const char *name, StringRef *value)
+{
+	if (!node->data.isTag()) {
+		return false;
+	}
+
+	const char *p = source + node->data.offset();
+	const char *end = tagEnd(p, p + node->data.length());
+	size_t len = strlen(name);
+
+	// Skip the tag name
+	while (p < end && !isspace(*p) && *p != '>' && *p != '/') ++p;
+
+	while (p < end) {
+		while (p < end && (isspace(*p) || *p == '/')) ++p;
+		const char *n = p;
+		while (p < end && !isspace(*p) && *p != '=' && *p != '>' && *p != '/') ++p;
+		if (p == n) {
+			break;
+		}
+		const char *ne = p;
+
+		while (p < end && isspace(*p)) ++p;
+		const char *v = p, *ve = p;
+		if (p < end && *p == '=') {
+			++p;
+			while (p < end && isspace(*p)) ++p;
+			if (p < end && (*p == '"' || *p == '\'')) {
+				char quote = *p++;
+				v = p;
+				while (p < end && *p != quote) ++p;
+				ve = p;
+				if (p < end) ++p;
+			} else {
+				v = p;
+				while (p < end && !isspace(*p) && *p != '>') ++p;
+				ve = p;
+			}
+		}
+
+		if ((size_t)(ne - n) == len && !::strncasecmp(n, name, len)) {
+			*value = StringRef(v, ve - v);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Appends the source of all text nodes in the subtree of a node.
+void textSpans(const char *source, Node *node, std::vector<StringRef> *spans)
+{
+	for (Node *n = node; n; n = following(n, node)) {
+		if (!n->data.isTag() && !n->data.isComment()) {
+			spans->push_back(outerHtml(source, n));
+		}
+	}
+}
+
+// Copies the concatenated text of the subtree of a node.
+size_t text(const char *source, Node *node, char *buffer, size_t size)
+{
+	size_t len = 0;
+	for (Node *n = node; n; n = following(n, node)) {
+		if (!n->data.isTag() && !n->data.isComment()) {
+			size_t l = n->data.length();
+			if (len < size) {
+				memcpy(buffer + len, source + n->data.offset(), std::min(l, size - len));
+			}
+			len += l;
+		}
+	}
+	return len;
+}
+
+
+/*!
+ * Constructs an empty selection.
+ */
+Selection::Selection()
+{
+}
+
+/*!
+ * Constructs a selection containing a whole tree and optionally
+ * applies a selector.
+ *
+ * \param tree The HTML tree
+ * \param expr The CSS selector expression
+ * \throws ParseException CSS selector parsing error
+ */
+Selection::Selection(const tree<htmlcxx::HTML::Node> &tree, const std::string &expr)
+{
+	NodeSet v = hcxselect::select(tree, expr);
+	swap(v);
+}
+
+/*!
+ * Constructs a selection from a set of nodes and optionally 
+ * applies a selector.
+ *
+ * \param nodes The set of nodes
+ * \param expr The CSS selector expression
+ * \throws ParseException CSS selector parsing error
+ */
+Selection::Selection(const NodeSet &nodes, const std::string &expr)
+{
+	if (!expr.empty()) {
+		NodeSet v = hcxselect::select(nodes, expr);
+		swap(v);
+	} else {
+		insert(nodes.begin(), nodes.end());
+	}
+}
+
+/*!
+ * Returns a new selection by selecting elements from this 
+ * selection using the given selector expression.
+ *
+ * \param expr The CSS selector expression
+ * \param stats Optional statistics for this call
+ * \returns A new selection of elements matching the given selector
+ * \throws ParseException CSS selector parsing error
+ */
+Selection Selection::select(const std::string &expr, Statistics *stats)
+{
+	Selection s;
+	NodeSet v = hcxselect::select(*this, expr, stats);
+	s.swap(v);
+	return s;
+}
+
+/*!
+ * Returns the nodes contained in both this selection and another set of
+ * nodes, in linear time.
+ */
+Selection Selection::intersect(const NodeSet &other) const
+{
+	Selection s;
+	std::set_intersection(begin(), end(), other.begin(), other.end(), std::inserter(s, s.end()), key_comp());
+	return s;
+}
+
+/*!
+ * Returns the nodes contained in this selection or in another set of
+ * nodes, in linear time.
+ */
+Selection Selection::unite(const NodeSet &other) const
+{
+	Selection s;
+	std::set_union(begin(), end(), other.begin(), other.end(), std::inserter(s, s.end()), key_comp());
+	return s;
+}
+
+/*!
+ * Returns the nodes of this selection that are not contained in another
+ * set of nodes, in linear time.
+ */
+Selection Selection::subtract(const NodeSet &other) const
+{
+	Selection s;
+	std::set_difference(begin(), end(), other.begin(), other.end(), std::inserter(s, s.end()), key_comp());
+	return s;
+}
+
+namespace
+{
+
+// Tests single nodes against a compiled selector, sharing the state of the
+// query. Without a selector, all nodes pass.
+class NodeTest
+{
+public:
+	NodeTest(const CompiledSelector *selector)
+		: m_fns(selector ? &selector->data()->fns : NULL),
+		  m_ctx(NULL, false, selector ? &selector->data()->limits : NULL, selector ? &selector->data()->scratch : NULL) { }
+
+	bool operator()(Node *node)
+	{
+		if (!m_fns) return true;
+		m_ctx.visit();
+		for (size_t i = 0; i < m_fns->size(); ++i) {
+			if ((*m_fns)[i]->match(node, m_ctx)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	const std::vector<SelectorFn *> *m_fns;
+	Context m_ctx;
+};
+
+// Returns the node's parent, or NULL if the node is at the top level of
+// the tree or its parent is
+inline Node *parentOf(Node *node)
+{
+	return (node->parent && node->parent->parent ? node->parent : NULL);
+}
+
+// Ancestor chain of the node visited last, from the top level down to the
+// node itself, with the test results of its nodes. When visiting nodes in
+// document order, every ancestor shared with earlier nodes is still on the
+// chain, so it is tested once without keeping a set of visited nodes.
+class AncestorChain
+{
+public:
+	enum State { Untested, Failed, Matched };
+
+	// Moves to the chain of a node, keeping the states of the ancestors
+	// shared with the previous chain
+	void visit(Node *node)
+	{
+		m_path.clear();
+		for (; node; node = parentOf(node)) {
+			m_path.push_back(node);
+		}
+		size_t n = m_path.size(), k = 0;
+		while (k < n && k < m_nodes.size() && m_nodes[k] == m_path[n - 1 - k]) {
+			++k;
+		}
+		m_nodes.resize(k);
+		m_states.resize(k);
+		for (; k < n; ++k) {
+			m_nodes.push_back(m_path[n - 1 - k]);
+			m_states.push_back(Untested);
+		}
+	}
+
+	size_t size() const { return m_nodes.size(); }
+	Node *node(size_t i) const { return m_nodes[i]; }
+	State &state(size_t i) { return m_states[i]; }
+
+private:
+	std::vector<Node *> m_nodes;
+	std::vector<State> m_states;
+	std::vector<Node *> m_path; // Buffer for the chain from the node upwards
+};
+
+// Adds the ancestors of all nodes of a selection that pass a test
+void ancestors(const Selection &sel, NodeTest &test, Selection *out)
+{
+	AncestorChain chain;
+	for (Selection::const_iterator it = sel.begin(); it != sel.end(); ++it) {
+		chain.visit(*it);
+
+		// Ancestors above a tested one have been tested as well
+		for (size_t i = chain.size() - 1; i-- > 0 && chain.state(i) == AncestorChain::Untested; ) {
+			bool matched = test(chain.node(i));
+			chain.state(i) = (matched ? AncestorChain::Matched : AncestorChain::Failed);
+			if (matched) {
+				out->insert(chain.node(i));
+			}
+		}
+	}
+}
+
+} // Anonymous namespace
+
+/*!
+ * Returns the nodes of this selection that match a selector. Only the
+ * nodes themselves are tested, without traversing their subtrees.
+ *
+ * \param expr The CSS selector expression
+ * \throws ParseException CSS selector parsing error
+ */
+Selection Selection::filter(const std::string &expr) const
+{
+	return filter(CompiledSelector(expr));
+}
+
+/*!
+ * Returns the nodes of this selection that match a compiled selector.
+ */
+Selection Selection::filter(const CompiledSelector &selector) const
+{
+	Selection s;
+	NodeTest test(&selector);
+	for (const_iterator it = begin(); it != end(); ++it) {
+		if (test(*it)) {
+			s.insert(s.end(), *it);
+		}
+	}
+	return s;
+}
+
+/*!
+ * Checks whether any node of this selection matches a selector.
+ *
+ * \param expr The CSS selector expression
+ * \throws ParseException CSS selector parsing error
+ */
+bool Selection::is(const std::string &expr) const
+{
+	return is(CompiledSelector(expr));
+}
+
+/*!
+ * Checks whether any node of this selection matches a compiled selector.
+ */
+bool Selection::is(const CompiledSelector &selector) const
+{
+	NodeTest test(&selector);
+	for (const_iterator it = begin(); it != end(); ++it) {
+		if (test(*it)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*!
+ * Returns, for every node of this selection, the node itself or its
+ * nearest ancestor that matches a selector, if any.
+ *
+ * \param expr The CSS selector expression
+ * \throws ParseException CSS selector parsing error
+ */
+Selection Selection::closest(const std::string &expr) const
+{
+	return closest(CompiledSelector(expr));
+}
+
+/*!
+ * Returns, for every node of this selection, the node itself or its
+ * nearest ancestor that matches a compiled selector, if any. Ancestors
+ * shared by several nodes are only tested once.
+ */
+Selection Selection::closest(const CompiledSelector &selector) const
+{
+	Selection s;
+	AncestorChain chain;
+	NodeTest test(&selector);
+	for (const_iterator it = begin(); it != end(); ++it) {
+		chain.visit(*it);
+		for (size_t i = chain.size(); i-- > 0; ) {
+			AncestorChain::State &state = chain.state(i);
+			if (state == AncestorChain::Untested) {
+				state = (test(chain.node(i)) ? AncestorChain::Matched : AncestorChain::Failed);
+				if (state == AncestorChain::Matched) {
+					s.insert(chain.node(i));
+				}
+			}
+			if (state == AncestorChain::Matched) {
+				break;
+			}
+		}
+	}
+	return s;
+}
+
+/*!
+ * Returns the ancestors of all nodes of this selection, optionally only
+ * those that match a selector.
+ *
+ * \param expr The CSS selector expression, or an empty string
+ * \throws ParseException CSS selector parsing error
+ */
+Selection Selection::parents(const std::string &expr) const
+{
+	if (expr.empty()) {
+		Selection s;
+		NodeTest test(NULL);
+		ancestors(*this, test, &s);
+		return s;
+	}
+	return parents(CompiledSelector(expr));
+}
+
+/*!
+ * Returns the ancestors of all nodes of this selection that match a
+ * compiled selector. Ancestors shared by several nodes are only tested
+ * once.
+ */
+Selection Selection::parents(const CompiledSelector &selector) const
+{
+	Selection s;
+	NodeTest test(&selector);
+	ancestors(*this, test, &s);
+	return s;
+}
+
+/*!
+ * Returns the child elements of all nodes of this selection, optionally
+ * only those that match a selector.
+ *
+ * \param expr The CSS selector expression, or an empty string
+ * \throws ParseException CSS selector parsing error
+ */
+Selection Selection::children(const std::string &expr) const
+{
+	if (expr.empty()) {
+		Selection s;
+		for (const_iterator it = begin(); it != end(); ++it) {
+			for (Node *node = (*it)->first_child; node; node = node->next_sibling) {
+				if (node->data.isTag()) {
+					s.insert(s.end(), node);
+				}
+			}
+		}
+		return s;
+	}
+	return children(CompiledSelector(expr));
+}
+
+/*!
+ * Returns the child elements of all nodes of this selection that match a
+ * compiled selector.
+ */
+Selection Selection::children(const CompiledSelector &selector) const
+{
+	Selection s;
+	NodeTest test(&selector);
+	for (const_iterator it = begin(); it != end(); ++it) {
+		for (Node *node = (*it)->first_child; node; node = node->next_sibling) {
+			if (node->data.isTag() && test(node)) {
+				s.insert(s.end(), node);
+			}
+		}
+	}
+	return s;
+}
+
+/*!
+ * Returns the source of all nodes in this selection, including the tags
+ * of elements. No characters are copied.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param out Receives a reference into \p source for every node
+ */
+void Selection::outerHtml(const char *source, std::vector<StringRef> *out) const
+{
+	out->clear();
+	for (const_iterator it = begin(); it != end(); ++it) {
+		out->push_back(hcxselect::outerHtml(source, *it));
+	}
+}
+
+/*!
+ * Returns the source of the contents of all elements in this selection.
+ * For other nodes, the references are empty. No characters are copied.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param out Receives a reference into \p source for every node
+ */
+void Selection::innerHtml(const char *source, std::vector<StringRef> *out) const
+{
+	out->clear();
+	for (const_iterator it = begin(); it != end(); ++it) {
+		out->push_back(hcxselect::innerHtml(source, *it));
+	}
+}
+
+/*!
+ * Returns the raw values of an attribute for all nodes in this
+ * selection. Nodes without the attribute yield a reference with a NULL
+ * data pointer. No characters are copied.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param name The attribute name
+ * \param out Receives a reference into \p source for every node
+ */
+void Selection::attribute(const char *source, const char *name, std::vector<StringRef> *out) const
+{
+	out->clear();
+	for (const_iterator it = begin(); it != end(); ++it) {
+		StringRef value;
+		hcxselect::attribute(source, *it, name, &value);
+		out->push_back(value);
+	}
+}
+
+/*!
+ * Returns the source of all text nodes within this selection, in
+ * document order. No characters are copied.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param out Receives the references into \p source
+ */
+void Selection::textSpans(const char *source, std::vector<StringRef> *out) const
+{
+	out->clear();
+	for (const_iterator it = begin(); it != end(); ++it) {
+		hcxselect::textSpans(source, *it, out);
+	}
+}
+
+/*!
+ * Copies the concatenated text of all nodes in this selection to a
+ * buffer. At most \p size characters are written and no terminating
+ * null character is added.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param buffer The destination buffer
+ * \param size The size of the buffer
+ * \returns The length of the whole text, which may exceed \p size
+ */
+size_t Selection::text(const char *source, char *buffer, size_t size) const
+{
+	size_t len = 0;
+	for (const_iterator it = begin(); it != end(); ++it) {
+		len += hcxselect::text(source, *it, buffer + std::min(len, size), size - std::min(len, size));
+	}
+	return len;
+}
+
+
+
+/*!
+ * Constructs an empty snapshot.
+ */
+FlatDocument::FlatDocument()
+	: maxDepth(0), root(-1)
+{
+}
+
+/*!
+ * Constructs a snapshot of the given tree.
+ *
+ * \param tree The HTML tree
+ */
+FlatDocument::FlatDocument(const tree<htmlcxx::HTML::Node> &tree)
+	: maxDepth(0), root(-1)
+{
+	build(tree);
+}
+
+/*!
+ * Builds the snapshot from the given tree, replacing the current contents.
+ * The attributes of all elements will be parsed.
+ *
+ * \param tree The HTML tree
+ */
+void FlatDocument::build(const tree<htmlcxx::HTML::Node> &tree)
+{
+	clear();
+
+	std::map<std::string, int> tagIds, attrIds, classIds, ids;
+	std::vector<int> idBegins, idTokens; // Like classBegin and classTokens
+	std::vector<int> open;       // Indices of currently open ancestors
+	std::vector<int> last(1, -1); // Last child for each open ancestor
+	int i = 0;
+
+	::tree<HTMLNode>::iterator it;
+	for (it = tree.begin(); it != tree.end(); ++it, ++i) {
+		while (!open.empty() && nodes[open.back()] != it.node->parent) {
+			end[open.back()] = i;
+			open.pop_back();
+			last.pop_back();
+		}
+
+		int p = (open.empty() ? -1 : open.back());
+		int ps = last.back();
+		last.back() = i;
+
+		nodes.push_back(it.node);
+		parent.push_back(p);
+		prevElement.push_back(ps < 0 ? -1 : ((flags[ps] & Tag) ? ps : prevElement[ps]));
+		end.push_back(0);
+		depth.push_back(open.size());
+		maxDepth = std::max(maxDepth, (int)open.size());
+		idBegins.push_back(idTokens.size());
+		flags.push_back((it->isTag() ? Tag : 0) | (it->isComment() ? Comment : 0));
+		offset.push_back(it->offset());
+		length.push_back(it->length());
+
+		std::string name = it->tagName();
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+		std::map<std::string, int>::iterator tt = tagIds.find(name);
+		if (tt == tagIds.end()) {
+			tt = tagIds.insert(std::make_pair(name, (int)tagNames.size())).first;
+			tagNames.push_back(name);
+		}
+		tag.push_back(tt->second);
+		if (root < 0 && it->isTag() && name == "html") {
+			root = i;
+		}
+
+		attrBegin.push_back(attrName.size());
+		classBegin.push_back(classTokens.size());
+		if (it->isTag()) {
+			if (it->attributes().empty()) it->parseAttributes();
+			std::map<std::string, std::string>::const_iterator at;
+			for (at = it->attributes().begin(); at != it->attributes().end(); ++at) {
+				std::map<std::string, int>::iterator nt = attrIds.find(at->first);
+				if (nt == attrIds.end()) {
+					nt = attrIds.insert(std::make_pair(at->first, (int)attrNames.size())).first;
+					attrNames.push_back(at->first);
+				}
+				attrName.push_back(nt->second);
+				attrValue.push_back(values.length());
+				attrLength.push_back(at->second.length());
+				values += at->second;
+			}
+
+			// Ids are compared case-insensitively as well
+			std::map<std::string, std::string>::const_iterator dt = it->attributes().find("id");
+			if (dt != it->attributes().end() && !dt->second.empty()) {
+				std::string id = dt->second;
+				std::transform(id.begin(), id.end(), id.begin(), ::tolower);
+				std::map<std::string, int>::iterator kt = ids.find(id);
+				if (kt == ids.end()) {
+					kt = ids.insert(std::make_pair(id, (int)ids.size())).first;
+				}
+				idTokens.push_back(kt->second);
+			}
+
+			// Split the class attribute into lower-case tokens
+			std::map<std::string, std::string>::const_iterator ct = it->attributes().find("class");
+			if (ct != it->attributes().end()) {
+				std::istringstream ss(ct->second);
+				std::string token;
+				while (ss >> token) {
+					std::transform(token.begin(), token.end(), token.begin(), ::tolower);
+					std::map<std::string, int>::iterator kt = classIds.find(token);
+					if (kt == classIds.end()) {
+						kt = classIds.insert(std::make_pair(token, (int)classIds.size())).first;
+					}
+					classTokens.push_back(kt->second);
+				}
+			}
+		}
+
+		open.push_back(i);
+		last.push_back(-1);
+	}
+	while (!open.empty()) {
+		end[open.back()] = i;
+		open.pop_back();
+	}
+	attrBegin.push_back(attrName.size());
+	classBegin.push_back(classTokens.size());
+
+	// Class names are stored in sorted order for lookups, so the tokens
+	// are renumbered accordingly, sorted and made unique per element
+	std::vector<int> order(classIds.size()), tokens;
+	for (std::map<std::string, int>::iterator kt = classIds.begin(); kt != classIds.end(); ++kt) {
+		order[kt->second] = classNames.size();
+		classNames.push_back(kt->first);
+	}
+	tokens.swap(classTokens);
+	for (size_t k = 0; k < tokens.size(); ++k) {
+		tokens[k] = order[tokens[k]];
+	}
+	for (int j = 0; j < i; ++j) {
+		std::vector<int>::iterator b = tokens.begin() + classBegin[j];
+		std::vector<int>::iterator e = tokens.begin() + classBegin[j+1];
+		std::sort(b, e);
+		classBegin[j] = classTokens.size();
+		classTokens.insert(classTokens.end(), b, std::unique(b, e));
+	}
+	classBegin[i] = classTokens.size();
+	buildIndex(classBegin, classTokens, classNames.size(), &classNodeBegin, &classNodes);
+
+	// Same for ids
+	idBegins.push_back(idTokens.size());
+	order.resize(ids.size());
+	for (std::map<std::string, int>::iterator kt = ids.begin(); kt != ids.end(); ++kt) {
+		order[kt->second] = idNames.size();
+		idNames.push_back(kt->first);
+	}
+	for (size_t k = 0; k < idTokens.size(); ++k) {
+		idTokens[k] = order[idTokens[k]];
+	}
+	buildIndex(idBegins, idTokens, idNames.size(), &idBegin, &idNodes);
+
+	// Nodes are indexed by tag using a counting sort
+	tagBegin.assign(tagNames.size() + 1, 0);
+	for (int j = 0; j < i; ++j) {
+		++tagBegin[tag[j] + 1];
+	}
+	for (size_t t = 0; t < tagNames.size(); ++t) {
+		tagBegin[t+1] += tagBegin[t];
+	}
+	tagNodes.resize(i);
+	std::vector<int> pos(tagBegin.begin(), tagBegin.end() - 1);
+	for (int j = 0; j < i; ++j) {
+		tagNodes[pos[tag[j]]++] = j;
+	}
+
+	// Next element siblings are determined backwards
+	nextElement.resize(i);
+	for (--i; i >= 0; --i) {
+		int ns = end[i];
+		if (ns >= (parent[i] < 0 ? size() : end[parent[i]])) {
+			ns = -1;
+		}
+		nextElement[i] = (ns < 0 ? -1 : ((flags[ns] & Tag) ? ns : nextElement[ns]));
+	}
+}
+
+/*!
+ * Looks up a tag name, ignoring case.
+ *
+ * \param name The tag name
+ * \returns The index of the name in tagNames, or -1 if no node has the
+ *          tag
+ */
+int FlatDocument::tagId(const std::string &name) const
+{
+	for (size_t t = 0; t < tagNames.size(); ++t) {
+		if (!::strcasecmp(tagNames[t].c_str(), name.c_str())) {
+			return t;
+		}
+	}
+	return -1;
+}
+
+/*!
+ * Looks up a class name, ignoring case.
+ *
+ * \param name The class name
+ * \returns The index of the name in classNames, or -1 if no element has
+ *          the class
+ */
+int FlatDocument::classId(const std::string &name) const
+{
+	std::string s(name);
+	std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+	std::vector<std::string>::const_iterator it = std::lower_bound(classNames.begin(), classNames.end(), s);
+	if (it == classNames.end() || *it != s) {
+		return -1;
+	}
+	return it - classNames.begin();
+}
+
+/*!
+ * Looks up the value of an id attribute, ignoring case.
+ *
+ * \param id The id
+ * \returns The index of the id in idNames, or -1 if no element has the id
+ */
+int FlatDocument::idId(const std::string &id) const
+{
+	std::string s(id);
+	std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+	std::vector<std::string>::const_iterator it = std::lower_bound(idNames.begin(), idNames.end(), s);
+	if (it == idNames.end() || *it != s) {
+		return -1;
+	}
+	return it - idNames.begin();
+}
+
+/*!
+ * Writes the snapshot to a stream in a binary format that can be queried
+ * in place using MappedDocument. This includes the node structure,
+ * interned names, attribute values and the offsets of nodes in the
+ * source, but not the source itself.
+ *
+ * \param out The output stream, which should be opened in binary mode
+ * \param indexes Whether to include the tag, class and id indexes
+ * \returns true on success
+ */
+bool FlatDocument::save(std::ostream &out, bool indexes) const
+{
+	// Names are stored as null-terminated strings
+	std::string strings;
+	std::vector<int> names[4];
+	const std::vector<std::string> *lists[4] = { &tagNames, &attrNames, &classNames, &idNames };
+	for (int k = 0; k < (indexes ? 4 : 3); ++k) {
+		for (size_t j = 0; j < lists[k]->size(); ++j) {
+			names[k].push_back(strings.length());
+			strings += (*lists[k])[j];
+			strings += '\0';
+		}
+	}
+
+	const char *data[NumSections] = {
+		bytes(parent), bytes(prevElement), bytes(nextElement), bytes(end),
+		bytes(depth), bytes(tag), bytes(flags), bytes(offset), bytes(length),
+		bytes(attrBegin), bytes(attrName), bytes(attrValue), bytes(attrLength),
+		bytes(classBegin), bytes(classTokens), values.data(), strings.data(),
+		bytes(names[0]), bytes(names[1]), bytes(names[2]), bytes(names[3]),
+		bytes(tagBegin), bytes(tagNodes), bytes(classNodeBegin), bytes(classNodes),
+		bytes(idBegin), bytes(idNodes)
+	};
+	size_t counts[NumSections] = {
+		parent.size(), prevElement.size(), nextElement.size(), end.size(),
+		depth.size(), tag.size(), flags.size(), offset.size(), length.size(),
+		attrBegin.size(), attrName.size(), attrValue.size(), attrLength.size(),
+		classBegin.size(), classTokens.size(), values.length(), strings.length(),
+		names[0].size(), names[1].size(), names[2].size(), names[3].size(),
+		tagBegin.size(), tagNodes.size(), classNodeBegin.size(), classNodes.size(),
+		idBegin.size(), idNodes.size()
+	};
+	if (!indexes) {
+		for (int i = TagBeginSection; i < NumSections; ++i) {
+			counts[i] = 0;
+		}
+	}
+
+	FileHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "HCXF", 4);
+	h.version = 1;
+	h.byteOrder = 0x01020304;
+	h.nodes = size();
+	h.root = root;
+	h.maxDepth = maxDepth;
+	size_t pos = (sizeof(h) + 7) & ~(size_t)7;
+	for (int i = 0; i < NumSections; ++i) {
+		h.sections[i][0] = pos;
+		h.sections[i][1] = counts[i];
+		pos = (pos + counts[i] * sectionSize(i) + 7) & ~(size_t)7;
+	}
+
+	static const char padding[8] = { 0 };
+	out.write((const char *)&h, sizeof(h));
+	pos = sizeof(h);
+	for (int i = 0; i < NumSections; ++i) {
+		out.write(padding, h.sections[i][0] - pos);
+		out.write(data[i], counts[i] * sectionSize(i));
+		pos = h.sections[i][0] + counts[i] * sectionSize(i);
+	}
+	return out.good();
+}
+
+/*!
+ * Removes all nodes from the snapshot.
+ */
+void FlatDocument::clear()
+{
+	nodes.clear();
+	parent.clear();
+	prevElement.clear();
+	nextElement.clear();
+	end.clear();
+	depth.clear();
+	tag.clear();
+	flags.clear();
+	offset.clear();
+	length.clear();
+	attrBegin.clear();
+	attrName.clear();
+	attrValue.clear();
+	attrLength.clear();
+	tagNames.clear();
+	tagBegin.clear();
+	tagNodes.clear();
+	classBegin.clear();
+	classTokens.clear();
+	classNames.clear();
+	classNodeBegin.clear();
+	classNodes.clear();
+	idNames.clear();
+	idBegin.clear();
+	idNodes.clear();
+	maxDepth = 0;
+	attrNames.clear();
+	values.clear();
+	root = -1;
+}
+
+/*!
+ * Applies a CSS selector expression to the snapshot.
+ *
+ * \param expr The CSS selector expression
+ * \param stats Optional statistics for this call
+ * \returns A set of nodes of the original tree that matches the given selector
+ * \throws ParseException CSS selector parsing error
+ */
+NodeSet FlatDocument::select(const std::string &expr, Statistics *stats) const
+{
+	std::vector<int> v;
+	select(expr, &v, stats);
+	return nodeSet(v);
+}
+
+/*!
+ * Applies a compiled selector to the snapshot.
+ *
+ * \param selector The compiled selector
+ * \param stats Optional statistics for this call
+ * \returns A set of nodes of the original tree that matches the given selector
+ */
+NodeSet FlatDocument::select(const CompiledSelector &selector, Statistics *stats) const
+{
+	std::vector<int> v;
+	select(selector, &v, stats);
+	return nodeSet(v);
+}
+
+/*!
+ * Returns the original nodes for a list of node indices.
+ *
+ * \param indices Node indices in document order
+ * \returns The corresponding set of nodes
+ */
+NodeSet FlatDocument::nodeSet(const std::vector<int> &indices) const
+{
+	NodeSet result;
+	std::vector<int>::const_iterator it;
+	for (it = indices.begin(); it != indices.end(); ++it) {
+		result.insert(result.end(), nodes[*it]);
+	}
+	return result;
+}
+
+/*!
+ * Applies a CSS selector expression to the snapshot and stores the
+ * indices of matching nodes in document order.
+ *
+ * \param expr The CSS selector expression
+ * \param result Vector that receives the indices of matching nodes
+ * \param stats Optional statistics for this call
+ * \throws ParseException CSS selector parsing error
+ */
+void FlatDocument::select(const std::string &expr, std::vector<int> *result, Statistics *stats) const
+{
+	if (expr.empty()) {
+		if (stats) stats->clear();
+		result->clear();
+		if (root >= 0) result->push_back(root);
+		return;
+	}
+
+	double start = (stats ? now() : 0.0);
+	select(CompiledSelector(expr), result, stats);
+	if (stats) {
+		stats->time = now() - start;
+	}
+}
+
+/*!
+ * Applies a compiled selector to the snapshot and stores the indices of
+ * matching nodes in document order.
+ *
+ * \param selector The compiled selector
+ * \param result Vector that receives the indices of matching nodes
+ * \param stats Optional statistics for this call
+ */
+void FlatDocument::select(const CompiledSelector &selector, std::vector<int> *result, Statistics *stats) const
+{
+	double start = 0.0;
+	if (stats) {
+		stats->clear();
+		stats->stepCalls.resize(selector.data()->steps, 0);
+		start = now();
+	}
+
+	result->clear();
+	Context ctx(stats, true, &selector.data()->limits, &selector.data()->scratch);
+	if (root >= 0) {
+		// Selectors that are best matched by testing all nodes share a
+		// single scan
+		const std::vector<SelectorFn *> &fns = selector.data()->fns;
+		std::vector<SelectorFn *> scans;
+		for (size_t i = 0; i < fns.size(); ++i) {
+			Plan p = plan(*this, fns[i], root, end[root]);
+			if (p.strategy == Plan::Scan) {
+				scans.push_back(fns[i]);
+			} else {
+				execute(*this, p, fns[i], root, end[root], ctx, result);
+			}
+		}
+		if (!scans.empty()) {
+			match(*this, root, end[root], scans, ctx, result);
+		}
+		if (fns.size() > 1) {
+			std::sort(result->begin(), result->end());
+			result->erase(std::unique(result->begin(), result->end()), result->end());
+		}
+	}
+
+	if (stats) {
+		stats->time = now() - start;
+	}
+}
+
+
+
+/*!
+ * Constructs an empty document.
+ */
+MappedDocument::MappedDocument()
+	: source(NULL), m_map(NULL), m_mapSize(0)
+{
+	close();
+}
+
+/*!
+ * Destructor, unmapping the document file if necessary.
+ */
+MappedDocument::~MappedDocument()
+{
+	close();
+}
+
+/*!
+ * Maps a file that has been written by FlatDocument::save() into memory.
+ *
+ * \param path The path of the file
+ * \returns false if the file cannot be mapped or is invalid
+ */
+bool MappedDocument::open(const std::string &path)
+{
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	::close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	if (!open(map, st.st_size)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	m_map = map;
+	m_mapSize = st.st_size;
+	return true;
+}
+
+/*!
+ * Uses a buffer containing the data written by FlatDocument::save(). The
+ * buffer is not copied and must outlive the document.
+ *
+ * \param data The data, aligned to at least 4 bytes
+ * \param size The size of the data
+ * \returns false if the data is invalid
+ */
+bool MappedDocument::open(const void *data, size_t size)
+{
+	close();
+	const char *base = (const char *)data;
+	const FileHeader *h = (const FileHeader *)data;
+	if (((size_t)data & 3) || size < sizeof(FileHeader) || memcmp(h->magic, "HCXF", 4)
+		|| h->version != 1 || h->byteOrder != 0x01020304 || h->nodes < 0) {
+		return false;
+	}
+
+	// All sections must be within the data and match the number of nodes
+	// and names
+	const unsigned int (*sections)[2] = h->sections;
+	for (int i = 0; i < NumSections; ++i) {
+		if ((sections[i][0] & 3) || sections[i][0] > size
+			|| sections[i][1] > (size - sections[i][0]) / sectionSize(i)) {
+			return false;
+		}
+	}
+	unsigned int n = h->nodes;
+	unsigned int tags = sections[TagNamesSection][1], attrs = sections[AttrNamesSection][1];
+	unsigned int classes = sections[ClassNamesSection][1], ids = sections[IdNamesSection][1];
+	bool indexes = (sections[TagBeginSection][1] > 0);
+	for (int i = ParentSection; i <= LengthSection; ++i) {
+		if (sections[i][1] != n) return false;
+	}
+	if (sections[AttrBeginSection][1] != n + 1 || sections[ClassBeginSection][1] != n + 1
+		|| sections[AttrValueSection][1] != sections[AttrNameSection][1]
+		|| sections[AttrLengthSection][1] != sections[AttrNameSection][1]
+		|| (indexes && (sections[TagBeginSection][1] != tags + 1 || sections[TagNodesSection][1] != n
+			|| sections[ClassNodeBeginSection][1] != classes + 1 || sections[IdBeginSection][1] != ids + 1))
+		|| h->root < -1 || h->root >= (int)n) {
+		return false;
+	}
+
+	// Names must be null-terminated strings within the string table
+	const char *strings = base + sections[StringsSection][0];
+	unsigned int chars = sections[StringsSection][1];
+	if (chars > 0 && strings[chars - 1] != '\0') {
+		return false;
+	}
+	for (int i = TagNamesSection; i <= IdNamesSection; ++i) {
+		const int *offsets = (const int *)(base + sections[i][0]);
+		for (unsigned int j = 0; j < sections[i][1]; ++j) {
+			if (offsets[j] < 0 || (unsigned int)offsets[j] >= chars) return false;
+		}
+	}
+
+	parent = (const int *)(base + sections[ParentSection][0]);
+	prevElement = (const int *)(base + sections[PrevElementSection][0]);
+	nextElement = (const int *)(base + sections[NextElementSection][0]);
+	end = (const int *)(base + sections[EndSection][0]);
+	depth = (const int *)(base + sections[DepthSection][0]);
+	tag = (const int *)(base + sections[TagSection][0]);
+	flags = (const unsigned char *)(base + sections[FlagsSection][0]);
+	offset = (const unsigned int *)(base + sections[OffsetSection][0]);
+	length = (const unsigned int *)(base + sections[LengthSection][0]);
+	attrBegin = (const int *)(base + sections[AttrBeginSection][0]);
+	attrName = (const int *)(base + sections[AttrNameSection][0]);
+	attrValue = (const int *)(base + sections[AttrValueSection][0]);
+	attrLength = (const int *)(base + sections[AttrLengthSection][0]);
+	classBegin = (const int *)(base + sections[ClassBeginSection][0]);
+	classTokens = (const int *)(base + sections[ClassTokensSection][0]);
+	values = base + sections[ValuesSection][0];
+	m_strings = strings;
+	for (int k = 0; k < 4; ++k) {
+		m_names[k] = (const int *)(base + sections[TagNamesSection + k][0]);
+	}
+	if (indexes) {
+		tagBegin = (const int *)(base + sections[TagBeginSection][0]);
+		tagNodes = (const int *)(base + sections[TagNodesSection][0]);
+		classNodeBegin = (const int *)(base + sections[ClassNodeBeginSection][0]);
+		classNodes = (const int *)(base + sections[ClassNodesSection][0]);
+		idBegin = (const int *)(base + sections[IdBeginSection][0]);
+		idNodes = (const int *)(base + sections[IdNodesSection][0]);
+	}
+	nodeCount = n;
+	tagCount = tags;
+	attrCount = attrs;
+	classCount = classes;
+	idCount = ids;
+	maxDepth = h->maxDepth;
+	root = h->root;
+	return true;
+}
+
+/*!
+ * Closes the document, unmapping the document file if necessary.
+ */
+void MappedDocument::close()
+{
+	if (m_map) {
+		munmap(m_map, m_mapSize);
+	}
+	m_map = NULL;
+	m_mapSize = 0;
+	m_strings = NULL;
+	for (int k = 0; k < 4; ++k) {
+		m_names[k] = NULL;
+	}
+
+	parent = prevElement = nextElement = end = depth = tag = NULL;
+	flags = NULL;
+	offset = length = NULL;
+	attrBegin = attrName = attrValue = attrLength = classBegin = classTokens = NULL;
+	tagBegin = tagNodes = classNodeBegin = classNodes = idBegin = idNodes = NULL;
+	values = NULL;
+	nodeCount = tagCount = attrCount = classCount = idCount = 0;
+	maxDepth = 0;
+	root = -1;
+}
+
+/*!
+ * Applies a CSS selector expression to the document and stores the
+ * indices of matching nodes in document order.
+ *
+ * \param expr The CSS selector expression
+ * \param result Vector that receives the indices of matching nodes
+ * \param stats Optional statistics for this call
+ * \throws ParseException CSS selector parsing error
+ */
+void MappedDocument::select(const std::string &expr, std::vector<int> *result, Statistics *stats) const
+{
+	if (expr.empty()) {
+		if (stats) stats->clear();
+		result->clear();
+		if (root >= 0) result->push_back(root);
+		return;
+	}
+
+	double start = (stats ? now() : 0.0);
+	select(CompiledSelector(expr), result, stats);
+	if (stats) {
+		stats->time = now() - start;
+	}
+}
+
+/*!
+ * Applies a compiled selector to the document and stores the indices of
+ * matching nodes in document order.
+ *
+ * \param selector The compiled selector
+ * \param result Vector that receives the indices of matching nodes
+ * \param stats Optional statistics for this call
+ */
+void MappedDocument::select(const CompiledSelector &selector, std::vector<int> *result, Statistics *stats) const
+{
+	double start = 0.0;
+	if (stats) {
+		stats->clear();
+		stats->stepCalls.resize(selector.data()->steps, 0);
+		start = now();
+	}
+
+	result->clear();
+	Context ctx(stats, true, &selector.data()->limits, &selector.data()->scratch);
+	if (root >= 0) {
+		// Selectors without an indexed type, class or id in their
+		// rightmost sequence share a single scan
+		const std::vector<SelectorFn *> &fns = selector.data()->fns;
+		std::vector<SelectorFn *> scans;
+		for (size_t i = 0; i < fns.size(); ++i) {
+			const int *first, *last;
+			if (!seeds(*this, fns[i], &first, &last)) {
+				scans.push_back(fns[i]);
+				continue;
+			}
+
+			first = std::lower_bound(first, last, root);
+			last = std::lower_bound(first, last, end[root]);
+			Selectors::MappedRef ref = { this, 0 };
+			for (; first < last; ++first) {
+				ref.i = *first;
+				ctx.visit();
+				++ctx.candidates;
+				if (fns[i]->match(ref, ctx)) {
+					result->push_back(ref.i);
+				}
+			}
+		}
+		if (!scans.empty()) {
+			match(*this, root, end[root], scans, ctx, result);
+		}
+		if (fns.size() > 1) {
+			std::sort(result->begin(), result->end());
+			result->erase(std::unique(result->begin(), result->end()), result->end());
+		}
+	}
+
+	if (stats) {
+		stats->time = now() - start;
+	}
+}
+
+/*!
+ * Looks up a tag name, ignoring case.
+ *
+ * \param name The tag name
+ * \returns The index of the name, or -1 if no node has the tag
+ */
+int MappedDocument::tagId(const std::string &name) const
+{
+	for (int t = 0; t < tagCount; ++t) {
+		if (!::strcasecmp(tagName(t), name.c_str())) {
+			return t;
+		}
+	}
+	return -1;
+}
+
+// Looks up a lower-case name in a sorted list of names
+static int findName(const char *strings, const int *names, int count, const std::string &name)
+{
+	std::string s(name);
+	std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+	int lo = 0, hi = count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		int c = strcmp(strings + names[mid], s.c_str());
+		if (c == 0) {
+			return mid;
+		} else if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+/*!
+ * Looks up a class name, ignoring case.
+ *
+ * \param name The class name
+ * \returns The index of the name, or -1 if no element has the class
+ */
+int MappedDocument::classId(const std::string &name) const
+{
+	return findName(m_strings, m_names[2], classCount, name);
+}
+
+/*!
+ * Looks up the value of an id attribute, ignoring case. This requires
+ * the document to contain indexes.
+ *
+ * \param id The id
+ * \returns The index of the id, or -1 if no element has the id
+ */
+int MappedDocument::idId(const std::string &id) const
+{
+	return findName(m_strings, m_names[3], idCount, id);
+}
+
+/*!
+ * Returns an interned lower-case tag name.
+ */
+const char *MappedDocument::tagName(int t) const
+{
+	return m_strings + m_names[0][t];
+}
+
+/*!
+ * Returns an interned attribute name.
+ */
+const char *MappedDocument::attributeName(int a) const
+{
+	return m_strings + m_names[1][a];
+}
+
+/*!
+ * Returns a lower-case class name. Class names are sorted.
+ */
+const char *MappedDocument::className(int k) const
+{
+	return m_strings + m_names[2][k];
+}
+
+/*!
+ * Returns a lower-case id value. Ids are sorted.
+ */
+const char *MappedDocument::idName(int k) const
+{
+	return m_strings + m_names[3][k];
+}
+
+
+// Describes how a selector expression is matched against a flat document.
+std::string explain(const std::string &expr, const FlatDocument &doc)
+{
+	CompiledSelector selector(expr);
+	const std::vector<SelectorFn *> &fns = selector.data()->fns;
+	int begin = doc.root, end = (doc.root >= 0 ? doc.end[doc.root] : 0);
+
+	std::ostringstream ss;
+	ss << "expression: " << selector.expression() << "\n";
+	ss << "document: " << doc.size() << " nodes, " << doc.tagNames.size() << " tags, "
+		<< doc.classNames.size() << " classes, " << doc.idNames.size() << " ids, "
+		<< "maximum depth " << doc.maxDepth << "\n";
+
+	for (size_t i = 0; i < fns.size() && begin >= 0; ++i) {
+		std::vector<Plan> alternatives;
+		Plan p = plan(doc, fns[i], begin, end, &alternatives);
+
+		Context ctx(NULL, true, &selector.data()->limits, &selector.data()->scratch);
+		std::vector<int> result;
+		execute(doc, p, fns[i], begin, end, ctx, &result);
+
+		ss << "selector " << (i + 1) << ": " << p.describe() << "\n";
+		ss << "  estimated: " << (long)p.candidates << " nodes, cost " << (long)p.cost << "\n";
+		ss << "  actual: " << ctx.candidates << " nodes, " << result.size() << " matches\n";
+		for (size_t j = 0; j < alternatives.size(); ++j) {
+			ss << "  considered: " << alternatives[j].describe() << ", "
+				<< (long)alternatives[j].candidates << " nodes, cost "
+				<< (long)alternatives[j].cost << "\n";
+		}
+	}
+	return ss.str();
+}
+
+
+/*!
+ * Constructs an empty summary.
+ */
+SubtreeSummary::SubtreeSummary()
+	: root(-1)
+{
+}
+
+/*!
+ * Constructs the summary of the given tree.
+ *
+ * \param tree The HTML tree
+ */
+SubtreeSummary::SubtreeSummary(const tree<htmlcxx::HTML::Node> &tree)
+	: root(-1)
+{
+	build(tree);
+}
+
+/*!
+ * Builds the summary of the given tree, replacing the current contents.
+ * The attributes of all elements will be parsed.
+ *
+ * \param tree The HTML tree
+ */
+void SubtreeSummary::build(const tree<htmlcxx::HTML::Node> &tree)
+{
+	clear();
+
+	std::vector<int> open; // Indices of currently open ancestors
+	int i = 0;
+
+	::tree<HTMLNode>::iterator it;
+	for (it = tree.begin(); it != tree.end(); ++it, ++i) {
+		// The bits of closed subtrees are added to their parents
+		while (!open.empty() && nodes[open.back()] != it.node->parent) {
+			int j = open.back();
+			open.pop_back();
+			end[j] = i;
+			if (!open.empty()) bits[open.back()] |= bits[j];
+		}
+
+		Bits b = 0;
+		if (it->isTag()) {
+			b |= summaryBit('t', it->tagName());
+			if (root < 0 && !strcasecmp(it->tagName(), "html")) {
+				root = i;
+			}
+
+			if (it->attributes().empty()) it->parseAttributes();
+			std::map<std::string, std::string>::const_iterator at = it->attributes().find("id");
+			if (at != it->attributes().end() && !at->second.empty()) {
+				b |= summaryBit('i', at->second);
+			}
+			at = it->attributes().find("class");
+			if (at != it->attributes().end()) {
+				std::istringstream ss(at->second);
+				std::string token;
+				while (ss >> token) {
+					b |= summaryBit('c', token);
+				}
+			}
+		}
+
+		nodes.push_back(it.node);
+		end.push_back(0);
+		bits.push_back(b);
+		open.push_back(i);
+	}
+	while (!open.empty()) {
+		int j = open.back();
+		open.pop_back();
+		end[j] = i;
+		if (!open.empty()) bits[open.back()] |= bits[j];
+	}
+}
+
+/*!
+ * Removes all nodes from the summary.
+ */
+void SubtreeSummary::clear()
+{
+	nodes.clear();
+	end.clear();
+	bits.clear();
+	root = -1;
+}
+
+/*!
+ * Applies a CSS selector expression to the summarized tree.
+ *
+ * \param expr The CSS selector expression
+ * \param stats Optional statistics for this call
+ * \returns A set of nodes that matches the given selector
+ * \throws ParseException CSS selector parsing error
+ */
+NodeSet SubtreeSummary::select(const std::string &expr, Statistics *stats) const
+{
+	if (expr.empty()) {
+		if (stats) stats->clear();
+		NodeSet v;
+		if (root >= 0) v.insert(nodes[root]);
+		return v;
+	}
+
+	double start = (stats ? now() : 0.0);
+	NodeSet result = select(CompiledSelector(expr), stats);
+	if (stats) {
+		stats->time = now() - start;
+	}
+	return result;
+}
+
+/*!
+ * Applies a compiled selector to the summarized tree, skipping subtrees
+ * that cannot contain a match.
+ *
+ * \param selector The compiled selector
+ * \param stats Optional statistics for this call
+ * \returns A set of nodes that matches the given selector
+ */
+NodeSet SubtreeSummary::select(const CompiledSelector &selector, Statistics *stats) const
+{
+	double start = 0.0;
+	if (stats) {
+		stats->clear();
+		stats->stepCalls.resize(selector.data()->steps, 0);
+		start = now();
+	}
+
+	const std::vector<SelectorFn *> &fns = selector.data()->fns;
+	const std::vector<Bits> &masks = selector.data()->masks;
+	Context ctx(stats, true, &selector.data()->limits, &selector.data()->scratch);
+	NodeSet result;
+	for (int i = root; i >= 0 && i < end[root]; ) {
+		size_t j = 0;
+		while (j < masks.size() && (bits[i] & masks[j]) != masks[j]) ++j;
+		if (j == masks.size()) {
+			i = end[i];
+			continue;
+		}
+
+		ctx.visit();
+		for (j = 0; j < fns.size(); ++j) {
+			if (fns[j]->match(nodes[i], ctx)) {
+				result.insert(result.end(), nodes[i]);
+				break;
+			}
+		}
+		++i;
+	}
+
+	if (stats) {
+		stats->time = now() - start;
+	}
+	return result;
+}
+
+
+/*!
+ * Constructs a live selection containing all nodes of a tree that match
+ * the given selector.
+ *
+ * \param tree The HTML tree
+ * \param selector The compiled selector
+ */
+LiveSelection::LiveSelection(const tree<htmlcxx::HTML::Node> &tree, const CompiledSelector &selector)
+	: m_selector(selector), m_root(findRoot(tree))
+{
+	if (m_root) {
+		refreshSubtree(m_root);
+	}
+}
+
+/*!
+ * Updates the selection after a subtree has been inserted into the tree.
+ *
+ * \param node The root node of the inserted subtree
+ */
+void LiveSelection::inserted(Node *node)
+{
+	if (!inScope(node)) {
+		return;
+	}
+	refreshSubtree(node);
+	if (node != m_root) {
+		refreshContext(node->parent, node->next_sibling, node);
+	}
+}
+
+/*!
+ * Updates the selection after a node has been modified, e.g. if its
+ * attributes or its tag name have changed.
+ *
+ * \param node The modified node
+ */
+void LiveSelection::changed(Node *node)
+{
+	inserted(node);
+}
+
+/*!
+ * Updates the selection before a subtree will be removed from the tree.
+ * All nodes of the subtree are removed from the selection immediately.
+ * Nodes depending on the removed subtree will be matched again by the
+ * next call to update(), i.e. after the subtree has been removed.
+ *
+ * \param node The root node of the subtree that will be removed
+ */
+void LiveSelection::removing(Node *node)
+{
+	dropSubtree(node);
+
+	std::vector<Removal>::iterator it = m_pending.begin();
+	while (it != m_pending.end()) {
+		Node *p = it->parent;
+		while (p && p != node) p = p->parent;
+		if (p == node) {
+			it = m_pending.erase(it);
+			continue;
+		}
+		if (it->next == node) {
+			it->next = node->next_sibling;
+		}
+		++it;
+	}
+
+	if (node == m_root) {
+		m_root = NULL;
+	} else if (inScope(node)) {
+		Removal r = { node->parent, node->next_sibling };
+		m_pending.push_back(r);
+	}
+}
+
+/*!
+ * Matches all nodes depending on removed subtrees again.
+ * This is done automatically by nodes() and contains().
+ */
+void LiveSelection::update()
+{
+	std::vector<Removal> pending;
+	pending.swap(m_pending);
+	for (size_t i = 0; i < pending.size(); ++i) {
+		refreshContext(pending[i].parent, pending[i].next, NULL);
+	}
+}
+
+/*!
+ * Returns the current set of matching nodes.
+ */
+NodeSet LiveSelection::nodes()
+{
+	update();
+	return NodeSet(m_nodes.begin(), m_nodes.end());
+}
+
+/*!
+ * Checks whether a node is part of the selection.
+ *
+ * \param node The node
+ * \returns \p true if the node is part of the selection
+ */
+bool LiveSelection::contains(Node *node)
+{
+	update();
+	return (m_nodes.find(node) != m_nodes.end());
+}
+
+// Checks whether a node is part of the <html> subtree
+bool LiveSelection::inScope(Node *node) const
+{
+	while (node && node != m_root) {
+		node = node->parent;
+	}
+	return (node != NULL);
+}
+
+// Matches a single node again
+void LiveSelection::refresh(Node *node)
+{
+	if (m_selector.matches(node)) {
+		m_nodes.insert(node);
+	} else {
+		m_nodes.erase(node);
+	}
+}
+
+// Matches all nodes of a subtree again
+void LiveSelection::refreshSubtree(Node *node)
+{
+	std::stack<Node *> stack;
+	stack.push(node);
+	while (!stack.empty()) {
+		node = stack.top();
+		stack.pop();
+		refresh(node);
+		for (Node *child = node->last_child; child; child = child->prev_sibling) {
+			stack.push(child);
+		}
+	}
+}
+
+// Matches all nodes again whose matching may depend on a modified
+// child of the given parent
+void LiveSelection::refreshContext(Node *parent, Node *next, Node *node)
+{
+	int features = m_selector.data()->features;
+	if (features & Selectors::LeftStructural) {
+		m_nodes.clear();
+		if (m_root) {
+			refreshSubtree(m_root);
+		}
+		return;
+	}
+
+	for (Node *p = parent; p; p = p->parent) {
+		refresh(p);
+		if (p == m_root) break;
+
+		// Anchors of :has(+ ...) and :has(~ ...) precede the ancestors
+		if (features & Selectors::Preceding) {
+			for (Node *s = p->prev_sibling; s; s = s->prev_sibling) {
+				refresh(s);
+			}
+		}
+	}
+
+	if (features & Selectors::Sibling) {
+		for (Node *s = next; s; s = s->next_sibling) {
+			refreshSubtree(s);
+		}
+	}
+
+	if (features & (Selectors::Positional | Selectors::LeftPositional)) {
+		for (Node *s = parent->first_child; s; s = s->next_sibling) {
+			if (s == node) continue;
+			if (features & Selectors::LeftPositional) {
+				refreshSubtree(s);
+			} else {
+				refresh(s);
+			}
+		}
+	}
+}
+
+// Removes all nodes of a subtree from the selection
+void LiveSelection::dropSubtree(Node *node)
+{
+	std::stack<Node *> stack;
+	stack.push(node);
+	while (!stack.empty()) {
+		node = stack.top();
+		stack.pop();
+		m_nodes.erase(node);
+		for (Node *child = node->first_child; child; child = child->next_sibling) {
+			stack.push(child);
+		}
+	}
+}
+
+
+/*!
+ * Constructs an empty set of counters.
+ */
+QueryCache::Statistics::Statistics()
+	: hits(0), prefixHits(0), misses(0), evictions(0), invalidations(0)
+{
+}
+
+/*!
+ * Returns the share of queries that have been answered using cached
+ * results, including those computed from the result of a prefix.
+ */
+double QueryCache::Statistics::hitRate() const
+{
+	unsigned long n = hits + prefixHits + misses;
+	return (n ? (double)(hits + prefixHits) / n : 0.0);
+}
+
+/*!
+ * Constructs an empty cache for a tree.
+ *
+ * \param tree The HTML tree, which must outlive the cache
+ * \param maxEntries Maximum number of cached results
+ * \param maxNodes Maximum total number of nodes in all cached results.
+ *        The most recent result is always kept, even if it exceeds the
+ *        limit.
+ */
+QueryCache::QueryCache(const tree<htmlcxx::HTML::Node> &tree, size_t maxEntries, size_t maxNodes)
+	: m_tree(&tree), m_maxEntries(std::max(maxEntries, (size_t)1)), m_maxNodes(maxNodes), m_nodes(0)
+{
+}
+
+/*!
+ * Applies a CSS selector expression to the tree, using cached results if
+ * possible.
+ *
+ * \param expr The CSS selector expression
+ * \returns The set of matching nodes, which remains valid until the next
+ *          call to select() or invalidate()
+ * \throws ParseException CSS selector parsing error
+ */
+const NodeSet &QueryCache::select(const std::string &expr)
+{
+	size_t split;
+	std::string key = normalize(expr, &split);
+	return lookup(key, expr, split);
+}
+
+/*!
+ * Drops all cached results. This must be called whenever the tree is
+ * modified.
+ */
+void QueryCache::invalidate()
+{
+	m_entries.clear();
+	m_uses.clear();
+	m_nodes = 0;
+	++m_stats.invalidations;
+}
+
+// Returns the result for a normalized expression, computing it from the
+// result of its prefix if the expression has been split. Only lookups
+// with count set are recorded in the statistics, so computing a prefix
+// does not count as a query of its own.
+const NodeSet &QueryCache::lookup(const std::string &key, const std::string &expr, size_t split, bool count)
+{
+	std::map<std::string, Entry>::iterator it = m_entries.find(key);
+	if (it != m_entries.end()) {
+		m_stats.hits += count;
+		m_uses.splice(m_uses.begin(), m_uses, it->second.use);
+		return it->second.nodes;
+	}
+
+	// Parse the whole expression first, so errors are reported as usual
+	CompiledSelector selector(expr);
+	NodeSet result;
+	if (split == std::string::npos) {
+		m_stats.misses += count;
+		hcxselect::select(*m_tree, selector).swap(result);
+	} else {
+		std::string prefix = key.substr(0, split);
+		size_t psplit;
+		normalize(prefix, &psplit);
+		bool cached = (m_entries.find(prefix) != m_entries.end());
+		const NodeSet &parents = lookup(prefix, prefix, psplit, false);
+		if (count) {
+			++(cached ? m_stats.prefixHits : m_stats.misses);
+		}
+
+		// Match the descendants or children of the prefix nodes against
+		// the last sequence, skipping subtrees that have been covered
+		CompiledSelector last(key.substr(split + 1));
+		const SelectorFn *fn = last.data()->fns[0];
+		Context ctx(NULL, true);
+		Node *covered = NULL;
+		for (NodeSet::const_iterator jt = parents.begin(); jt != parents.end(); ++jt) {
+			Node *top = *jt;
+			if (key[split] == '>') {
+				for (Node *node = top->first_child; node; node = node->next_sibling) {
+					ctx.visit();
+					if (fn->match(node, ctx)) {
+						result.insert(node);
+					}
+				}
+				continue;
+			}
+
+			Node *p = top->parent;
+			while (p && p != covered) p = p->parent;
+			if (p) continue;
+			covered = top;
+			for (Node *node = following(top, top); node; node = following(node, top)) {
+				ctx.visit();
+				if (fn->match(node, ctx)) {
+					result.insert(result.end(), node);
+				}
+			}
+		}
+	}
+
+	// The prefix may have been evicted meanwhile, so look up again
+	it = m_entries.insert(std::make_pair(key, Entry())).first;
+	it->second.nodes.swap(result);
+	m_uses.push_front(key);
+	it->second.use = m_uses.begin();
+	m_nodes += it->second.nodes.size();
+	evict();
+	return it->second.nodes;
+}
+
+// Drops the least recently used results until the cache fits into its
+// limits, keeping at least the most recent one
+void QueryCache::evict()
+{
+	while (m_uses.size() > 1 && (m_entries.size() > m_maxEntries || m_nodes > m_maxNodes)) {
+		std::map<std::string, Entry>::iterator it = m_entries.find(m_uses.back());
+		m_nodes -= it->second.nodes.size();
+		m_entries.erase(it);
+		m_uses.pop_back();
+		++m_stats.evictions;
+	}
+}
+
+
+// Selectors of a rule set, bucketed by the id, class or type of their
+// rightmost sequence
+struct RuleSet::Data
+{
+	// Selector of a rule, with the summary bits of the sequences that
+	// must match ancestors
+	struct Entry
+	{
+		SelectorFn *fn;
+		int rule;
+		SubtreeSummary::Bits ancestors;
+	};
+
+	// Ids, classes and types are compared ignoring case
+	struct NoCase
+	{
+		bool operator()(const std::string &a, const std::string &b) const
+		{
+			return ::strcasecmp(a.c_str(), b.c_str()) < 0;
+		}
+	};
+
+	typedef std::map<std::string, std::vector<Entry>, NoCase> Buckets;
+
+	Data() : rules(0), steps(0) { }
+	~Data() { delete_all(fns); }
+
+	// Adds a selector to the bucket of the id, a class or the type of its
+	// rightmost sequence, preferring the most selective one
+	void insert(SelectorFn *fn, int rule)
+	{
+		Buckets *buckets = NULL;
+		const std::string *key = NULL;
+		const std::vector<SelectorFn *> &seq = Selectors::rightmost(fn)->fns;
+		for (size_t i = 0; i < seq.size(); ++i) {
+			Selectors::Atom a = Selectors::atom(seq[i]);
+			if (a.kind == Selectors::Atom::IdAtom) {
+				buckets = &ids;
+				key = a.name;
+				break;
+			} else if (a.kind == Selectors::Atom::ClassAtom && buckets != &classes) {
+				buckets = &classes;
+				key = a.name;
+			} else if (a.kind == Selectors::Atom::TypeAtom && !buckets) {
+				buckets = &tags;
+				key = a.name;
+			}
+		}
+
+		Entry e = { fn, rule, ancestorMask(fn) };
+		(buckets ? (*buckets)[*key] : universal).push_back(e);
+		fns.push_back(fn);
+	}
+
+	// Tests a node against the selectors of a bucket whose ancestor bits
+	// are all set in the summary bits of the node's ancestors, appending
+	// the ids of matching rules
+	static void test(const std::vector<Entry> &entries, Node *node, SubtreeSummary::Bits ancestors, Context &ctx, std::vector<int> *rules)
+	{
+		for (size_t i = 0; i < entries.size(); ++i) {
+			if (!(entries[i].ancestors & ~ancestors) && entries[i].fn->match(node, ctx)) {
+				rules->push_back(entries[i].rule);
+			}
+		}
+	}
+
+	// Tests a node against the selectors in the bucket of a name, if any
+	static void test(const Buckets &buckets, const std::string &name, Node *node, SubtreeSummary::Bits ancestors, Context &ctx, std::vector<int> *rules)
+	{
+		Buckets::const_iterator it = buckets.find(name);
+		if (it != buckets.end()) {
+			test(it->second, node, ancestors, ctx, rules);
+		}
+	}
+
+	Buckets ids, classes, tags;
+	std::vector<Entry> universal;
+	std::vector<SelectorFn *> fns;
+	int rules;
+	int steps;
+};
+
+/*!
+ * Constructs an empty rule set.
+ */
+RuleSet::RuleSet()
+	: d(new Data())
+{
+}
+
+/*!
+ * Destructor.
+ */
+RuleSet::~RuleSet()
+{
+	delete d;
+}
+
+/*!
+ * Parses a CSS selector expression and adds it as a new rule.
+ *
+ * \param expr The CSS selector expression
+ * \returns The id of the rule, which is the number of rules added before
+ * \throws ParseException CSS selector parsing error. The rule set is not
+ *         modified.
+ */
+int RuleSet::add(const std::string &expr)
+{
+	// Rules consisting of a single id, class or type are common in
+	// filter lists and don't need the lexer
+	Trivial trivial(trim(expr));
+	std::vector<SelectorFn *> fns;
+	int steps = 1;
+	if (trivial.shape != Trivial::None) {
+		fns.push_back(trivial.compile());
+	} else {
+		fns = parse(expr, &steps);
+	}
+
+	for (size_t i = 0; i < fns.size(); ++i) {
+		d->insert(fns[i], d->rules);
+	}
+	d->steps = std::max(d->steps, steps);
+	return d->rules++;
+}
+
+/*!
+ * Returns the number of rules.
+ */
+int RuleSet::size() const
+{
+	return d->rules;
+}
+
+/*!
+ * Matches all rules against a tree. Every node of the tree is visited
+ * once, and only tested against the rules in the buckets of its id,
+ * classes and type. Rules are skipped if the summary bits of the node's
+ * ancestors (see SubtreeSummary) lack the type, a class or the id of a
+ * sequence that must match an ancestor.
+ *
+ * \param tree The HTML tree
+ * \param matches Receives the matching nodes in document order, with the
+ *        ids of all rules matching a node in increasing order
+ * \param stats Optional statistics for this call
+ */
+void RuleSet::select(const tree<htmlcxx::HTML::Node> &tree, std::vector<RuleMatch> *matches, Statistics *stats) const
+{
+	typedef SubtreeSummary::Bits Bits;
+	double start = 0.0;
+	if (stats) {
+		stats->clear();
+		stats->stepCalls.resize(d->steps, 0);
+		start = now();
+	}
+
+	// Every rule is tested against the nodes of its bucket only, so
+	// precomputing the matches of :has() for the whole document does not
+	// pay off
+	matches->clear();
+	Context ctx(stats, false);
+	std::vector<int> rules;
+	std::string name;
+	Node *root = findRoot(tree);
+
+	// Summary bits of the ancestors of the nodes at each depth
+	std::vector<Bits> path(1, 0);
+	for (Node *p = (root ? root->parent : NULL); p; p = p->parent) {
+		path[0] |= summaryBit('t', p->data.tagName());
+	}
+
+	for (Node *node = root; node; ) {
+		ctx.visit();
+		rules.clear();
+		Bits ancestors = path.back(), bits = 0;
+		Data::test(d->universal, node, ancestors, ctx, &rules);
+
+		if (node->data.isTag()) {
+			bits |= summaryBit('t', node->data.tagName());
+			if (!d->tags.empty()) {
+				Data::test(d->tags, node->data.tagName(), node, ancestors, ctx, &rules);
+			}
+
+			const char *str, *end;
+			size_t len;
+			if (Selectors::TreeAccess::attribute(node, "id", ctx, &str, &len) && len > 0) {
+				name.assign(str, len);
+				bits |= summaryBit('i', name);
+				Data::test(d->ids, name, node, ancestors, ctx, &rules);
+			}
+			if (Selectors::TreeAccess::attribute(node, "class", ctx, &str, &len)) {
+				// Split the class attribute like [class~=...]
+				for (end = str + len; str < end; ) {
+					while (str < end && isspace(*str)) ++str;
+					const char *last = str;
+					while (str < end && !isspace(*str)) ++str;
+					if (str > last) {
+						name.assign(last, str);
+						bits |= summaryBit('c', name);
+						Data::test(d->classes, name, node, ancestors, ctx, &rules);
+					}
+				}
+			}
+		}
+
+		if (rules.size() > 1) {
+			std::sort(rules.begin(), rules.end());
+			rules.erase(std::unique(rules.begin(), rules.end()), rules.end());
+		}
+		for (size_t i = 0; i < rules.size(); ++i) {
+			RuleMatch m = { rules[i], node };
+			matches->push_back(m);
+		}
+
+		// Advance in document order, keeping track of the ancestors
+		if (node->first_child) {
+			path.push_back(ancestors | bits);
+			node = node->first_child;
+			continue;
+		}
+		while (node != root && !node->next_sibling) {
+			node = node->parent;
+			path.pop_back();
+		}
+		node = (node == root ? NULL : node->next_sibling);
+	}
+
+	if (stats) {
+		stats->time = now() - start;
+	}
 }
 
 } // namespace hcxselect
@@ -32,8 +32,12 @@
 #define HCXSELECT_H_
 
 #include <exception>
+#include <iosfwd>
+#include <list>
+#include <map>
 #include <string>
 #include <set>
+#include <vector>
 
 #include <htmlcxx/html/Node.h>
 #include <htmlcxx/html/tree.h>
@@ -72,25 +76,323 @@ struct NodeComp {
 typedef std::set<Node *, NodeComp> NodeSet;
 
 
+/*!
+ * Runtime statistics of a single select() call.
+ * The wall time is always recorded. All other counters are only
+ * maintained if the library has been compiled with
+ * \p HCXSELECT_STATISTICS defined, and are zero otherwise.
+ */
+struct Statistics
+{
+	Statistics();
+	void clear();
+
+	/*!
+	 * Number of nodes visited during traversal.
+	 */
+	unsigned long nodesVisited;
+
+	/*!
+	 * Number of invocations of simple selectors (type, attribute,
+	 * pseudo-class etc.).
+	 */
+	unsigned long predicateCalls;
+
+	/*!
+	 * Number of match invocations per selector step, i.e. per sequence
+	 * of simple selectors, in the order of their appearance in the
+	 * selector expression.
+	 */
+	std::vector<unsigned long> stepCalls;
+
+	/*!
+	 * Number of parent nodes inspected by descendant and child
+	 * combinators.
+	 */
+	unsigned long ancestorSteps;
+
+	/*!
+	 * Number of sibling nodes inspected by sibling combinators.
+	 */
+	unsigned long siblingSteps;
+
+	/*!
+	 * Number of calls to htmlcxx::HTML::Node::parseAttributes().
+	 */
+	unsigned long attributeParses;
+
+	/*!
+	 * Number of characters of text searched by \p :contains() and
+	 * \p :icontains().
+	 */
+	unsigned long textBytes;
+
+	/*!
+	 * Wall time in seconds, including parsing of the selector expression.
+	 */
+	double time;
+};
+
+
+/*!
+ * Flag for cancelling running queries, e.g. from another thread.
+ * Queries check the flag periodically while traversing the document
+ * and throw a LimitException once it is set.
+ */
+class CancellationToken
+{
+public:
+	CancellationToken() : m_cancelled(0) { }
+
+	/*!
+	 * Requests cancellation of all queries using this token.
+	 */
+	void cancel() { __atomic_store_n(&m_cancelled, 1, __ATOMIC_RELEASE); }
+
+	/*!
+	 * Clears the cancellation request.
+	 */
+	void reset() { __atomic_store_n(&m_cancelled, 0, __ATOMIC_RELEASE); }
+
+	/*!
+	 * Checks whether cancellation has been requested.
+	 */
+	bool cancelled() const { return __atomic_load_n(&m_cancelled, __ATOMIC_ACQUIRE); }
+
+private:
+	int m_cancelled;
+};
+
+
+/*!
+ * Limits on the work spent on a compiled selector, e.g. for selectors
+ * from untrusted sources. Complexity and nesting are checked when
+ * parsing the expression, the other limits apply to each query. A value
+ * of zero disables the respective limit. Exceeding a limit results in a
+ * LimitException.
+ */
+struct Limits
+{
+	Limits();
+
+	/*!
+	 * Maximum number of nodes visited during traversal.
+	 */
+	unsigned long maxNodes;
+
+	/*!
+	 * Maximum number of invocations of simple selectors, including
+	 * those for ancestors and siblings checked by combinators.
+	 */
+	unsigned long maxPredicates;
+
+	/*!
+	 * Maximum number of simple selectors and combinators in the
+	 * expression.
+	 */
+	unsigned int maxComplexity;
+
+	/*!
+	 * Maximum nesting depth of :not(), :is(), :where() and :has().
+	 */
+	unsigned int maxNesting;
+
+	/*!
+	 * Optional token for cancelling queries.
+	 */
+	const CancellationToken *token;
+};
+
+
+/*!
+ * A parsed CSS selector expression.
+ * Compiled selectors can be applied to any number of documents without
+ * parsing the expression again. Copies share the parsed expression, and
+ * a compiled selector may be used from multiple threads concurrently.
+ */
+class CompiledSelector
+{
+public:
+	explicit CompiledSelector(const std::string &expr);
+	CompiledSelector(const std::string &expr, const Limits &limits);
+	CompiledSelector(const CompiledSelector &other);
+	~CompiledSelector();
+
+	CompiledSelector &operator=(const CompiledSelector &other);
+
+	const std::string &expression() const;
+	bool matches(Node *node) const;
+
+	/*!
+	 * Opaque data of the compiled selector, for internal use.
+	 */
+	struct Data;
+	const Data *data() const { return d; }
+
+private:
+	Data *d;
+};
+
+
 /*!
  * Applies a CSS selector expression to a whole HTML tree.
  *
  * \param tree The HTML tree
  * \param expr The CSS selector expression
+ * \param stats Optional statistics for this call
  * \returns A set of nodes that matches the given selector
  * \throws ParseException CSS selector parsing error
  */
-NodeSet select(const tree<htmlcxx::HTML::Node> &tree, const std::string &expr);
+NodeSet select(const tree<htmlcxx::HTML::Node> &tree, const std::string &expr, Statistics *stats = NULL);
 
 /*!
  * Applies a CSS selector expression to a set of nodes.
  *
  * \param nodes The set of nodes
  * \param expr The CSS selector expression
+ * \param stats Optional statistics for this call
  * \returns A set of nodes that matches the given selector
  * \throws ParseException CSS selector parsing error
  */
-NodeSet select(const NodeSet &nodes, const std::string &expr);
+NodeSet select(const NodeSet &nodes, const std::string &expr, Statistics *stats = NULL);
+
+/*!
+ * Applies a compiled selector to a whole HTML tree.
+ *
+ * \param tree The HTML tree
+ * \param selector The compiled selector
+ * \param stats Optional statistics for this call
+ * \returns A set of nodes that matches the given selector
+ */
+NodeSet select(const tree<htmlcxx::HTML::Node> &tree, const CompiledSelector &selector, Statistics *stats = NULL);
+
+/*!
+ * Applies a compiled selector to a set of nodes.
+ *
+ * \param nodes The set of nodes
+ * \param selector The compiled selector
+ * \param stats Optional statistics for this call
+ * \returns A set of nodes that matches the given selector
+ */
+NodeSet select(const NodeSet &nodes, const CompiledSelector &selector, Statistics *stats = NULL);
+
+
+/*!
+ * Receives matching nodes one at a time, see select().
+ */
+class Visitor
+{
+public:
+	virtual ~Visitor() { }
+
+	/*!
+	 * Called for every matching node, in document order.
+	 *
+	 * \param node The matching node
+	 * \returns \p false to stop the selection
+	 */
+	virtual bool visit(Node *node) = 0;
+};
+
+/*!
+ * Applies a compiled selector to a whole HTML tree and passes every
+ * matching node to a visitor, in document order. No intermediate set of
+ * nodes is built, so the selection does not allocate memory besides
+ * parsing attributes of nodes that have not been inspected before.
+ *
+ * \param tree The HTML tree
+ * \param selector The compiled selector
+ * \param visitor The visitor, which may stop the selection
+ * \param stats Optional statistics for this call
+ */
+void select(const tree<htmlcxx::HTML::Node> &tree, const CompiledSelector &selector, Visitor &visitor, Statistics *stats = NULL);
+
+/*!
+ * Applies a compiled selector to a whole HTML tree and appends all
+ * matching nodes to a list, in document order. If the list is reused,
+ * repeated selections do not allocate memory once it is large enough.
+ *
+ * \param tree The HTML tree
+ * \param selector The compiled selector
+ * \param out The list of matching nodes
+ * \param stats Optional statistics for this call
+ */
+void selectInto(const tree<htmlcxx::HTML::Node> &tree, const CompiledSelector &selector, std::vector<Node *> *out, Statistics *stats = NULL);
+
+
+/*!
+ * Non-owning reference to a range of characters in the source of a
+ * document. The source must outlive the reference.
+ */
+struct StringRef
+{
+	StringRef() : data(NULL), length(0) { }
+	StringRef(const char *data, size_t length) : data(data), length(length) { }
+
+	/*!
+	 * Returns a copy of the referenced characters.
+	 */
+	std::string str() const { return std::string(data, length); }
+
+	const char *data; //!< First character, or NULL
+	size_t length;    //!< Number of characters
+};
+
+/*!
+ * Returns the source of a node, including the tags of elements.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param node The node
+ * \returns A reference into \p source
+ */
+StringRef outerHtml(const char *source, Node *node);
+
+/*!
+ * Returns the source of the contents of an element, i.e. everything
+ * between its opening and closing tags. For other nodes, the returned
+ * reference is empty.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param node The node
+ * \returns A reference into \p source
+ */
+StringRef innerHtml(const char *source, Node *node);
+
+/*!
+ * Looks up the raw value of an attribute in the opening tag of an
+ * element. Attribute names are compared case-insensitively, quotes
+ * around the value are removed and entities are left as they are.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param node The node
+ * \param name The attribute name
+ * \param value Receives a reference into \p source if found
+ * \returns \p true if the node is an element having the attribute
+ */
+bool attribute(const char *source, Node *node, const char *name, StringRef *value);
+
+/*!
+ * Appends the source of all text nodes in the subtree of a node to a
+ * list, in document order.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param node The node
+ * \param spans The list of references into \p source
+ */
+void textSpans(const char *source, Node *node, std::vector<StringRef> *spans);
+
+/*!
+ * Copies the concatenated text of the subtree of a node to a buffer.
+ * At most \p size characters are written and no terminating null
+ * character is added.
+ *
+ * \param source The HTML source the tree has been parsed from
+ * \param node The node
+ * \param buffer The destination buffer
+ * \param size The size of the buffer
+ * \returns The length of the whole text, which may exceed \p size
+ */
+size_t text(const char *source, Node *node, char *buffer, size_t size);
 
 
 /*!
@@ -106,12 +408,429 @@ public:
 	Selection(const tree<htmlcxx::HTML::Node> &tree, const std::string &expr = std::string());
 	Selection(const NodeSet &nodes, const std::string &expr = std::string());
 
-	Selection select(const std::string &expr);
+	Selection select(const std::string &expr, Statistics *stats = NULL);
+
+	Selection intersect(const NodeSet &other) const;
+	Selection unite(const NodeSet &other) const;
+	Selection subtract(const NodeSet &other) const;
+
+	Selection filter(const std::string &expr) const;
+	Selection filter(const CompiledSelector &selector) const;
+	bool is(const std::string &expr) const;
+	bool is(const CompiledSelector &selector) const;
+	Selection closest(const std::string &expr) const;
+	Selection closest(const CompiledSelector &selector) const;
+	Selection parents(const std::string &expr = std::string()) const;
+	Selection parents(const CompiledSelector &selector) const;
+	Selection children(const std::string &expr = std::string()) const;
+	Selection children(const CompiledSelector &selector) const;
+
+	void outerHtml(const char *source, std::vector<StringRef> *out) const;
+	void innerHtml(const char *source, std::vector<StringRef> *out) const;
+	void attribute(const char *source, const char *name, std::vector<StringRef> *out) const;
+	void textSpans(const char *source, std::vector<StringRef> *out) const;
+	size_t text(const char *source, char *buffer, size_t size) const;
 };
 
 typedef Selection Selector;
 
 
+/*!
+ * Flat, read-only snapshot of an HTML tree.
+ * All nodes of the tree are stored in document order (pre-order) in
+ * contiguous arrays, indexed by the position of the node. Navigating the
+ * snapshot boils down to array lookups instead of following the pointers
+ * of individually allocated tree nodes, which makes matching a lot more
+ * cache-friendly. This pays off if large documents are queried repeatedly.
+ *
+ * The position of a node and the end of its subtree form an interval that
+ * contains exactly the intervals of its descendants. Together with an
+ * index of nodes by tag, this allows descendant and child combinators to
+ * be evaluated by joining the sorted candidate lists of both sides
+ * instead of walking up from every node. Building the snapshot is thus
+ * the numbering pass for structural joins on trees, since select() returns
+ * the nodes of the original tree. Class attributes are split into
+ * interned tokens when building the snapshot, so class selectors are
+ * answered by looking up integers in a short sorted list.
+ *
+ * The snapshot refers to the nodes of the original tree, which must
+ * therefore outlive it and must not be modified while it is in use.
+ */
+class FlatDocument
+{
+public:
+	/*!
+	 * Node flags.
+	 */
+	enum Flags {
+		Tag = 0x01,    //!< Node is an element
+		Comment = 0x02 //!< Node is a comment
+	};
+
+	FlatDocument();
+	FlatDocument(const tree<htmlcxx::HTML::Node> &tree);
+
+	void build(const tree<htmlcxx::HTML::Node> &tree);
+	void clear();
+
+	/*!
+	 * Returns the number of nodes in the snapshot.
+	 */
+	int size() const { return (int)nodes.size(); }
+
+	NodeSet select(const std::string &expr, Statistics *stats = NULL) const;
+	NodeSet select(const CompiledSelector &selector, Statistics *stats = NULL) const;
+	void select(const std::string &expr, std::vector<int> *result, Statistics *stats = NULL) const;
+	void select(const CompiledSelector &selector, std::vector<int> *result, Statistics *stats = NULL) const;
+
+	NodeSet nodeSet(const std::vector<int> &indices) const;
+	int tagId(const std::string &name) const;
+	int classId(const std::string &name) const;
+	int idId(const std::string &id) const;
+
+	bool save(std::ostream &out, bool indexes = true) const;
+
+	std::vector<Node *> nodes;          //!< Original tree nodes
+	std::vector<int> parent;            //!< Index of parent node, or -1
+	std::vector<int> prevElement;       //!< Index of previous element sibling, or -1
+	std::vector<int> nextElement;       //!< Index of next element sibling, or -1
+	std::vector<int> end;               //!< Index following the node's subtree
+	std::vector<int> depth;             //!< Depth of the node, starting at 0
+	std::vector<int> tag;               //!< Interned tag name (index into tagNames)
+	std::vector<unsigned char> flags;   //!< Node flags
+	std::vector<unsigned int> offset;   //!< Offset of the node in the source
+	std::vector<unsigned int> length;   //!< Length of the node in the source
+	std::vector<int> attrBegin;         //!< Attributes of node i are [attrBegin[i], attrBegin[i+1])
+	std::vector<int> attrName;          //!< Interned attribute name (index into attrNames)
+	std::vector<int> attrValue;         //!< Offset of the attribute value in values
+	std::vector<int> attrLength;        //!< Length of the attribute value
+	std::vector<std::string> tagNames;  //!< Interned lower-case tag names
+	std::vector<int> tagBegin;          //!< Nodes with tag t are tagNodes[tagBegin[t], tagBegin[t+1])
+	std::vector<int> tagNodes;          //!< Node indices ordered by tag and position
+	std::vector<int> classBegin;        //!< Classes of node i are [classBegin[i], classBegin[i+1])
+	std::vector<int> classTokens;       //!< Sorted class names of each node (indices into classNames)
+	std::vector<std::string> classNames; //!< Sorted lower-case class names
+	std::vector<int> classNodeBegin;    //!< Nodes with class k are classNodes[classNodeBegin[k], classNodeBegin[k+1])
+	std::vector<int> classNodes;        //!< Node indices ordered by class and position
+	std::vector<std::string> idNames;   //!< Sorted lower-case values of id attributes
+	std::vector<int> idBegin;           //!< Nodes with id k are idNodes[idBegin[k], idBegin[k+1])
+	std::vector<int> idNodes;           //!< Node indices ordered by id and position
+	int maxDepth;                       //!< Maximum depth of all nodes
+	std::vector<std::string> attrNames; //!< Interned attribute names
+	std::string values;                 //!< Attribute values
+	int root;                           //!< Index of the <html> element, or -1
+};
+
+/*!
+ * Read-only view of a flat document that has been written with
+ * FlatDocument::save(). The data is mapped into memory and queried in
+ * place, without a deserialization step, so that archived documents can
+ * be queried repeatedly without parsing them again. The arrays have the
+ * same meaning as those of FlatDocument. Nodes are identified by their
+ * index in document order, and offset[] and length[] hold their position
+ * in the original source, as reported by htmlcxx. If the document has
+ * been saved with indexes, the nodes to examine are taken from the tag,
+ * class or id index whenever possible.
+ *
+ * The format uses the native byte order, so files can only be opened on
+ * machines of the same architecture. When opening a document, only its
+ * structure is validated and its contents are trusted.
+ */
+class MappedDocument
+{
+public:
+	MappedDocument();
+	~MappedDocument();
+
+	bool open(const std::string &path);
+	bool open(const void *data, size_t size);
+	void close();
+
+	/*!
+	 * Returns the number of nodes in the document.
+	 */
+	int size() const { return nodeCount; }
+
+	/*!
+	 * Returns whether the document contains tag, class and id indexes.
+	 */
+	bool hasIndexes() const { return tagBegin != NULL; }
+
+	void select(const std::string &expr, std::vector<int> *result, Statistics *stats = NULL) const;
+	void select(const CompiledSelector &selector, std::vector<int> *result, Statistics *stats = NULL) const;
+
+	int tagId(const std::string &name) const;
+	int classId(const std::string &name) const;
+	int idId(const std::string &id) const;
+	const char *tagName(int t) const;
+	const char *attributeName(int a) const;
+	const char *className(int k) const;
+	const char *idName(int k) const;
+
+	const int *parent;                  //!< Index of parent node, or -1
+	const int *prevElement;             //!< Index of previous element sibling, or -1
+	const int *nextElement;             //!< Index of next element sibling, or -1
+	const int *end;                     //!< Index following the node's subtree
+	const int *depth;                   //!< Depth of the node, starting at 0
+	const int *tag;                     //!< Interned tag name (see tagName())
+	const unsigned char *flags;         //!< Node flags (see FlatDocument::Flags)
+	const unsigned int *offset;         //!< Offset of the node in the source
+	const unsigned int *length;         //!< Length of the node in the source
+	const int *attrBegin;               //!< Attributes of node i are [attrBegin[i], attrBegin[i+1])
+	const int *attrName;                //!< Interned attribute name (see attributeName())
+	const int *attrValue;               //!< Offset of the attribute value in values
+	const int *attrLength;              //!< Length of the attribute value
+	const int *classBegin;              //!< Classes of node i are [classBegin[i], classBegin[i+1])
+	const int *classTokens;             //!< Sorted class names of each node (see className())
+	const int *tagBegin;                //!< Nodes with tag t are tagNodes[tagBegin[t], tagBegin[t+1]), or NULL
+	const int *tagNodes;                //!< Node indices ordered by tag and position
+	const int *classNodeBegin;          //!< Nodes with class k are classNodes[classNodeBegin[k], classNodeBegin[k+1])
+	const int *classNodes;              //!< Node indices ordered by class and position
+	const int *idBegin;                 //!< Nodes with id k are idNodes[idBegin[k], idBegin[k+1])
+	const int *idNodes;                 //!< Node indices ordered by id and position
+	const char *values;                 //!< Attribute values
+	const char *source;                 //!< Original source, if set by the caller, for :contains()
+	int nodeCount;                      //!< Number of nodes
+	int tagCount;                       //!< Number of interned tag names
+	int attrCount;                      //!< Number of interned attribute names
+	int classCount;                     //!< Number of class names
+	int idCount;                        //!< Number of id values, or 0 without indexes
+	int maxDepth;                       //!< Maximum depth of all nodes
+	int root;                           //!< Index of the <html> element, or -1
+
+private:
+	MappedDocument(const MappedDocument &);
+	MappedDocument &operator=(const MappedDocument &);
+
+	const int *m_names[4]; // Offsets of tag, attribute, class and id names in m_strings
+	const char *m_strings;
+	void *m_map;
+	size_t m_mapSize;
+};
+
+
+/*!
+ * Summary of the tags, classes and ids within every subtree of an HTML
+ * tree. For every node, these names are hashed into a small bitmap that
+ * also includes the bitmaps of all descendants. A subtree whose bitmap
+ * lacks a bit required by the rightmost sequence of every selector
+ * cannot contain a match, so it is skipped when selecting. This pays off
+ * for large documents in which the matches are concentrated in small
+ * regions.
+ *
+ * The summary refers to the nodes of the original tree, which must
+ * therefore outlive it and must not be modified while it is in use.
+ */
+class SubtreeSummary
+{
+public:
+	typedef unsigned long long Bits;
+
+	SubtreeSummary();
+	SubtreeSummary(const tree<htmlcxx::HTML::Node> &tree);
+
+	void build(const tree<htmlcxx::HTML::Node> &tree);
+	void clear();
+
+	/*!
+	 * Returns the number of nodes in the summary.
+	 */
+	int size() const { return (int)nodes.size(); }
+
+	NodeSet select(const std::string &expr, Statistics *stats = NULL) const;
+	NodeSet select(const CompiledSelector &selector, Statistics *stats = NULL) const;
+
+	std::vector<Node *> nodes; //!< Original tree nodes in document order
+	std::vector<int> end;      //!< Index following the node's subtree
+	std::vector<Bits> bits;    //!< Hashed tags, classes and ids of the node's subtree
+	int root;                  //!< Index of the <html> element, or -1
+};
+
+
+/*!
+ * Describes how a CSS selector expression is matched against a flat
+ * document. Selections on flat documents are planned using the sizes of
+ * the tag, class and id indexes: the nodes to examine are either all
+ * nodes, the nodes having a type, class or id of the rightmost sequence,
+ * the descendants of nodes having one of an earlier sequence, or the
+ * candidates of all sequences, joined structurally. For every selector
+ * of the expression, the returned text lists the chosen plan with the
+ * estimated and actual number of examined nodes and the number of
+ * matches, followed by all plans that have been considered.
+ *
+ * \param expr The CSS selector expression
+ * \param doc The flat document
+ * \returns A human-readable description of the query plan
+ * \throws ParseException CSS selector parsing error
+ */
+std::string explain(const std::string &expr, const FlatDocument &doc);
+
+
+/*!
+ * Selection that is kept up to date while the underlying tree is modified.
+ * Initially, the selection contains all nodes of the tree that match the
+ * given selector. Afterwards, every modification of the tree must be
+ * reported using inserted(), changed() or removing(). Only the nodes
+ * whose matching might be affected by a modification will be matched
+ * again: the modified subtree, its ancestors, the subtrees of following
+ * siblings if the selector contains sibling combinators and the
+ * remaining siblings if it contains positional pseudo-classes. If a
+ * selector contains \p :empty left of a combinator, the whole tree will
+ * be matched again.
+ */
+class LiveSelection
+{
+public:
+	LiveSelection(const tree<htmlcxx::HTML::Node> &tree, const CompiledSelector &selector);
+
+	void inserted(Node *node);
+	void changed(Node *node);
+	void removing(Node *node);
+
+	void update();
+	NodeSet nodes();
+	bool contains(Node *node);
+
+private:
+	bool inScope(Node *node) const;
+	void refresh(Node *node);
+	void refreshSubtree(Node *node);
+	void refreshContext(Node *parent, Node *next, Node *node);
+	void dropSubtree(Node *node);
+
+	// Context of a removed subtree that still needs to be matched again
+	struct Removal
+	{
+		Node *parent, *next;
+	};
+
+	CompiledSelector m_selector;
+	Node *m_root;
+	std::set<Node *> m_nodes;
+	std::vector<Removal> m_pending;
+};
+
+
+/*!
+ * Opt-in cache of query results for a single tree.
+ * Results are stored per selector expression, normalized by removing
+ * insignificant whitespace. If an expression ends in a descendant or
+ * child combinator, e.g. \p "div.content p", the result of the prefix
+ * (\p "div.content") is looked up or computed and cached first, and only
+ * the descendants or children of its nodes are matched against the
+ * rightmost sequence. Queries sharing a prefix thus share its result.
+ *
+ * The least recently used results are dropped if the number of cached
+ * results or the total number of cached nodes exceeds the given limits.
+ * The cache does not notice modifications of the tree: invalidate() must
+ * be called after every modification. A cache must not be used from
+ * multiple threads concurrently.
+ */
+class QueryCache
+{
+public:
+	/*!
+	 * Counters of cache lookups.
+	 */
+	struct Statistics
+	{
+		Statistics();
+
+		unsigned long hits;          //!< Queries answered from the cache
+		unsigned long prefixHits;    //!< Queries computed from the cached result of a prefix
+		unsigned long misses;        //!< Queries computed without any cached result
+		unsigned long evictions;     //!< Results dropped because of the size limits
+		unsigned long invalidations; //!< Calls to invalidate()
+
+		double hitRate() const;
+	};
+
+	QueryCache(const tree<htmlcxx::HTML::Node> &tree, size_t maxEntries = 64, size_t maxNodes = 65536);
+
+	const NodeSet &select(const std::string &expr);
+	void invalidate();
+
+	/*!
+	 * Returns the number of cached results.
+	 */
+	size_t size() const { return m_entries.size(); }
+
+	/*!
+	 * Returns the total number of nodes in all cached results.
+	 */
+	size_t nodes() const { return m_nodes; }
+
+	/*!
+	 * Returns the lookup counters.
+	 */
+	const Statistics &statistics() const { return m_stats; }
+
+private:
+	QueryCache(const QueryCache &);
+	QueryCache &operator=(const QueryCache &);
+
+	const NodeSet &lookup(const std::string &key, const std::string &expr, size_t split, bool count = true);
+	void evict();
+
+	// Cached result, with its position in the list of recently used keys
+	struct Entry
+	{
+		NodeSet nodes;
+		std::list<std::string>::iterator use;
+	};
+
+	const tree<htmlcxx::HTML::Node> *m_tree;
+	size_t m_maxEntries, m_maxNodes, m_nodes;
+	std::map<std::string, Entry> m_entries;
+	std::list<std::string> m_uses; // Most recently used first
+	Statistics m_stats;
+};
+
+
+/*!
+ * Match of a rule of a RuleSet.
+ */
+struct RuleMatch
+{
+	int rule;   //!< Rule id, as returned by RuleSet::add()
+	Node *node; //!< Matching node
+};
+
+/*!
+ * Large set of selectors that are matched in a single walk of a tree,
+ * e.g. the thousands of rules of a content filter list.
+ * Every selector is put into a bucket according to the rightmost
+ * sequence of its compound selectors: the bucket of its id, one of its
+ * classes or its type, in this order of preference, or a bucket of
+ * selectors that need to be tested against every node. Selection visits
+ * every node once and tests only the selectors in the buckets of its id,
+ * classes and type. A rule set may be used from multiple threads
+ * concurrently once all rules have been added.
+ */
+class RuleSet
+{
+public:
+	RuleSet();
+	~RuleSet();
+
+	int add(const std::string &expr);
+	int size() const;
+
+	void select(const tree<htmlcxx::HTML::Node> &tree, std::vector<RuleMatch> *matches, Statistics *stats = NULL) const;
+
+	/*!
+	 * Opaque data of the rule set, for internal use.
+	 */
+	struct Data;
+
+private:
+	RuleSet(const RuleSet &);
+	RuleSet &operator=(const RuleSet &);
+
+	Data *d;
+};
+
+
 /*!
  * Exception that may be thrown when parsing a selector expression.
  */
@@ -139,6 +858,47 @@ private:
 	const char *m_info;
 };
 
+/*!
+ * Exception that is thrown when a selector exceeds its limits or a query
+ * is cancelled.
+ */
+class LimitException : public std::exception
+{
+public:
+	/*!
+	 * The limit that has been exceeded.
+	 */
+	enum Limit { Nodes, Predicates, Complexity, Nesting, Cancelled };
+
+	/*!
+	 * Constructor.
+	 */
+	LimitException(Limit limit) : m_limit(limit) { }
+
+	/*!
+	 * Returns the error string.
+	 */
+	const char *what() const throw()
+	{
+		switch (m_limit) {
+			case Nodes: return "Too many nodes visited";
+			case Predicates: return "Too many predicates evaluated";
+			case Complexity: return "Selector too complex";
+			case Nesting: return "Selector nested too deeply";
+			default: break;
+		}
+		return "Query cancelled";
+	}
+
+	/*!
+	 * Returns the limit that has been exceeded.
+	 */
+	Limit limit() const throw() { return m_limit; }
+
+private:
+	Limit m_limit;
+};
+
 } // namespace hcxselect
 
 #endif // HCXSELECT_H_
@@ -0,0 +1,1799 @@
+/*
+ * hcxselect - A CSS selector engine for htmlcxx
+ * Copyright (C) 2011 Jonas Gehring
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef HCXSELECT_MATCHER_H_
+#define HCXSELECT_MATCHER_H_
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <strings.h>
+
+#include "hcxselect.h"
+
+#ifdef HCXSELECT_STATISTICS
+ #define HCXSELECT_STAT(ctx, s) do { if ((ctx).stats) { (ctx).stats->s; } } while (0)
+#else
+ #define HCXSELECT_STAT(ctx, s) do { } while (0)
+#endif
+
+
+namespace hcxselect
+{
+
+// Selector functions and their node access policies. These are templates
+// on the node access so that matching can be instantiated for any
+// document representation; see NodeTraits below.
+namespace detail
+{
+
+// Delete all elements of a container
+template<typename T>
+inline void delete_all(const T &v)
+{
+	for (typename T::const_iterator it = v.begin(); it != v.end(); ++it) {
+		delete *it;
+	}
+}
+
+// State of a general sibling combinator for the children of a parent:
+// whether an element preceding node matches the left side. K is the key
+// type of a node in the respective document representation.
+template <class K>
+struct SiblingState
+{
+	const void *fn;
+	K parent;
+	K node;
+	bool matched;
+};
+
+// Fixed number of sibling states, replaced in round-robin order. Nested
+// lists of children that are visited alternately need one state each.
+template <class K>
+struct SiblingStates
+{
+	enum { Capacity = 32 };
+
+	SiblingStates() : size(0), next(0) { }
+
+	// Returns the state of a combinator for the children of parent, or
+	// NULL if there is none
+	SiblingState<K> *find(const void *fn, const K &parent)
+	{
+		for (int i = 0; i < size; ++i) {
+			if (states[i].fn == fn && states[i].parent == parent) {
+				return &states[i];
+			}
+		}
+		return NULL;
+	}
+
+	void insert(const SiblingState<K> &state)
+	{
+		states[next] = state;
+		next = (next + 1) % Capacity;
+		if (size < Capacity) ++size;
+	}
+
+	SiblingState<K> states[Capacity];
+	int size, next;
+};
+
+// Substring search for a fixed needle, optionally ignoring ASCII case.
+// Candidate positions are found by comparing the first and the last
+// character of the needle with 16 positions at a time if SSE2 is
+// available, and by the Boyer-Moore-Horspool algorithm otherwise and for
+// the remainder of the text.
+class TextSearch
+{
+public:
+	TextSearch(const std::string &needle, bool nocase);
+
+	const char *find(const char *text, size_t length) const;
+	size_t length() const { return m_needle.length(); }
+
+	// Compares n characters of a text with the needle from position pos
+	bool equal(const char *s, size_t pos, size_t n) const
+	{
+		const char *needle = m_needle.data() + pos;
+		if (!m_nocase) {
+			return !memcmp(s, needle, n);
+		}
+		for (size_t i = 0; i < n; ++i) {
+			if (::tolower((unsigned char)s[i]) != (unsigned char)needle[i]) return false;
+		}
+		return true;
+	}
+
+private:
+
+	std::string m_needle; // Lower-case if case is ignored
+	bool m_nocase;
+	unsigned int m_skip[256];
+};
+
+namespace Selectors
+{
+
+// Reference to a node of a flat or mapped document
+template <class D>
+struct FlatRefT
+{
+	const D *doc;
+	int i;
+};
+
+typedef FlatRefT<FlatDocument> FlatRef;
+typedef FlatRefT<MappedDocument> MappedRef;
+
+} // namespace Selectors
+
+// Set of tree nodes in an open-addressing hash table, which keeps its
+// capacity when cleared
+class NodeMarks
+{
+public:
+	NodeMarks() : m_size(0) { }
+
+	void clear()
+	{
+		std::fill(m_table.begin(), m_table.end(), (Node *)NULL);
+		m_size = 0;
+	}
+
+	void insert(Node *node)
+	{
+		if (2 * (m_size + 1) > m_table.size()) {
+			grow();
+		}
+		size_t i = slot(node);
+		if (!m_table[i]) {
+			m_table[i] = node;
+			++m_size;
+		}
+	}
+
+	bool contains(Node *node) const
+	{
+		return !m_table.empty() && m_table[slot(node)] == node;
+	}
+
+private:
+	// Returns the slot of a node, or the empty slot it would be stored in
+	size_t slot(Node *node) const
+	{
+		size_t mask = m_table.size() - 1;
+		size_t i = (((size_t)node >> 4) * 2654435761u) & mask;
+		while (m_table[i] && m_table[i] != node) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void grow()
+	{
+		std::vector<Node *> old(m_table.size() < 64 ? 64 : 2 * m_table.size(), (Node *)NULL);
+		m_table.swap(old);
+		m_size = 0;
+		for (size_t i = 0; i < old.size(); ++i) {
+			if (old[i]) insert(old[i]);
+		}
+	}
+
+	std::vector<Node *> m_table; // Size is a power of two
+	size_t m_size;
+};
+
+// Marks of the selector functions that precompute their matches, e.g.
+// :has(). Clearing the table keeps the entries for the next query, and
+// entries do not move when others are added.
+template <class M>
+class MarkTable
+{
+public:
+	MarkTable() : m_used(0) { }
+
+	// Returns the marks of a selector function computed during this
+	// query, or NULL
+	M *find(const void *fn)
+	{
+		for (size_t i = 0; i < m_used; ++i) {
+			if (m_entries[i].first == fn) return &m_entries[i].second;
+		}
+		return NULL;
+	}
+
+	M &insert(const void *fn)
+	{
+		if (m_used == m_entries.size()) {
+			m_entries.push_back(std::make_pair(fn, M()));
+		}
+		m_entries[m_used].first = fn;
+		return m_entries[m_used++].second;
+	}
+
+	void clear() { m_used = 0; }
+
+private:
+	std::deque<std::pair<const void *, M> > m_entries;
+	size_t m_used;
+};
+
+// Characters kept by a text scan for matches spanning several text nodes,
+// and the nodes they belong to: kept characters from position first
+// belong to second
+template <class R>
+struct TextCarry
+{
+	std::string chars;
+	std::vector<std::pair<size_t, R> > owners;
+};
+
+// Buffers of :has() and :contains() that are reused by the queries of a
+// compiled selector, one query at a time
+struct Scratch
+{
+	void clear()
+	{
+		treeMarks.clear();
+		flatMarks.clear();
+	}
+
+	MarkTable<NodeMarks> treeMarks;
+	MarkTable<std::vector<bool> > flatMarks;
+	TextCarry<Node *> treeCarry;
+	TextCarry<Selectors::FlatRef> flatCarry;
+	TextCarry<Selectors::MappedRef> mappedCarry;
+};
+
+// Per-query state that is passed to all selector functions
+struct Context
+{
+	Context(Statistics *stats = NULL, bool bulk = false, const Limits *limits = NULL, Scratch **spare = NULL)
+		: stats(stats), bulk(bulk), candidates(0), limits(limits), nodes(0), predicates(0),
+		  m_scratch(NULL), m_spare(spare)
+	{
+		nodeCheck = next(0, limits ? limits->maxNodes : 0);
+		predicateCheck = next(0, limits ? limits->maxPredicates : 0);
+		if (limits && limits->token && limits->token->cancelled()) {
+			throw LimitException(LimitException::Cancelled);
+		}
+	}
+
+	// Returns the scratch buffers to the compiled selector, unless another
+	// query has done so in the meantime
+	~Context()
+	{
+		if (!m_scratch) {
+			return;
+		}
+		m_scratch->clear();
+		if (!m_spare || !__sync_bool_compare_and_swap(m_spare, (Scratch *)NULL, m_scratch)) {
+			delete m_scratch;
+		}
+	}
+
+	// Returns the buffers of :has() and :contains(), taking those of the
+	// compiled selector if no other query is using them
+	Scratch &scratch()
+	{
+		if (!m_scratch) {
+			if (m_spare) {
+				m_scratch = __sync_lock_test_and_set(m_spare, (Scratch *)NULL);
+			}
+			if (!m_scratch) {
+				m_scratch = new Scratch();
+			}
+		}
+		return *m_scratch;
+	}
+
+	// Accounts for a visited node
+	inline void visit()
+	{
+		HCXSELECT_STAT(*this, nodesVisited++);
+		if (++nodes >= nodeCheck) check();
+	}
+
+	// Accounts for the invocation of a simple selector
+	inline void evaluate()
+	{
+		HCXSELECT_STAT(*this, predicateCalls++);
+		if (++predicates >= predicateCheck) check();
+	}
+
+	// Checks the limits of the query, which happens once the number of
+	// visited nodes or evaluated predicates exceeds a limit, and
+	// periodically if there is a cancellation token
+	void check()
+	{
+		if (limits->maxNodes && nodes > limits->maxNodes) {
+			throw LimitException(LimitException::Nodes);
+		}
+		if (limits->maxPredicates && predicates > limits->maxPredicates) {
+			throw LimitException(LimitException::Predicates);
+		}
+		if (limits->token && limits->token->cancelled()) {
+			throw LimitException(LimitException::Cancelled);
+		}
+		nodeCheck = next(nodes, limits->maxNodes);
+		predicateCheck = next(predicates, limits->maxPredicates);
+	}
+
+	// Returns the count at which the limits need to be checked next
+	unsigned long next(unsigned long count, unsigned long max) const
+	{
+		unsigned long n = ULONG_MAX;
+		if (limits && limits->token) {
+			n = count + CheckInterval;
+		}
+		if (max && max + 1 < n) {
+			n = max + 1;
+		}
+		return n;
+	}
+
+	enum { CheckInterval = 1024 };
+
+	Statistics *stats;
+
+	// Whether many nodes of the document will be matched, so that
+	// precomputing results for the whole document pays off
+	bool bulk;
+
+	// Sibling states of general sibling combinators
+	SiblingStates<Node *> treeSiblings;
+	SiblingStates<int> flatSiblings;
+
+	// Interned class names of class selectors in a flat or mapped document, indexed
+	// by selector
+	std::vector<int> classIds;
+
+	// Number of nodes examined when evaluating plans for flat documents
+	unsigned long candidates;
+
+	// Optional limits, visited nodes and evaluated predicates, and the
+	// counts at which the limits will be checked next
+	const Limits *limits;
+	unsigned long nodes, predicates;
+	unsigned long nodeCheck, predicateCheck;
+
+private:
+	Context(const Context &);
+	Context &operator=(const Context &);
+
+	Scratch *m_scratch;
+	Scratch **m_spare; // Slot for the buffers of a compiled selector
+};
+
+namespace Selectors
+{
+
+// Node access for htmlcxx trees
+struct TreeAccess
+{
+	typedef Node *Ref;
+	typedef Node *Key;
+
+	typedef NodeMarks Marks;
+
+	static inline bool valid(Ref r) { return r != NULL; }
+	static inline bool same(Ref a, Ref b) { return a == b; }
+	static inline Key key(Ref r) { return r; }
+	static inline Ref parent(Ref r) { return r->parent; }
+	static inline Ref firstChild(Ref r) { return r->first_child; }
+	static inline Ref nextSibling(Ref r) { return r->next_sibling; }
+
+	static inline Ref prevElement(Ref r) {
+		r = r->prev_sibling;
+		while (r && !r->data.isTag()) r = r->prev_sibling;
+		return r;
+	}
+
+	static inline Ref nextElement(Ref r) {
+		r = r->next_sibling;
+		while (r && !r->data.isTag()) r = r->next_sibling;
+		return r;
+	}
+
+	static inline bool isTag(Ref r) { return r->data.isTag(); }
+	static inline bool isComment(Ref r) { return r->data.isComment(); }
+	static inline unsigned int length(Ref r) { return r->data.length(); }
+
+	static inline bool hasTag(Ref r, const char *tag) {
+		return !::strcasecmp(r->data.tagName().c_str(), tag);
+	}
+
+	static inline bool sameTag(Ref a, Ref b) {
+		return !::strcasecmp(a->data.tagName().c_str(), b->data.tagName().c_str());
+	}
+
+	static inline bool attribute(Ref r, const std::string &name, Context &ctx, const char **str, size_t *len) {
+		if (r->data.attributes().empty()) {
+			HCXSELECT_STAT(ctx, attributeParses++);
+			r->data.parseAttributes();
+		}
+		const std::map<std::string, std::string> &attrs = r->data.attributes();
+		std::map<std::string, std::string>::const_iterator it = attrs.find(name);
+		if (it == attrs.end()) {
+			return false;
+		}
+		*str = it->second.c_str();
+		*len = it->second.length();
+		return true;
+	}
+
+	// Trees have no class index, so class attributes need to be parsed
+	static inline int hasClass(Ref, const std::string &, int, Context &) { return -1; }
+
+	static inline MarkTable<Marks> &marks(Context &ctx) { return ctx.scratch().treeMarks; }
+	static inline void initMarks(Marks &m, Ref) { m.clear(); }
+	static inline void mark(Marks &m, Ref r) { m.insert(r); }
+	static inline bool marked(const Marks &m, Ref r) { return m.contains(r); }
+	static inline TextCarry<Ref> &carry(Context &ctx) { return ctx.scratch().treeCarry; }
+
+	static inline SiblingStates<Key> &siblings(Context &ctx) { return ctx.treeSiblings; }
+
+	static inline bool text(Ref r, const char **str, size_t *len) {
+		*str = r->data.text().data();
+		*len = r->data.text().length();
+		return true;
+	}
+};
+
+// Names, attribute values and class tokens of flat and mapped documents
+inline const char *flatTagName(const FlatDocument *d, int t) { return d->tagNames[t].c_str(); }
+inline const char *flatTagName(const MappedDocument *d, int t) { return d->tagName(t); }
+inline const char *flatAttrName(const FlatDocument *d, int a) { return d->attrNames[a].c_str(); }
+inline const char *flatAttrName(const MappedDocument *d, int a) { return d->attributeName(a); }
+inline const char *flatValues(const FlatDocument *d) { return d->values.data(); }
+inline const char *flatValues(const MappedDocument *d) { return d->values; }
+inline const int *flatClassTokens(const FlatDocument *d) { return (d->classTokens.empty() ? NULL : &d->classTokens[0]); }
+inline const int *flatClassTokens(const MappedDocument *d) { return d->classTokens; }
+
+// Availability of the tag, class and id indexes, and the id index
+inline bool flatIndexed(const FlatDocument *) { return true; }
+inline bool flatIndexed(const MappedDocument *d) { return d->hasIndexes(); }
+inline const int *flatIdNodes(const FlatDocument *d) { return (d->idNodes.empty() ? NULL : &d->idNodes[0]); }
+inline const int *flatIdNodes(const MappedDocument *d) { return d->idNodes; }
+
+// Text of text nodes, taken from the original nodes of flat documents and
+// from the source of mapped documents, if known
+inline bool flatText(const FlatDocument *d, int i, const char **str, size_t *len)
+{
+	*str = d->nodes[i]->data.text().data();
+	*len = d->nodes[i]->data.text().length();
+	return true;
+}
+
+inline bool flatText(const MappedDocument *d, int i, const char **str, size_t *len)
+{
+	*str = (d->source ? d->source + d->offset[i] : NULL);
+	*len = d->length[i];
+	return (d->source != NULL);
+}
+
+// Text scan buffers for flat and mapped documents
+inline TextCarry<FlatRef> &flatCarry(Scratch &s, const FlatDocument *) { return s.flatCarry; }
+inline TextCarry<MappedRef> &flatCarry(Scratch &s, const MappedDocument *) { return s.mappedCarry; }
+
+// Node access for flat documents and, sharing the same layout, mapped
+// documents
+template <class D>
+struct FlatAccessT
+{
+	typedef FlatRefT<D> Ref;
+	typedef int Key;
+	typedef std::vector<bool> Marks;
+
+	static inline Ref ref(const Ref &r, int i) {
+		Ref s = { r.doc, i };
+		return s;
+	}
+
+	static inline bool valid(const Ref &r) { return r.i >= 0; }
+	static inline bool same(const Ref &a, const Ref &b) { return a.i == b.i; }
+	static inline Key key(const Ref &r) { return r.i; }
+	static inline Ref parent(const Ref &r) { return ref(r, r.doc->parent[r.i]); }
+	static inline Ref prevElement(const Ref &r) { return ref(r, r.doc->prevElement[r.i]); }
+	static inline Ref nextElement(const Ref &r) { return ref(r, r.doc->nextElement[r.i]); }
+
+	static inline Ref firstChild(const Ref &r) {
+		return ref(r, r.i + 1 < r.doc->end[r.i] ? r.i + 1 : -1);
+	}
+
+	static inline Ref nextSibling(const Ref &r) {
+		int p = r.doc->parent[r.i];
+		int j = r.doc->end[r.i];
+		return ref(r, (p >= 0 && j < r.doc->end[p]) ? j : -1);
+	}
+
+	static inline bool isTag(const Ref &r) { return r.doc->flags[r.i] & FlatDocument::Tag; }
+	static inline bool isComment(const Ref &r) { return r.doc->flags[r.i] & FlatDocument::Comment; }
+	static inline unsigned int length(const Ref &r) { return r.doc->length[r.i]; }
+
+	static inline bool hasTag(const Ref &r, const char *tag) {
+		return !::strcasecmp(flatTagName(r.doc, r.doc->tag[r.i]), tag);
+	}
+
+	static inline bool sameTag(const Ref &a, const Ref &b) {
+		return a.doc->tag[a.i] == b.doc->tag[b.i];
+	}
+
+	static inline bool attribute(const Ref &r, const std::string &name, Context &, const char **str, size_t *len) {
+		const D *d = r.doc;
+		for (int k = d->attrBegin[r.i]; k < d->attrBegin[r.i+1]; ++k) {
+			if (name == flatAttrName(d, d->attrName[k])) {
+				*str = flatValues(d) + d->attrValue[k];
+				*len = d->attrLength[k];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static inline int hasClass(const Ref &r, const std::string &name, int index, Context &ctx) {
+		const D *d = r.doc;
+		if (ctx.classIds.size() <= (size_t)index) {
+			ctx.classIds.resize(index + 1, -2);
+		}
+		int &id = ctx.classIds[index];
+		if (id == -2) {
+			id = d->classId(name);
+		}
+		if (id < 0) {
+			return 0;
+		}
+		const int *tokens = flatClassTokens(d);
+		return std::binary_search(tokens + d->classBegin[r.i], tokens + d->classBegin[r.i+1], id);
+	}
+
+	static inline MarkTable<Marks> &marks(Context &ctx) { return ctx.scratch().flatMarks; }
+	static inline void initMarks(Marks &m, const Ref &r) { m.assign(r.doc->size(), false); }
+	static inline void mark(Marks &m, const Ref &r) { m[r.i] = true; }
+	static inline bool marked(const Marks &m, const Ref &r) { return m[r.i]; }
+	static inline TextCarry<Ref> &carry(Context &ctx) { return flatCarry(ctx.scratch(), (const D *)NULL); }
+
+	static inline SiblingStates<Key> &siblings(Context &ctx) { return ctx.flatSiblings; }
+
+	static inline bool text(const Ref &r, const char **str, size_t *len) { return flatText(r.doc, r.i, str, len); }
+};
+
+typedef FlatAccessT<FlatDocument> FlatAccess;
+typedef FlatAccessT<MappedDocument> MappedAccess;
+
+// Properties of selectors that determine which other nodes the matching
+// of a node depends on
+enum Feature
+{
+	Sibling = 0x01,        // Sibling combinators
+	Positional = 0x02,     // Positional pseudo-classes (:nth-child etc.)
+	Structural = 0x04,     // Pseudo-classes depending on children (:empty)
+	LeftPositional = 0x08, // Positional pseudo-classes left of a combinator
+	LeftStructural = 0x10, // Structural pseudo-classes left of a combinator
+	Preceding = 0x20       // Relative selectors depending on following siblings
+};
+
+// Abstract base class for selector functions
+struct SelectorFn
+{
+	// Concrete selector function, for dispatching to its matchT() template
+	enum Variant {
+		UniversalFn, TypeFn, AttributeFn, AttributeValueFn, ClassFn, PseudoFn,
+		NegationFn, MatchesAnyFn, RelativeFn, SimpleSequenceFn, CombinatorFn
+	};
+
+	SelectorFn(Variant variant) : variant(variant) { }
+	virtual ~SelectorFn() { }
+	virtual bool match(Node *node, Context &ctx) const = 0;
+	virtual bool match(const FlatRef &ref, Context &ctx) const = 0;
+	virtual bool match(const MappedRef &ref, Context &ctx) const = 0;
+
+	// Returns a combination of Feature flags
+	virtual int features() const { return 0; }
+
+	// Appends the matching nodes of a flat document within [begin, end)
+	// to result, in document order. Returns false if not supported.
+	virtual bool join(const FlatDocument &, int, int, Context &, std::vector<int> *) const { return false; }
+
+	Variant variant;
+};
+
+// Matches a node using the matchT() template of a selector function, so
+// that node access is inlined for any access policy A
+template <class A>
+bool dispatch(const SelectorFn *fn, const typename A::Ref &r, Context &ctx);
+
+// Implements the virtual match functions by forwarding to the matchT()
+// template of a selector function
+#define SELECTOR_MATCH_FNS \
+	bool match(Node *node, Context &ctx) const { return matchT<TreeAccess>(node, ctx); } \
+	bool match(const FlatRef &ref, Context &ctx) const { return matchT<FlatAccess>(ref, ctx); } \
+	bool match(const MappedRef &ref, Context &ctx) const { return matchT<MappedAccess>(ref, ctx); }
+
+// Checks whether a node is not the root element, i.e. the outermost html
+// element. Nested html elements have a parent like any other element.
+template <class A>
+inline bool hasParent(const typename A::Ref &r)
+{
+	typename A::Ref jt = A::parent(r);
+	if (!A::valid(jt) || !A::hasTag(r, "html")) return true;
+	for (; A::valid(jt); jt = A::parent(jt)) {
+		if (A::hasTag(jt, "html")) return true;
+	}
+	return false;
+}
+
+// Advances to the next node in document order within the subtree of top
+template <class A>
+inline bool advance(typename A::Ref &r, const typename A::Ref &top)
+{
+	typename A::Ref jt = A::firstChild(r);
+	while (!A::valid(jt)) {
+		if (A::same(r, top)) return false;
+		jt = A::nextSibling(r);
+		r = A::parent(r);
+	}
+	r = jt;
+	return true;
+}
+
+// Checks whether a is a proper ancestor of r
+template <class A>
+inline bool isAncestor(const typename A::Ref &a, typename A::Ref r)
+{
+	for (r = A::parent(r); A::valid(r); r = A::parent(r)) {
+		if (A::same(a, r)) return true;
+	}
+	return false;
+}
+
+// Searches the concatenated text of the text nodes that are passed to
+// feed() in document order, so that every text node is scanned once.
+// Matches spanning several text nodes are found by keeping the last
+// characters seen so far, together with the text nodes they belong to.
+template <class A>
+class TextScan
+{
+public:
+	enum Found { None = 0, Inside, Spanning };
+
+	TextScan(const TextSearch &search, TextCarry<typename A::Ref> &carry)
+		: m_search(search), m_carry(carry.chars), m_owners(carry.owners)
+	{
+		m_carry.clear();
+		m_owners.clear();
+	}
+
+	// Passes a node to the scan and returns whether a match ends within
+	// its text. For matches spanning several text nodes, the node
+	// containing the first character of the last such match is stored in
+	// first. Elements and comments are skipped.
+	int feed(const typename A::Ref &r, Context &ctx, typename A::Ref *first)
+	{
+		const char *str;
+		size_t len, m = m_search.length();
+		if (A::isTag(r) || A::isComment(r) || !A::text(r, &str, &len)) {
+			return None;
+		}
+		HCXSELECT_STAT(ctx, textBytes += len);
+
+		int found = None;
+		if (m_search.find(str, len)) {
+			found = Inside;
+		} else {
+			// Matches starting in the kept characters, latest first
+			const char *c = m_carry.data();
+			for (size_t i = m_carry.size(); i-- > 0; ) {
+				size_t n = m_carry.size() - i;
+				if (len >= m - n && m_search.equal(c + i, 0, n) && m_search.equal(str, n, m - n)) {
+					*first = owner(i);
+					found = Spanning;
+					break;
+				}
+			}
+		}
+
+		// Keep the last m - 1 characters and the nodes they belong to
+		if (len >= m - 1) {
+			m_carry.assign(str + len - (m - 1), m - 1);
+			m_owners.assign(1, Owner(0, r));
+		} else if (len > 0) {
+			m_owners.push_back(Owner(m_carry.size(), r));
+			m_carry.append(str, len);
+			if (m_carry.size() > m - 1) {
+				size_t n = m_carry.size() - (m - 1);
+				m_carry.erase(0, n);
+				while (m_owners.size() > 1 && m_owners[1].first <= n) {
+					m_owners.erase(m_owners.begin());
+				}
+				for (size_t i = 0; i < m_owners.size(); ++i) {
+					m_owners[i].first = (m_owners[i].first > n ? m_owners[i].first - n : 0);
+				}
+			}
+		}
+		return found;
+	}
+
+private:
+	typedef std::pair<size_t, typename A::Ref> Owner;
+
+	// Returns the node of a kept character
+	typename A::Ref owner(size_t i) const
+	{
+		size_t j = m_owners.size() - 1;
+		while (m_owners[j].first > i) --j;
+		return m_owners[j].second;
+	}
+
+	const TextSearch &m_search;
+	std::string &m_carry;
+	std::vector<Owner> &m_owners;
+};
+
+// Universal selector (*)
+struct Universal : SelectorFn
+{
+	Universal() : SelectorFn(UniversalFn) { }
+
+	SELECTOR_MATCH_FNS
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &) const
+	{
+		return A::isTag(r);
+	}
+};
+
+// Type selector (E)
+struct Type : SelectorFn
+{
+	Type(const std::string &type) : SelectorFn(TypeFn), type(type) { }
+
+	SELECTOR_MATCH_FNS
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &) const
+	{
+		return (A::isTag(r) && A::hasTag(r, type.c_str()));
+	}
+
+	std::string type;
+};
+
+// Attribute selector (E[foo])
+struct Attribute : SelectorFn
+{
+	Attribute(const std::string &attr) : SelectorFn(AttributeFn), attr(attr) { }
+
+	SELECTOR_MATCH_FNS
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		const char *str;
+		size_t len;
+		return A::attribute(r, attr, ctx, &str, &len);
+	}
+
+	std::string attr;
+};
+
+// Attribute value, with optional comparison operator (E[foo=bar])
+struct AttributeValue : SelectorFn
+{
+	AttributeValue(const std::string &attr, const std::string &value, char c = '=', Variant variant = AttributeValueFn)
+		: SelectorFn(variant), attr(attr), value(value), c(c) { }
+
+	SELECTOR_MATCH_FNS
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		if (value.empty() && c != '=') return false;
+
+		// Missing attributes are treated like empty ones
+		const char *str = "";
+		size_t len = 0;
+		A::attribute(r, attr, ctx, &str, &len);
+		return matchValue(str, len);
+	}
+
+	bool matchValue(const char *str, size_t len) const
+	{
+		const char *v = value.c_str();
+		size_t l = value.length();
+		switch (c) {
+			case '=': return (len == l && !::strncasecmp(str, v, l));
+			case '^': return (len >= l && !::strncasecmp(str, v, l));
+			case '$': return (len >= l && !::strncasecmp(str + len - l, v, l));
+			case '*': return (std::search(str, str + len, v, v + l) != str + len);
+			case '|': return ((len == l || (len > l && str[l] == '-')) && !::strncasecmp(str, v, l));
+			case '~': {
+				// Split string by space and compare every part
+				const char *ptr = str, *last = str;
+				const char *end = str + len;
+				while (ptr < end) {
+					while (ptr < end && !isspace(*ptr)) ++ptr;
+					if ((size_t)(ptr - last) == l && !::strncasecmp(v, last, l)) {
+						return true;
+					}
+					while (ptr < end && isspace(*ptr)) ++ptr;
+					last = ptr;
+				}
+				return false;
+			}
+			default: break;
+		}
+		return true;
+	}
+
+	std::string attr;
+	std::string value;
+	char c;
+};
+
+// Class selector (.foo), equivalent to [class~=foo]
+struct Class : AttributeValue
+{
+	Class(const std::string &name, int index)
+		: AttributeValue("class", name, '~', ClassFn), index(index) { }
+
+	SELECTOR_MATCH_FNS
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		if (value.empty()) return false;
+
+		// Use the class index of the document, if any
+		int has = A::hasClass(r, value, index, ctx);
+		if (has >= 0) {
+			return has;
+		}
+		return AttributeValue::matchT<A>(r, ctx);
+	}
+
+	int index;
+};
+
+// Pseudo class or element
+struct Pseudo : SelectorFn
+{
+	// Supported pseudo-classes, resolved when parsing so that matching
+	// does not need to compare strings
+	enum Kind
+	{
+		Unknown, Root, FirstChild, LastChild, FirstOfType, LastOfType,
+		OnlyChild, OnlyOfType, Empty, NthChild, NthLastChild, NthOfType,
+		NthLastOfType, Text, Comment, Contains, IContains
+	};
+
+	Pseudo(const std::string &type, int an = 0, int b = 0)
+		: SelectorFn(PseudoFn), type(type), kind(resolve(type)), an(an), b(b), search(NULL) { }
+
+	// Text pseudo-classes (:contains() and :icontains())
+	Pseudo(const std::string &type, const std::string &text)
+		: SelectorFn(PseudoFn), type(type), kind(resolve(type)), an(0), b(0), search(NULL)
+	{
+		if (kind == Contains || kind == IContains) {
+			search = new TextSearch(text, kind == IContains);
+		}
+	}
+
+	~Pseudo() { delete search; }
+
+	static Kind resolve(const std::string &type)
+	{
+		static const char *names[] = {
+			"", "root", "first-child", "last-child", "first-of-type", "last-of-type",
+			"only-child", "only-of-type", "empty", "nth-child", "nth-last-child", "nth-of-type",
+			"nth-last-of-type", "text", "comment", "contains", "icontains"
+		};
+		for (size_t i = 1; i < sizeof(names) / sizeof(names[0]); ++i) {
+			if (type == names[i]) return (Kind)i;
+		}
+		return Unknown;
+	}
+
+	bool checkNum(int i) const
+	{
+		if (an == 0) {
+			return (i == b);
+		}
+		return (((i - b) % an) == 0);
+	}
+
+	template <class A>
+	bool matchs(const typename A::Ref &r, Kind kind) const
+	{
+		typename A::Ref jt;
+		if (kind == Root) {
+			return !hasParent<A>(r);
+		} else if (kind == FirstChild) {
+			if (!hasParent<A>(r)) return false;
+			return A::isTag(r) && !A::valid(A::prevElement(r));
+		} else if (kind == LastChild) {
+			if (!hasParent<A>(r)) return false;
+			return A::isTag(r) && !A::valid(A::nextElement(r));
+		} else if (kind == FirstOfType) {
+			if (!hasParent<A>(r) || !A::isTag(r)) return false;
+			for (jt = A::prevElement(r); A::valid(jt); jt = A::prevElement(jt)) {
+				if (A::sameTag(jt, r)) return false;
+			}
+			return true;
+		} else if (kind == LastOfType) {
+			if (!hasParent<A>(r) || !A::isTag(r)) return false;
+			for (jt = A::nextElement(r); A::valid(jt); jt = A::nextElement(jt)) {
+				if (A::sameTag(jt, r)) return false;
+			}
+			return true;
+		} else if (kind == Empty) {
+			if (A::isTag(r)) {
+				jt = A::firstChild(r);
+				return (!A::valid(jt) ||
+						(A::isComment(jt) && !A::valid(A::nextSibling(jt))));
+			}
+			return (A::isComment(r) || A::length(r) == 0);
+		} else if (kind == NthChild) {
+			if (!hasParent<A>(r)) return false;
+			int i = 1;
+			for (jt = A::prevElement(r); A::valid(jt); jt = A::prevElement(jt)) {
+				++i;
+			}
+			return checkNum(i);
+		} else if (kind == NthLastChild) {
+			if (!hasParent<A>(r)) return false;
+			int i = 1;
+			for (jt = A::nextElement(r); A::valid(jt); jt = A::nextElement(jt)) {
+				++i;
+			}
+			return checkNum(i);
+		} else if (kind == NthOfType) {
+			if (!hasParent<A>(r)) return false;
+			int i = 1;
+			for (jt = A::prevElement(r); A::valid(jt); jt = A::prevElement(jt)) {
+				if (A::sameTag(jt, r)) ++i;
+			}
+			return checkNum(i);
+		} else if (kind == NthLastOfType) {
+			if (!hasParent<A>(r)) return false;
+			int i = 1;
+			for (jt = A::nextElement(r); A::valid(jt); jt = A::nextElement(jt)) {
+				if (A::sameTag(jt, r)) ++i;
+			}
+			return checkNum(i);
+		} else if (kind == Text) {
+			return (!A::isTag(r) && !A::isComment(r));
+		} else if (kind == Comment) {
+			return A::isComment(r);
+		}
+		return false;
+	}
+
+	SELECTOR_MATCH_FNS
+
+	int features() const
+	{
+		if (kind == Empty || kind == Contains || kind == IContains) {
+			return Structural;
+		} else if (kind == Root || kind == Text || kind == Comment) {
+			return 0;
+		}
+		return Positional;
+	}
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		if (search) {
+			return matchText<A>(r, ctx);
+		} else if (kind == OnlyChild) {
+			return matchs<A>(r, FirstChild) && matchs<A>(r, LastChild);
+		} else if (kind == OnlyOfType) {
+			return matchs<A>(r, FirstOfType) && matchs<A>(r, LastOfType);
+		}
+		return matchs<A>(r, kind);
+	}
+
+	// Checks whether the text of an element contains the search string.
+	// When matching many nodes, the text of the whole document is
+	// scanned once and the elements containing matches are marked.
+	template <class A>
+	bool matchText(const typename A::Ref &r, Context &ctx) const
+	{
+		if (!A::isTag(r)) {
+			return false;
+		} else if (search->length() == 0) {
+			return true;
+		} else if (!ctx.bulk) {
+			TextScan<A> scan(*search, A::carry(ctx));
+			typename A::Ref jt, first;
+			for (jt = r; advance<A>(jt, r); ) {
+				if (scan.feed(jt, ctx, &first)) return true;
+			}
+			return false;
+		}
+
+		MarkTable<typename A::Marks> &marks = A::marks(ctx);
+		typename A::Marks *m = marks.find(this);
+		if (!m) {
+			m = &marks.insert(this);
+			markText<A>(r, *m, ctx);
+		}
+		return A::marked(*m, r);
+	}
+
+	// Marks all elements of the document containing r whose text contains
+	// the search string. Propagation stops at marked nodes.
+	template <class A>
+	void markText(const typename A::Ref &r, typename A::Marks &marks, Context &ctx) const
+	{
+		typename A::Ref top = r, jt, kt, first;
+		while (A::valid(A::parent(top))) top = A::parent(top);
+		A::initMarks(marks, top);
+
+		TextScan<A> scan(*search, A::carry(ctx));
+		for (jt = top; advance<A>(jt, top); ) {
+			int found = scan.feed(jt, ctx, &first);
+			if (!found) {
+				continue;
+			}
+
+			// The innermost element containing a match that spans several
+			// text nodes is the common ancestor of the first and last one
+			kt = A::parent(jt);
+			if (found == TextScan<A>::Spanning) {
+				for (kt = A::parent(first); A::valid(kt) && !isAncestor<A>(kt, jt); kt = A::parent(kt)) ;
+			}
+			for (; A::valid(kt) && !A::marked(marks, kt); kt = A::parent(kt)) {
+				A::mark(marks, kt);
+			}
+		}
+	}
+
+	std::string type;
+	Kind kind;
+	int an, b;
+	TextSearch *search;
+
+private:
+	Pseudo(const Pseudo &);
+	Pseudo &operator=(const Pseudo &);
+};
+
+// Negation (:not)
+struct Negation : SelectorFn
+{
+	Negation(SelectorFn *fn) : SelectorFn(NegationFn), fn(fn) { }
+	~Negation() { delete fn; }
+
+	SELECTOR_MATCH_FNS
+
+	int features() const
+	{
+		return fn->features();
+	}
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		return !dispatch<A>(fn, r, ctx);
+	}
+
+	SelectorFn *fn;
+};
+
+// Matches-any (:is, :where)
+struct MatchesAny : SelectorFn
+{
+	MatchesAny(const std::vector<SelectorFn *> &fns) : SelectorFn(MatchesAnyFn), fns(fns) { }
+	~MatchesAny() { delete_all(fns); }
+
+	SELECTOR_MATCH_FNS
+
+	int features() const
+	{
+		int f = 0;
+		for (size_t i = 0; i < fns.size(); ++i) {
+			f |= fns[i]->features();
+		}
+		return f;
+	}
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		for (size_t i = 0; i < fns.size(); ++i) {
+			if (dispatch<A>(fns[i], r, ctx)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::vector<SelectorFn *> fns;
+};
+
+// Relational pseudo-class (:has) with a single relative selector. The
+// selector is split into its sequences: fn is matched against the nodes
+// standing in relation c to the anchor, like an implicit :scope, and next
+// (if any) checks the rest of the selector from there. If many nodes are
+// matched, the nodes satisfying the relation are marked in a single pass
+// by propagating the matches of the argument to their anchors.
+struct Relative : SelectorFn
+{
+	Relative(SelectorFn *fn, char c, Relative *next = NULL) : SelectorFn(RelativeFn), fn(fn), c(c), next(next) { }
+	~Relative() { delete fn; delete next; }
+
+	SELECTOR_MATCH_FNS
+
+	int features() const
+	{
+		// The anchor depends on its descendants and following siblings
+		return Structural | Positional | (c == '+' || c == '~' ? Preceding : 0)
+			| fn->features() | (next ? next->features() : 0);
+	}
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		if (!ctx.bulk) {
+			return matchDirect<A>(r, ctx);
+		}
+
+		MarkTable<typename A::Marks> &marks = A::marks(ctx);
+		typename A::Marks *m = marks.find(this);
+		if (!m) {
+			m = &marks.insert(this);
+			markAnchors<A>(r, *m, ctx);
+		}
+		return A::marked(*m, r);
+	}
+
+	// Checks whether a node related to an anchor matches the sequence
+	// and the rest of the selector
+	template <class A>
+	inline bool matchRelated(const typename A::Ref &r, Context &ctx) const
+	{
+		return dispatch<A>(fn, r, ctx) && (!next || dispatch<A>(next, r, ctx));
+	}
+
+	// Checks the relation for a single node
+	template <class A>
+	bool matchDirect(const typename A::Ref &r, Context &ctx) const
+	{
+		typename A::Ref jt, kt;
+		switch (c) {
+			case ' ':
+				for (jt = r; advance<A>(jt, r); ) {
+					if (matchRelated<A>(jt, ctx)) return true;
+				}
+				return false;
+			case '*':
+				for (kt = A::firstChild(r); A::valid(kt); kt = A::nextSibling(kt)) {
+					for (jt = kt; advance<A>(jt, kt); ) {
+						if (matchRelated<A>(jt, ctx)) return true;
+					}
+				}
+				return false;
+			case '>':
+				for (jt = A::firstChild(r); A::valid(jt); jt = A::nextSibling(jt)) {
+					if (matchRelated<A>(jt, ctx)) return true;
+				}
+				return false;
+			case '+':
+				jt = A::nextElement(r);
+				return A::valid(jt) && matchRelated<A>(jt, ctx);
+			case '~':
+				for (jt = A::nextElement(r); A::valid(jt); jt = A::nextElement(jt)) {
+					if (matchRelated<A>(jt, ctx)) return true;
+				}
+				return false;
+			default: break;
+		}
+		return false;
+	}
+
+	// Marks all anchors of argument matches in the document containing r.
+	// Propagation stops at nodes that have already been marked, so every
+	// node is marked at most once.
+	template <class A>
+	void markAnchors(const typename A::Ref &r, typename A::Marks &marks, Context &ctx) const
+	{
+		typename A::Ref top = r, jt, kt;
+		while (A::valid(A::parent(top))) top = A::parent(top);
+		A::initMarks(marks, top);
+
+		for (jt = top; advance<A>(jt, top); ) {
+			if (!matchRelated<A>(jt, ctx)) {
+				continue;
+			}
+			switch (c) {
+				case ' ':
+				case '*':
+					kt = A::parent(jt);
+					if (c == '*' && A::valid(kt)) kt = A::parent(kt);
+					for (; A::valid(kt) && !A::marked(marks, kt); kt = A::parent(kt)) {
+						A::mark(marks, kt);
+					}
+					break;
+				case '>':
+					A::mark(marks, A::parent(jt));
+					break;
+				case '+':
+					kt = A::prevElement(jt);
+					if (A::valid(kt)) A::mark(marks, kt);
+					break;
+				case '~':
+					for (kt = A::prevElement(jt); A::valid(kt) && !A::marked(marks, kt); kt = A::prevElement(kt)) {
+						A::mark(marks, kt);
+					}
+					break;
+				default: break;
+			}
+		}
+	}
+
+	SelectorFn *fn;
+	char c;
+	Relative *next;
+};
+
+// Type, class or id required by a simple selector, which can be looked up
+// in the indexes of flat and mapped documents
+struct Atom
+{
+	enum Kind { None, TypeAtom, ClassAtom, IdAtom };
+
+	Atom(Kind kind = None, const std::string *name = NULL) : kind(kind), name(name) { }
+
+	Kind kind;
+	const std::string *name;
+};
+
+// Returns the type, class or id required by a simple selector, if any
+inline Atom atom(const SelectorFn *fn)
+{
+	const AttributeValue *a;
+	switch (fn->variant) {
+		case SelectorFn::TypeFn:
+			return Atom(Atom::TypeAtom, &static_cast<const Type *>(fn)->type);
+		case SelectorFn::ClassFn:
+			a = static_cast<const Class *>(fn);
+			return (a->value.empty() ? Atom() : Atom(Atom::ClassAtom, &a->value));
+		case SelectorFn::AttributeValueFn:
+			a = static_cast<const AttributeValue *>(fn);
+			return (a->attr == "id" && a->c == '=' && !a->value.empty() ? Atom(Atom::IdAtom, &a->value) : Atom());
+		default: break;
+	}
+	return Atom();
+}
+
+// A simple selector sequence
+struct SimpleSequence : SelectorFn
+{
+	SimpleSequence(const std::vector<SelectorFn *> &fns, int step)
+		: SelectorFn(SimpleSequenceFn), fns(fns), step(step) { }
+	~SimpleSequence() { delete_all(fns); }
+
+	SELECTOR_MATCH_FNS
+
+	int features() const
+	{
+		int f = 0;
+		for (size_t i = 0; i < fns.size(); ++i) {
+			f |= fns[i]->features();
+		}
+		return f;
+	}
+
+	// Looks up the nodes of a flat document having the type, class or id
+	// of this sequence with the fewest nodes. Returns false if the
+	// sequence contains none of these.
+	bool key(const FlatDocument &doc, std::string *name, const int **begin, const int **end) const
+	{
+		bool found = false;
+		for (size_t i = 0; i < fns.size(); ++i) {
+			const std::vector<int> *offsets, *nodes;
+			std::string s;
+			int k;
+			Atom a = atom(fns[i]);
+			if (a.kind == Atom::TypeAtom) {
+				k = doc.tagId(*a.name);
+				offsets = &doc.tagBegin; nodes = &doc.tagNodes;
+				s = *a.name;
+			} else if (a.kind == Atom::ClassAtom) {
+				k = doc.classId(*a.name);
+				offsets = &doc.classNodeBegin; nodes = &doc.classNodes;
+				s = "." + *a.name;
+			} else if (a.kind == Atom::IdAtom) {
+				k = doc.idId(*a.name);
+				offsets = &doc.idBegin; nodes = &doc.idNodes;
+				s = "#" + *a.name;
+			} else {
+				continue;
+			}
+
+			const int *b = NULL, *e = NULL;
+			if (k >= 0) {
+				b = &(*nodes)[0] + (*offsets)[k];
+				e = &(*nodes)[0] + (*offsets)[k+1];
+			}
+			if (!found || e - b < *end - *begin) {
+				*name = s;
+				*begin = b;
+				*end = e;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	// Candidates are taken from the index of the most selective type, class
+	// or id, if any
+	bool join(const FlatDocument &doc, int begin, int end, Context &ctx, std::vector<int> *result) const
+	{
+		std::string name;
+		const int *it, *last;
+		bool indexed = key(doc, &name, &it, &last);
+		if (indexed) {
+			it = std::lower_bound(it, last, begin);
+			last = std::lower_bound(it, last, end);
+		}
+
+		FlatRef ref = { &doc, begin };
+		while (indexed ? it != last : ref.i < end) {
+			if (indexed) ref.i = *it++;
+			ctx.visit();
+			++ctx.candidates;
+			if (match(ref, ctx)) {
+				result->push_back(ref.i);
+			}
+			if (!indexed) ++ref.i;
+		}
+		return true;
+	}
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		HCXSELECT_STAT(ctx, stepCalls[step]++);
+		std::vector<SelectorFn *>::const_iterator ft(fns.begin());
+		std::vector<SelectorFn *>::const_iterator end(fns.end());
+		while (ft != end) {
+			ctx.evaluate();
+			if (!dispatch<A>(*ft, r, ctx)) {
+				break;
+			}
+			++ft;
+		}
+		return (ft == end);
+	}
+
+	std::vector<SelectorFn *> fns;
+	int step;
+};
+
+// Combinator ( , >, ~, +)
+struct Combinator : SelectorFn
+{
+	Combinator(SelectorFn *left, SelectorFn *right, char c) : SelectorFn(CombinatorFn), left(left), right(right), c(c) { }
+	~Combinator() { delete left; delete right; }
+
+	SELECTOR_MATCH_FNS
+
+	int features() const
+	{
+		int l = left->features();
+		int f = right->features() | (l & Sibling);
+		if (l & (Positional | LeftPositional)) f |= LeftPositional;
+		if (l & (Structural | LeftStructural)) f |= LeftStructural;
+		if (c == '+' || c == '~') f |= Sibling;
+		return f;
+	}
+
+	// Descendant and child combinators are evaluated by joining the
+	// candidates of both sides, using the pre-order indices and subtree
+	// ends of the flat document as intervals.
+	bool join(const FlatDocument &doc, int begin, int end, Context &ctx, std::vector<int> *result) const
+	{
+		if (c == '+' || c == '~') return false;
+
+		std::vector<int> r, l;
+		if (!right->join(doc, begin, end, ctx, &r)) return false;
+		if (r.empty()) return true;
+		if (!left->join(doc, 0, r.back(), ctx, &l)) return false;
+
+		std::vector<int> stack; // Candidates containing the current node
+		std::vector<int>::const_iterator lt = l.begin();
+		for (std::vector<int>::const_iterator it = r.begin(); it != r.end(); ++it) {
+			FlatRef ref = { &doc, *it };
+			if (!hasParent<FlatAccess>(ref)) continue;
+
+			if (c == '>') {
+				if (std::binary_search(l.begin(), l.end(), doc.parent[*it])) {
+					result->push_back(*it);
+				}
+				continue;
+			}
+
+			for (; lt != l.end() && *lt < *it; ++lt) {
+				while (!stack.empty() && doc.end[stack.back()] <= *lt) stack.pop_back();
+				stack.push_back(*lt);
+			}
+			while (!stack.empty() && doc.end[stack.back()] <= *it) stack.pop_back();
+			HCXSELECT_STAT(ctx, ancestorSteps++);
+			if (!stack.empty() && (c == ' ' || doc.depth[stack.front()] + 2 <= doc.depth[*it])) {
+				result->push_back(*it);
+			}
+		}
+		return true;
+	}
+
+	template <class A>
+	bool matchT(const typename A::Ref &r, Context &ctx) const
+	{
+		// First, check if the node matches the right side of the combinator
+		if (!dispatch<A>(right, r, ctx)) {
+			return false;
+		}
+
+		// Check all suitable neighbor nodes using the left selector
+		typename A::Ref jt;
+		switch (c) {
+			case ' ': // Descendant
+			case '*': // Greatchild or further descendant
+				if (!hasParent<A>(r)) return false;
+				jt = A::parent(r);
+				if (c == '*' && A::valid(jt)) {
+					HCXSELECT_STAT(ctx, ancestorSteps++);
+					jt = A::parent(jt);
+				}
+				while (A::valid(jt)) {
+					HCXSELECT_STAT(ctx, ancestorSteps++);
+					if (dispatch<A>(left, jt, ctx)) {
+						return true;
+					}
+					jt = A::parent(jt);
+				}
+				return false;
+
+			case '>': // Child
+				if (!hasParent<A>(r)) return false;
+				jt = A::parent(r);
+				HCXSELECT_STAT(ctx, ancestorSteps++);
+				return A::valid(jt) && dispatch<A>(left, jt, ctx);
+
+			case '+': // Adjacent sibling
+				if (!hasParent<A>(r)) return false;
+				jt = A::prevElement(r);
+				HCXSELECT_STAT(ctx, siblingSteps++);
+				return A::valid(jt) && dispatch<A>(left, jt, ctx);
+
+			case '~': // General sibling
+				if (!hasParent<A>(r)) return false;
+				return preceded<A>(r, ctx);
+
+			default: break;
+		}
+
+		return false;
+	}
+
+	// Checks whether an element preceding r in the list of children of its
+	// parent matches the left side. The result for the last node checked
+	// below a parent is kept in the context, so the previous siblings of a
+	// node only need to be examined up to that node. Visiting the children
+	// of a parent in document order thus takes linear time.
+	template <class A>
+	bool preceded(const typename A::Ref &r, Context &ctx) const
+	{
+		typedef typename A::Key Key;
+		Key parent = A::key(A::parent(r));
+		Key node = A::key(r);
+		SiblingStates<Key> &states = A::siblings(ctx);
+		SiblingState<Key> *state = states.find(this, parent);
+		if (state && state->node == node) {
+			return state->matched;
+		}
+
+		// Matching the left side may replace the state, so keep a copy
+		bool cached = (state != NULL);
+		SiblingState<Key> last = (cached ? *state : SiblingState<Key>());
+		bool matched = false;
+		for (typename A::Ref jt = A::prevElement(r); A::valid(jt); jt = A::prevElement(jt)) {
+			HCXSELECT_STAT(ctx, siblingSteps++);
+			if (cached && A::key(jt) == last.node) {
+				matched = last.matched || dispatch<A>(left, jt, ctx);
+				break;
+			}
+			if (dispatch<A>(left, jt, ctx)) {
+				matched = true;
+				break;
+			}
+		}
+
+		state = states.find(this, parent);
+		if (state) {
+			state->node = node;
+			state->matched = matched;
+		} else {
+			SiblingState<Key> s = { this, parent, node, matched };
+			states.insert(s);
+		}
+		return matched;
+	}
+
+	SelectorFn *left, *right;
+	char c;
+};
+
+#undef SELECTOR_MATCH_FNS
+
+// Returns the rightmost sequence of a selector
+inline const SimpleSequence *rightmost(const SelectorFn *fn)
+{
+	while (fn->variant == SelectorFn::CombinatorFn) {
+		fn = static_cast<const Combinator *>(fn)->right;
+	}
+	return static_cast<const SimpleSequence *>(fn);
+}
+
+// Splits a selector into its sequences, from right to left, and the
+// combinators between them. Combinator i joins sequence i + 1 on its left
+// to sequence i.
+inline void split(const SelectorFn *fn, std::vector<const SimpleSequence *> *seqs, std::string *combinators)
+{
+	while (fn->variant == SelectorFn::CombinatorFn) {
+		const Combinator *c = static_cast<const Combinator *>(fn);
+		seqs->push_back(static_cast<const SimpleSequence *>(c->right));
+		*combinators += c->c;
+		fn = c->left;
+	}
+	seqs->push_back(static_cast<const SimpleSequence *>(fn));
+}
+
+template <class A>
+inline bool dispatch(const SelectorFn *fn, const typename A::Ref &r, Context &ctx)
+{
+	switch (fn->variant) {
+		case SelectorFn::UniversalFn: return static_cast<const Universal *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::TypeFn: return static_cast<const Type *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::AttributeFn: return static_cast<const Attribute *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::AttributeValueFn: return static_cast<const AttributeValue *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::ClassFn: return static_cast<const Class *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::PseudoFn: return static_cast<const Pseudo *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::NegationFn: return static_cast<const Negation *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::MatchesAnyFn: return static_cast<const MatchesAny *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::RelativeFn: return static_cast<const Relative *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::SimpleSequenceFn: return static_cast<const SimpleSequence *>(fn)->matchT<A>(r, ctx);
+		case SelectorFn::CombinatorFn: return static_cast<const Combinator *>(fn)->matchT<A>(r, ctx);
+	}
+	return false;
+}
+
+} // namespace Selectors
+
+using Selectors::SelectorFn;
+
+// Selector functions, limits and number of steps of a compiled selector
+const std::vector<SelectorFn *> &functions(const CompiledSelector &selector);
+const Limits &limits(const CompiledSelector &selector);
+int steps(const CompiledSelector &selector);
+
+template <class T> struct TraitsAccess;
+
+// Per-query state for documents accessed through node traits, holding
+// the precomputed relative matches, the text scan buffers and the sibling
+// states keyed by T::Key
+template <class T>
+struct TraitsContext : Context
+{
+	TraitsContext(Statistics *stats, bool bulk, const Limits *limits)
+		: Context(stats, bulk, limits) { }
+
+	MarkTable<typename TraitsAccess<T>::Marks> marks;
+	TextCarry<typename T::Ref> carry;
+	SiblingStates<typename T::Key> siblings;
+};
+
+// Node access policy forwarding to user-supplied node traits T. All
+// functions are static, so that calls to T are inlined.
+template <class T>
+struct TraitsAccess
+{
+	typedef typename T::Ref Ref;
+	typedef typename T::Key Key;
+	typedef std::set<Key> Marks;
+
+	static inline bool valid(const Ref &r) { return T::valid(r); }
+	static inline bool same(const Ref &a, const Ref &b) { return T::same(a, b); }
+	static inline Key key(const Ref &r) { return T::key(r); }
+	static inline Ref parent(const Ref &r) { return T::parent(r); }
+	static inline Ref firstChild(const Ref &r) { return T::firstChild(r); }
+	static inline Ref nextSibling(const Ref &r) { return T::nextSibling(r); }
+	static inline Ref prevElement(const Ref &r) { return T::prevElement(r); }
+	static inline Ref nextElement(const Ref &r) { return T::nextElement(r); }
+	static inline bool isTag(const Ref &r) { return T::isTag(r); }
+	static inline bool isComment(const Ref &r) { return T::isComment(r); }
+	static inline unsigned int length(const Ref &r) { return T::length(r); }
+	static inline bool hasTag(const Ref &r, const char *tag) { return T::hasTag(r, tag); }
+	static inline bool sameTag(const Ref &a, const Ref &b) { return T::sameTag(a, b); }
+
+	static inline bool attribute(const Ref &r, const std::string &name, Context &, const char **str, size_t *len) {
+		return T::attribute(r, name, str, len);
+	}
+
+	static inline int hasClass(const Ref &r, const std::string &name, int, Context &) {
+		return T::hasClass(r, name);
+	}
+
+	static inline MarkTable<Marks> &marks(Context &ctx) {
+		return static_cast<TraitsContext<T> &>(ctx).marks;
+	}
+	static inline void initMarks(Marks &m, const Ref &) { m.clear(); }
+	static inline void mark(Marks &m, const Ref &r) { m.insert(T::key(r)); }
+	static inline bool marked(const Marks &m, const Ref &r) { return m.find(T::key(r)) != m.end(); }
+
+	static inline TextCarry<Ref> &carry(Context &ctx) {
+		return static_cast<TraitsContext<T> &>(ctx).carry;
+	}
+
+	static inline SiblingStates<Key> &siblings(Context &ctx) {
+		return static_cast<TraitsContext<T> &>(ctx).siblings;
+	}
+
+	static inline bool text(const Ref &r, const char **str, size_t *len) { return T::text(r, str, len); }
+};
+
+} // namespace detail
+
+
+/*!
+ * Base class for node traits, which adapt a custom document
+ * representation to the selector matcher. Derived is the traits class
+ * itself and R the node reference type, e.g. a pointer.
+ *
+ * The traits class must provide the following static functions:
+ * \code
+ * bool valid(const Ref &r);          // false for a null reference
+ * bool same(const Ref &a, const Ref &b);
+ * Ref parent(const Ref &r);
+ * Ref firstChild(const Ref &r);
+ * Ref nextSibling(const Ref &r);
+ * Ref prevSibling(const Ref &r);
+ * bool isTag(const Ref &r);          // whether the node is an element
+ * bool isComment(const Ref &r);
+ * unsigned int length(const Ref &r); // length of text nodes
+ * const char *tagName(const Ref &r);
+ * bool attribute(const Ref &r, const std::string &name, const char **value, size_t *length);
+ * \endcode
+ *
+ * Document order is the pre-order given by firstChild() and
+ * nextSibling(). The remaining functions have defaults below which may be
+ * hidden by the traits class, e.g. to compare interned tag names or to
+ * look up class names in an index.
+ */
+template <class Derived, class R>
+struct NodeTraits
+{
+	typedef R Ref;
+	typedef R Key; //!< Ordered key identifying a node
+
+	static inline Key key(const Ref &r) { return r; }
+
+	static inline Ref prevElement(Ref r) {
+		do { r = Derived::prevSibling(r); } while (Derived::valid(r) && !Derived::isTag(r));
+		return r;
+	}
+
+	static inline Ref nextElement(Ref r) {
+		do { r = Derived::nextSibling(r); } while (Derived::valid(r) && !Derived::isTag(r));
+		return r;
+	}
+
+	static inline bool hasTag(const Ref &r, const char *tag) {
+		return !::strcasecmp(Derived::tagName(r), tag);
+	}
+
+	static inline bool sameTag(const Ref &a, const Ref &b) {
+		return !::strcasecmp(Derived::tagName(a), Derived::tagName(b));
+	}
+
+	//! Returns 1 or 0 if the node has a class or not, or -1 to parse the
+	//! class attribute instead
+	static inline int hasClass(const Ref &, const std::string &) { return -1; }
+
+	//! Returns the text of a text node for \p :contains(), which matches
+	//! nothing if no text is available
+	static inline bool text(const Ref &, const char **, size_t *) { return false; }
+};
+
+/*!
+ * Checks whether a node matches a compiled selector, using the given node
+ * traits.
+ */
+template <class Traits>
+bool matches(const CompiledSelector &selector, const typename Traits::Ref &node)
+{
+	typedef detail::TraitsAccess<Traits> A;
+	const std::vector<detail::SelectorFn *> &fns = detail::functions(selector);
+	detail::TraitsContext<Traits> ctx(NULL, false, &detail::limits(selector));
+	for (size_t i = 0; i < fns.size(); ++i) {
+		if (detail::Selectors::dispatch<A>(fns[i], node, ctx)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*!
+ * Appends the nodes within the subtree of root (including root) that
+ * match a compiled selector to a list, in document order, using the given
+ * node traits.
+ */
+template <class Traits>
+void select(const CompiledSelector &selector, const typename Traits::Ref &root, std::vector<typename Traits::Ref> *out, Statistics *stats = NULL)
+{
+	typedef detail::TraitsAccess<Traits> A;
+	if (stats) {
+		stats->clear();
+		stats->stepCalls.resize(detail::steps(selector), 0);
+	}
+	if (!Traits::valid(root)) {
+		return;
+	}
+
+	const std::vector<detail::SelectorFn *> &fns = detail::functions(selector);
+	detail::TraitsContext<Traits> ctx(stats, true, &detail::limits(selector));
+	typename Traits::Ref r = root;
+	do {
+		ctx.visit();
+		for (size_t i = 0; i < fns.size(); ++i) {
+			if (detail::Selectors::dispatch<A>(fns[i], r, ctx)) {
+				out->push_back(r);
+				break;
+			}
+		}
+	} while (detail::Selectors::advance<A>(r, root));
+}
+
+} // namespace hcxselect
+
+#endif // HCXSELECT_MATCHER_H_
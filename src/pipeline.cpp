@@ -0,0 +1,446 @@
+/*
+ * hcxselect - A CSS selector engine for htmlcxx
+ * Copyright (C) 2011 Jonas Gehring
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+
+
+namespace hcxselect
+{
+
+// Anonymous namespace for local helpers
+namespace
+{
+
+// Returns the current time in seconds
+inline double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Waits a little longer on every call, starting with busy waiting
+inline void backoff(int *spins)
+{
+	if (++*spins < 64) {
+		return;
+	} else if (*spins < 128) {
+		sched_yield();
+	} else {
+		usleep(50);
+	}
+}
+
+// Bounded multi-producer, multi-consumer queue of pointers. Every cell
+// carries a sequence number that tells producers and consumers whether
+// it is free or filled for their position, so that positions are
+// claimed using compare-and-swap without any locks.
+template <class T>
+class BoundedQueue
+{
+public:
+	BoundedQueue(size_t capacity) : m_head(0), m_tail(0)
+	{
+		size_t n = 1;
+		while (n < capacity) n <<= 1;
+		m_cells.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			m_cells[i].seq = i;
+		}
+		m_mask = n - 1;
+	}
+
+	bool tryPush(T *value)
+	{
+		size_t pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+		Cell *cell;
+		for (;;) {
+			cell = &m_cells[pos & m_mask];
+			long diff = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+			if (diff == 0) {
+				if (__sync_bool_compare_and_swap(&m_tail, pos, pos + 1)) break;
+			} else if (diff < 0) {
+				return false; // Full
+			}
+			pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+		}
+		cell->value = value;
+		__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	bool tryPop(T **value)
+	{
+		size_t pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+		Cell *cell;
+		for (;;) {
+			cell = &m_cells[pos & m_mask];
+			long diff = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)(pos + 1);
+			if (diff == 0) {
+				if (__sync_bool_compare_and_swap(&m_head, pos, pos + 1)) break;
+			} else if (diff < 0) {
+				return false; // Empty
+			}
+			pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+		}
+		*value = cell->value;
+		__atomic_store_n(&cell->seq, pos + m_mask + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	void push(T *value)
+	{
+		for (int spins = 0; !tryPush(value); backoff(&spins)) ;
+	}
+
+	T *pop()
+	{
+		T *value;
+		for (int spins = 0; !tryPop(&value); backoff(&spins)) ;
+		return value;
+	}
+
+private:
+	struct Cell
+	{
+		size_t seq;
+		T *value;
+	};
+
+	std::vector<Cell> m_cells;
+	size_t m_mask;
+	char m_pad1[64];
+	size_t m_head;
+	char m_pad2[64];
+	size_t m_tail;
+};
+
+typedef BoundedQueue<PipelineDocument> DocumentQueue;
+
+// Pipeline stages, in the order in which documents pass them
+enum StageId { ReadStage, ParseStage, SelectStage };
+
+} // Anonymous namespace
+
+
+// Private data of a pipeline
+struct Pipeline::Data
+{
+	Data(Pipeline *owner, int slots)
+		: owner(owner), slots(slots), available(slots), parsing(slots), matching(slots), done(slots) { }
+
+	// Thread of a stage
+	struct Worker
+	{
+		Data *data;
+		StageId stage;
+		double busy;
+		pthread_t thread;
+	};
+
+	static void *main(void *arg)
+	{
+		Worker *w = (Worker *)arg;
+		w->data->work(w);
+		return NULL;
+	}
+
+	// Processes documents until all submitted ones have passed the stage
+	void work(Worker *w)
+	{
+		DocumentQueue *in[] = { &available, &parsing, &matching };
+		DocumentQueue *out[] = { &parsing, &matching, &done };
+		for (;;) {
+			// Readers take a free slot before claiming the next name, so
+			// that the earliest document in flight always has a slot
+			PipelineDocument *doc = NULL;
+			if (w->stage == ReadStage) {
+				doc = available.pop();
+			}
+			size_t k = __sync_fetch_and_add(&claimed[w->stage], 1);
+			if (k >= names->size()) {
+				if (doc) available.push(doc);
+				break;
+			}
+			if (!doc) {
+				doc = in[w->stage]->pop();
+			}
+
+			double start = now();
+			if (w->stage == ReadStage) {
+				doc->index = k;
+			}
+			try {
+				process(w->stage, doc, k);
+			} catch (...) {
+				// Exceptions must not leave the thread. The document is
+				// passed on as failed, so the sink still moves forward.
+				doc->error = true;
+				doc->dom = NULL;
+				for (size_t i = 0; i < doc->matches.size(); ++i) {
+					doc->matches[i].clear();
+				}
+			}
+			w->busy += now() - start;
+			out[w->stage]->push(doc);
+		}
+	}
+
+	// Passes a document through a stage
+	void process(StageId stage, PipelineDocument *doc, size_t k)
+	{
+		switch (stage) {
+			case ReadStage:
+				doc->name = (*names)[k];
+				doc->source.clear();
+				doc->dom = NULL;
+				doc->error = !owner->read(*doc);
+				__sync_fetch_and_add(&bytes, doc->source.length());
+				break;
+			case ParseStage:
+				if (!doc->error) {
+					doc->parser.parse(doc->source);
+					doc->dom = &doc->parser.getTree();
+				}
+				break;
+			case SelectStage:
+				doc->matches.resize(selectors.size());
+				doc->limited = false;
+				for (size_t i = 0; i < selectors.size(); ++i) {
+					doc->matches[i].clear();
+					if (!doc->dom) continue;
+					try {
+						selectInto(*doc->dom, selectors[i], &doc->matches[i]);
+					} catch (const LimitException &) {
+						doc->matches[i].clear();
+						doc->limited = true;
+					}
+				}
+				break;
+		}
+	}
+
+	Pipeline *owner;
+	std::vector<CompiledSelector> selectors;
+	int threads[3];
+	int slots;
+	std::vector<PipelineDocument> documents;
+	DocumentQueue available, parsing, matching, done; // Input queues of the stages and the sink
+
+	// Per-run state
+	const std::vector<std::string> *names;
+	volatile size_t claimed[3];
+	volatile size_t bytes;
+};
+
+
+/*!
+ * Constructs a pipeline.
+ *
+ * \param selectors The CSS selector expressions to apply to every document
+ * \param readers Number of reader threads
+ * \param parsers Number of parser threads
+ * \param matchers Number of selector threads
+ * \param slots Maximum number of documents in flight, defaulting to twice
+ *        the number of threads
+ * \param limits Limits for every selector and document
+ * \throws ParseException CSS selector parsing error
+ * \throws LimitException A selector exceeds the complexity or nesting limit
+ */
+Pipeline::Pipeline(const std::vector<std::string> &selectors, int readers, int parsers, int matchers, int slots,
+	const Limits &limits)
+{
+	readers = std::max(readers, 1);
+	parsers = std::max(parsers, 1);
+	matchers = std::max(matchers, 1);
+	if (slots <= 0) {
+		slots = 2 * (readers + parsers + matchers);
+	}
+
+	d = new Data(this, slots);
+	d->threads[ReadStage] = readers;
+	d->threads[ParseStage] = parsers;
+	d->threads[SelectStage] = matchers;
+	try {
+		for (size_t i = 0; i < selectors.size(); ++i) {
+			d->selectors.push_back(CompiledSelector(selectors[i], limits));
+		}
+	} catch (...) {
+		delete d;
+		throw;
+	}
+	d->documents.resize(slots);
+}
+
+/*!
+ * Destructor.
+ */
+Pipeline::~Pipeline()
+{
+	delete d;
+}
+
+/*!
+ * Passes the given documents through the pipeline and calls consume()
+ * for each of them in order. Returns after all documents have been
+ * consumed.
+ *
+ * \param names The names of the documents, passed to read()
+ * \param stats Optional statistics for this run
+ * \returns false if any document could not be read or processed
+ */
+bool Pipeline::run(const std::vector<std::string> &names, Statistics *stats)
+{
+	double start = now();
+	d->names = &names;
+	d->bytes = 0;
+	for (int s = 0; s < 3; ++s) {
+		d->claimed[s] = 0;
+	}
+	for (int i = 0; i < d->slots; ++i) {
+		d->available.push(&d->documents[i]);
+	}
+
+	std::vector<Data::Worker> workers;
+	for (int s = ReadStage; s <= SelectStage; ++s) {
+		for (int i = 0; i < d->threads[s]; ++i) {
+			Data::Worker w = { d, (StageId)s, 0.0, pthread_t() };
+			workers.push_back(w);
+		}
+	}
+	for (size_t i = 0; i < workers.size(); ++i) {
+		pthread_create(&workers[i].thread, NULL, Data::main, &workers[i]);
+	}
+
+	// Documents finish out of order, but at most one per slot is in
+	// flight, so they are buffered by their index modulo the number of
+	// slots until all preceding ones have been consumed
+	std::vector<PipelineDocument *> pending(d->slots, (PipelineDocument *)NULL);
+	size_t next = 0;
+	bool ok = true;
+	double busy = 0.0;
+	for (size_t k = 0; k < names.size(); ++k) {
+		PipelineDocument *doc = d->done.pop();
+		pending[doc->index % d->slots] = doc;
+		double t = now();
+		while ((doc = pending[next % d->slots]) != NULL && doc->index == next) {
+			pending[next % d->slots] = NULL;
+			ok = (ok && !doc->error);
+			consume(*doc);
+			d->available.push(doc);
+			++next;
+		}
+		busy += now() - t;
+	}
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	PipelineDocument *doc;
+	while (d->available.tryPop(&doc)) ;
+
+	if (stats) {
+		stats->documents = names.size();
+		stats->bytes = d->bytes;
+		stats->time = now() - start;
+		Stage *stages[] = { &stats->read, &stats->parse, &stats->select };
+		for (int s = ReadStage; s <= SelectStage; ++s) {
+			stages[s]->threads = d->threads[s];
+			stages[s]->busy = 0.0;
+		}
+		for (size_t i = 0; i < workers.size(); ++i) {
+			stages[workers[i].stage]->busy += workers[i].busy;
+		}
+		stats->sink.threads = 1;
+		stats->sink.busy = busy;
+	}
+	return ok;
+}
+
+/*!
+ * Reads the source of a document. By default, this reads the file
+ * named by the document.
+ *
+ * \param doc The document whose source should be filled in
+ * \returns false if reading failed
+ */
+bool Pipeline::read(PipelineDocument &doc)
+{
+	FILE *f = fopen(doc.name.c_str(), "rb");
+	if (f == NULL) {
+		return false;
+	}
+	char buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		doc.source.append(buffer, n);
+	}
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+/*!
+ * Returns a human-readable report of the throughput and of the
+ * utilization of every stage, i.e. the fraction of time its threads
+ * have been busy.
+ */
+std::string Pipeline::Statistics::describe() const
+{
+	std::ostringstream ss;
+	ss << std::fixed << std::setprecision(1);
+	ss << documents << " documents, " << bytes / 1048576.0 << " MB in " << time * 1000 << " ms: ";
+	ss << (time > 0 ? documents / time : 0.0) << " documents/s, "
+		<< (time > 0 ? bytes / 1048576.0 / time : 0.0) << " MB/s\n";
+
+	const char *labels[] = { "read", "parse", "select", "sink" };
+	const Stage *stages[] = { &read, &parse, &select, &sink };
+	for (int s = 0; s < 4; ++s) {
+		double capacity = time * stages[s]->threads;
+		ss << std::setw(7) << std::left << labels[s] << std::right
+			<< std::setw(3) << stages[s]->threads << " threads, busy "
+			<< std::setw(8) << stages[s]->busy * 1000 << " ms, utilization "
+			<< std::setw(5) << (capacity > 0 ? 100 * stages[s]->busy / capacity : 0.0) << "%\n";
+	}
+	return ss.str();
+}
+
+} // namespace hcxselect
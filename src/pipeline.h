@@ -0,0 +1,133 @@
+/*
+ * hcxselect - A CSS selector engine for htmlcxx
+ * Copyright (C) 2011 Jonas Gehring
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef HCXSELECT_PIPELINE_H_
+#define HCXSELECT_PIPELINE_H_
+
+#include <string>
+#include <vector>
+
+#include <htmlcxx/html/ParserDom.h>
+
+#include "hcxselect.h"
+
+
+namespace hcxselect
+{
+
+/*!
+ * Document passing through a Pipeline. Documents are recycled: once a
+ * document has been consumed, its buffers, parser and tree are reused
+ * for a later one.
+ */
+struct PipelineDocument
+{
+	PipelineDocument() : index(0), error(false), limited(false), dom(NULL) { }
+
+	size_t index;                 //!< Position in the list of submitted names
+	std::string name;             //!< Submitted name, e.g. a file path
+	std::string source;           //!< HTML source, filled in by the reader stage
+	bool error;                   //!< Whether reading the source failed or a stage threw an exception
+	bool limited;                 //!< Whether a selector exceeded its limits, leaving its matches empty
+	htmlcxx::HTML::ParserDom parser; //!< Parser owning the tree
+	const tree<htmlcxx::HTML::Node> *dom; //!< Parsed tree, or NULL on error
+	std::vector<std::vector<Node *> > matches; //!< Matching nodes in document order, per selector
+};
+
+/*!
+ * Driver that overlaps reading, parsing and matching of many documents.
+ * Documents flow through a reader, a parser and a selector stage, each
+ * running on its own threads and connected by bounded lock-free queues.
+ * The number of documents in flight is limited by a fixed number of
+ * recycled PipelineDocument slots. Results are passed to consume() in
+ * the order in which the documents have been submitted, on the thread
+ * that called run().
+ *
+ * Subclasses implement consume() and may override read(), which copies
+ * the file named by the document into its source by default. read() is
+ * called concurrently if there are multiple reader threads. Exceptions
+ * thrown by read(), by parsing or by selection are caught per document,
+ * which is then passed to consume() with its error flag set.
+ */
+class Pipeline
+{
+public:
+	/*!
+	 * Work done by the threads of a pipeline stage.
+	 */
+	struct Stage
+	{
+		int threads; //!< Number of threads
+		double busy; //!< Time in seconds spent working, summed over all threads
+	};
+
+	/*!
+	 * Throughput and utilization of a pipeline run.
+	 */
+	struct Statistics
+	{
+		size_t documents;   //!< Number of documents
+		size_t bytes;       //!< Total size of all sources
+		double time;        //!< Wall time in seconds
+		Stage read;         //!< Reader stage
+		Stage parse;        //!< Parser stage
+		Stage select;       //!< Selector stage
+		Stage sink;         //!< In-order delivery to consume()
+
+		std::string describe() const;
+	};
+
+	Pipeline(const std::vector<std::string> &selectors, int readers = 1, int parsers = 1, int matchers = 1, int slots = 0,
+		const Limits &limits = Limits());
+	virtual ~Pipeline();
+
+	bool run(const std::vector<std::string> &names, Statistics *stats = NULL);
+
+protected:
+	virtual bool read(PipelineDocument &doc);
+
+	/*!
+	 * Called for every document in submission order.
+	 *
+	 * \param doc The document, which will be reused after returning
+	 */
+	virtual void consume(const PipelineDocument &doc) = 0;
+
+private:
+	Pipeline(const Pipeline &);
+	Pipeline &operator=(const Pipeline &);
+
+	struct Data;
+	Data *d;
+};
+
+} // namespace hcxselect
+
+#endif // HCXSELECT_PIPELINE_H_
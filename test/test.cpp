@@ -28,19 +28,59 @@
  */
 
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <istream>
+#include <map>
+#include <new>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <htmlcxx/html/ParserDom.h>
 
+#include <arena.h>
 #include <hcxselect.h>
+#include <matcher.h>
+#include <pipeline.h>
+
+#include <unistd.h>
 
 using namespace std;
 
 
+// Global allocation counter, see checkAllocations(). Updated atomically
+// since the pipeline allocates from multiple threads.
+static size_t allocations = 0;
+
+#if __cplusplus >= 201103L
+#define THROW_BAD_ALLOC
+#define THROW_NOTHING noexcept
+#else
+#define THROW_BAD_ALLOC throw(std::bad_alloc)
+#define THROW_NOTHING throw()
+#endif
+
+void *operator new(size_t size) THROW_BAD_ALLOC
+{
+	__sync_fetch_and_add(&allocations, 1);
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) THROW_NOTHING
+{
+	free(p);
+}
+
+
 const char *rawsource = \
 "<html>"
 "  <ul>"
@@ -166,6 +206,10 @@ struct tvec {
 	{"span + div a", 1, "<a class=\"13\" href=\"http://example.com\"></a>"}, // 88
 	{"p td > span", 1, "<span class=\"sp\"></span>"}, // 89
 	{"p ~ div + table", 1, "<table id=\"t\" class=\"\"></table>"}, // 90
+	{"* ~ *", 10, "<li n=\"2\"></li>,<p id=\"foobar\"></p>,<nonsense id=\"id1\"></nonsense>,<p title=\"title\"></p>,<table></table>,<p title=\"t2\" lang=\"en-gb\"></p>,<span class=\"a bb c\"></span>,<div class=\"one.word\"></div>,<div class=\"span\"></div>,<table id=\"t\" class=\"\"></table>"},
+	{"p ~ * ~ div", 2, "<div class=\"one.word\"></div>,<div class=\"span\"></div>"},
+	{"ul ~ p ~ p ~ span", 1, "<span class=\"a bb c\"></span>"},
+	{"#foobar ~ :not(p) ~ table", 1, "<table id=\"t\" class=\"\"></table>"},
 	{"table:empty", 1, "<table id=\"t\" class=\"\"></table>"}, // 148, 150
 	{"li:empty", 0, ""}, // 151, 152
 	{".\\31 \\33", 1, "<a class=\"13\" href=\"http://example.com\"></a>"}, // 175c
@@ -175,6 +219,7 @@ struct tvec {
 	{".a\\ bb\\ c", 0, ""}, // 155b
 	{".one.word", 0, ""}, // 155c
 	{".one\\.word", 1, "<div class=\"one.word\"></div>"}, // 155d
+	{".BB.A:not(.x)", 1, "<span class=\"a bb c\"></span>"},
 	{"a & span, p", -1, ""}, // 156
 	{"[*=t2]", -1, ""}, // 157
 	{"[*|*=t2]", -1, ""}, // 158
@@ -195,8 +240,894 @@ struct tvec {
 	{"table:not([class$=\"\"])", 2, "<table></table>,<table id=\"t\" class=\"\"></table>"}, // 184d
 	{"table:not([class^=\"\"])", 2, "<table></table>,<table id=\"t\" class=\"\"></table>"}, // 184e
 	{"table:not([class*=\"\"])", 2, "<table></table>,<table id=\"t\" class=\"\"></table>"}, // 184f
+
+	// Selectors Level 4
+	{":is(p, nonsense)[id]", 2, "<p id=\"foobar\"></p>,<nonsense id=\"id1\"></nonsense>"},
+	{":where(ul, table) > *", 3, "<li></li>,<li n=\"2\"></li>,<tr></tr>"},
+	{"span:is(p > *, td > * )", 2, "<span class=\"class1\" lang=\"en-fr\"></span>,<span class=\"sp\"></span>"},
+	{"p:not(:is([id], [lang]))", 1, "<p title=\"title\"></p>"},
+	{":is()", -1, ""},
+	{":is(p,)", -1, ""},
+	{"p:has(span)", 1, "<p title=\"title\"></p>"},
+	{"html > :has(span.sp)", 1, "<p title=\"title\"></p>"},
+	{"li:has(bla)", 1, "<li></li>"},
+	{"div:has(a, span)", 1, "<div class=\"one.word\"></div>"},
+	{":has(> td)", 1, "<tr></tr>"},
+	{"p:has(+ span)", 1, "<p title=\"t2\" lang=\"en-gb\"></p>"},
+	{"span:has(~ table)", 2, "<span class=\"class1\" lang=\"en-fr\"></span>,<span class=\"a bb c\"></span>"},
+	{"*:has(> :first-child:empty)", 1, "<li></li>"},
+	{":has(> table:has(td)) > span", 1, "<span class=\"class1\" lang=\"en-fr\"></span>"},
+	{"p:not(:has(*))", 2, "<p id=\"foobar\"></p>,<p title=\"t2\" lang=\"en-gb\"></p>"},
+	{"p:has(table span)", 1, "<p title=\"title\"></p>"},
+	{"p:has(html span)", 0, ""},
+	{"p:has(> table td > span)", 1, "<p title=\"title\"></p>"},
+	{"p:has(> tr td)", 0, ""},
+	{"p:has(~ div > a)", 3, "<p id=\"foobar\"></p>,<p title=\"title\"></p>,<p title=\"t2\" lang=\"en-gb\"></p>"},
+	{"span:has(+ div a)", 1, "<span class=\"a bb c\"></span>"},
+	{"html:has(ul * bla)", 1, "<html></html>"},
+	{"html:has(> ul * li)", 0, ""},
+	{":has(> li + li)", 1, "<ul></ul>"},
+	{"p:has()", -1, ""},
+	{"p:has(>)", -1, ""},
+
+	// Text pseudo-classes
+	{"p:contains(\"paragraph\")", 2, "<p id=\"foobar\"></p>,<p title=\"title\"></p>"},
+	{"span:contains(Span)", 1, "<span class=\"sp\"></span>"},
+	{"span:icontains('SPAN')", 3, "<span class=\"class1\" lang=\"en-fr\"></span>,<span class=\"sp\"></span>,<span class=\"a bb c\"></span>"},
+	{":contains(\"ooray\")", 2, "<html></html>,<div class=\"one.word\"></div>"},
+	{"div:contains(\"hooray    ref\")", 1, "<div class=\"one.word\"></div>"},
+	{":contains(\"real      A\")", 1, "<html></html>"},
+	{"li:contains(\"\")", 2, "<li></li>,<li n=\"2\"></li>"},
+	{":contains(\"A comment\")", 0, ""},
+	{"p:not(:contains(title))", 2, "<p id=\"foobar\"></p>,<p title=\"t2\" lang=\"en-gb\"></p>"},
+	{"td:icontains( \"IN TABLE\" )", 1, "<td></td>"},
+	{":has(> :contains(table))", 5, "<html></html>,<p title=\"title\"></p>,<table></table>,<tr></tr>,<td></td>"},
+	{"p:contains()", -1, ""},
+	{"p:contains(\"a\" \"b\")", -1, ""},
+
+	// Selectors anchored at the root element
+	{":root > p > span", 1, "<span class=\"class1\" lang=\"en-fr\"></span>"},
+	{"html > p > table td > span", 1, "<span class=\"sp\"></span>"},
+	{":root > p > table td > span", 1, "<span class=\"sp\"></span>"},
+	{":root > p > table > td", 0, ""},
+	{":root > ul li > bla", 1, "<bla></bla>"},
+	{":root > div.span", 1, "<div class=\"span\"></div>"},
+	{"html, :root > nonsense", 2, "<html></html>,<nonsense id=\"id1\"></nonsense>"},
+	{"html:root.x > p", 0, ""},
+
+	// Trivial selectors
+	{"SPAN.Sp", 1, "<span class=\"sp\"></span>"},
+	{"#FooBar", 1, "<p id=\"foobar\"></p>"},
+	{"html", 1, "<html></html>"},
+	{" td ", 1, "<td></td>"},
+	{"div.one", 0, ""},
+	{"-x", 0, ""},
+};
+
+
+// Checks a live selection against a full selection after modifying the tree
+static bool checkLive(const tree<htmlcxx::HTML::Node> &dom, const char *expr, unsigned int offset)
+{
+	tree<htmlcxx::HTML::Node> copy(dom);
+	hcxselect::LiveSelection live(copy, hcxselect::CompiledSelector(expr));
+
+	tree<htmlcxx::HTML::Node>::iterator it, html, li, nonsense;
+	for (it = copy.begin(); it != copy.end(); ++it) {
+		if (it->tagName() == "html" && html.node == NULL) html = it;
+		if (it->tagName() == "li" && li.node == NULL) li = it;
+		if (it->tagName() == "nonsense") nonsense = it;
+	}
+
+	// Remove the first list item, rename an element and append a new one
+	live.removing(li.node);
+	copy.erase(li);
+
+	nonsense->tagName("span");
+	live.changed(nonsense.node);
+
+	htmlcxx::HTML::Node node;
+	node.text("<p title=\"new\">");
+	node.closingText("</p>");
+	node.tagName("p");
+	node.offset(offset);
+	node.isTag(true);
+	it = copy.append_child(html, node);
+	live.inserted(it.node);
+
+	return (live.nodes() == hcxselect::select(copy, expr));
+}
+
+
+// Checks that live selections pick up changes below the following
+// siblings of :has() anchors
+static bool checkLiveSiblings(const char *expr)
+{
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree("<html><body><h1></h1><div><span>a</span></div></body></html>");
+	hcxselect::LiveSelection live(dom, hcxselect::CompiledSelector(expr));
+
+	tree<htmlcxx::HTML::Node>::iterator it = dom.begin();
+	while (it != dom.end() && it->tagName() != "span") ++it;
+	it->text("<span class=\"x\">");
+	it->parseAttributes();
+	live.changed(it.node);
+
+	hcxselect::NodeSet nodes = live.nodes();
+	return (nodes.size() == 1 && nodes == hcxselect::select(dom, expr));
+}
+
+
+// Checks the extraction of source ranges from a selection
+static bool checkExtract(const tree<htmlcxx::HTML::Node> &dom, const string &source)
+{
+	const char *src = source.c_str();
+	hcxselect::Selection s(dom, "p[title], a");
+	vector<hcxselect::StringRef> refs;
+
+	s.outerHtml(src, &refs);
+	if (refs.size() != 3 || refs[2].str() != "<a class=\"13\" href=\"http://example.com\">ref</a>") return false;
+	s.innerHtml(src, &refs);
+	if (refs[0].str().find("    A paragraph") != 0 || refs[1].str() != "Another one" || refs[2].str() != "ref") return false;
+	s.attribute(src, "TITLE", &refs);
+	if (refs[0].str() != "title" || refs[1].str() != "t2" || refs[2].data != NULL) return false;
+
+	hcxselect::Selection d(dom, "div");
+	d.textSpans(src, &refs);
+	if (refs.size() != 4 || refs[2].str() != "  ") return false;
+	char buf[16];
+	size_t n = d.text(src, buf, sizeof(buf));
+	return (n == 21 && string(buf, sizeof(buf)) == "hooray    ref  f");
+}
+
+
+// Checks that a mapped document reports the source offsets of the
+// expected nodes
+static bool checkMapped(const hcxselect::MappedDocument &doc, const char *expr, const hcxselect::NodeSet &expected)
+{
+	vector<int> v;
+	doc.select(expr, &v);
+	if (v.size() != expected.size()) return false;
+	hcxselect::NodeSet::const_iterator it = expected.begin();
+	for (size_t i = 0; i < v.size(); ++i, ++it) {
+		if (doc.offset[v[i]] != (*it)->data.offset() || doc.length[v[i]] != (*it)->data.length()) return false;
+	}
+	return true;
+}
+
+// Checks saving flat documents to files and mapping them
+static bool checkMappedFile(const hcxselect::FlatDocument &flat, const string &data)
+{
+	char path[] = "hcxselect-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) return false;
+	close(fd);
+	ofstream out(path, ios::binary);
+	flat.save(out);
+	out.close();
+
+	hcxselect::MappedDocument doc, truncated;
+	bool ok = doc.open(path) && doc.size() == flat.size() && doc.hasIndexes()
+		&& !truncated.open(data.data(), data.length() / 2)
+		&& checkMapped(doc, "p[title] > span, #id1", flat.select("p[title] > span, #id1"));
+	unlink(path);
+	return ok;
+}
+
+
+// Checks that filtering blocks of nodes by type, class and id gives the
+// same results as testing every node, on a document spanning many blocks
+static bool checkBatch()
+{
+	string source = "<html><body>";
+	for (int i = 0; i < 150; i++) {
+		source += (i == 90 ? "<section id=\"w\">" : "");
+		source += (i % 3 ? "<p class=\"a\">" : "<div class=\"a b\" id=\"d\">");
+		source += (i % 2 ? "<span>x</span>" : "<span class=\"b\" id=\"s\">y</span>");
+		source += (i % 3 ? "</p>" : "</div>");
+		source += (i == 95 ? "</section>" : "");
+	}
+	source += "</body></html>";
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	hcxselect::FlatDocument flat(dom);
+	ostringstream out;
+	flat.save(out, false);
+	string data = out.str();
+	hcxselect::MappedDocument unindexed;
+	if (!unindexed.open(data.data(), data.length())) {
+		return false;
+	}
+
+	const char *selectors[] = {
+		"span", "p", "div.a.b", ".b", "span#s", "#d > span", "body span.b", "p:nth-child(2n) span",
+		"div span, p", ".a:not(p) > *", "span.c", "em", "#s.b, p.b", "#w span#s", "#w .b", NULL
+	};
+	for (int i = 0; selectors[i]; i++) {
+		hcxselect::NodeSet s = hcxselect::select(dom, selectors[i]);
+		if (s.empty() != (i >= 10 && i <= 11) || flat.select(selectors[i]) != s
+			|| !checkMapped(unindexed, selectors[i], s)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Pipeline that reads documents consisting of the test source repeated
+// as often as their name says, and checks that they arrive in order with
+// the same results as direct selection
+struct TestPipeline : hcxselect::Pipeline
+{
+	TestPipeline(const vector<string> &selectors)
+		: hcxselect::Pipeline(selectors, 2, 2, 2, 3), selectors(selectors), next(0), ok(true) { }
+
+	bool read(hcxselect::PipelineDocument &doc)
+	{
+		if (doc.name == "throw") {
+			throw runtime_error("unreadable");
+		}
+		for (int i = atoi(doc.name.c_str()); i > 0; --i) {
+			doc.source += rawsource;
+		}
+		return (doc.name != "missing");
+	}
+
+	void consume(const hcxselect::PipelineDocument &doc)
+	{
+		ok = (ok && doc.index == next++ && doc.error == (doc.name == "missing" || doc.name == "throw"));
+		ok = (ok && doc.source.length() == atoi(doc.name.c_str()) * strlen(rawsource));
+		for (size_t i = 0; ok && i < selectors.size(); ++i) {
+			hcxselect::NodeSet s;
+			if (doc.dom) s = hcxselect::select(*doc.dom, selectors[i]);
+			ok = (doc.matches[i] == vector<hcxselect::Node *>(s.begin(), s.end()));
+		}
+	}
+
+	vector<string> selectors;
+	size_t next;
+	bool ok;
 };
 
+// Checks that a pipeline delivers all documents in order, including ones
+// that could not be read or whose reader threw an exception
+static bool checkPipeline()
+{
+	vector<string> selectors, names;
+	selectors.push_back("p > span");
+	selectors.push_back("div, #foobar");
+	for (int i = 0; i < 50; i++) {
+		ostringstream ss;
+		ss << (i * 7) % 11;
+		names.push_back(i == 23 ? "missing" : i == 37 ? "throw" : ss.str());
+	}
+
+	TestPipeline pipeline(selectors);
+	hcxselect::Pipeline::Statistics stats;
+	bool ok = !pipeline.run(names, &stats) && pipeline.ok && pipeline.next == names.size();
+	names.resize(10);
+	pipeline.next = 0;
+	return (ok && pipeline.run(names) && pipeline.ok && pipeline.next == 10 && stats.documents == 50);
+}
+
+
+// Counts the visited nodes and stops after a given number of them
+struct Counter : hcxselect::Visitor
+{
+	Counter(size_t limit) : n(0), limit(limit) { }
+	bool visit(hcxselect::Node *) { return (++n < limit); }
+	size_t n, limit;
+};
+
+// Checks that repeated selections into reused buffers do not allocate,
+// once the attributes of all nodes have been parsed by htmlcxx
+static bool checkAllocations(const tree<htmlcxx::HTML::Node> &dom, const char *expr)
+{
+	hcxselect::CompiledSelector selector(expr);
+	hcxselect::NodeSet expected = hcxselect::select(dom, selector);
+	vector<hcxselect::Node *> nodes;
+	nodes.reserve(expected.size());
+	Counter all(1000), first(1);
+	size_t matches = 0, single = 0;
+	for (tree<htmlcxx::HTML::Node>::iterator it = dom.begin(); it != dom.end(); ++it) {
+		single += selector.matches(it.node);
+	}
+
+	size_t n = allocations;
+	for (int i = 0; i < 10; i++) {
+		nodes.clear();
+		hcxselect::selectInto(dom, selector, &nodes);
+		hcxselect::select(dom, selector, all);
+		hcxselect::select(dom, selector, first);
+		for (tree<htmlcxx::HTML::Node>::iterator it = dom.begin(); it != dom.end(); ++it) {
+			matches += selector.matches(it.node);
+		}
+	}
+	if (allocations != n) {
+		cerr << "Selection of '" << expr << "' allocated memory" << endl;
+		return false;
+	}
+
+	return (nodes == vector<hcxselect::Node *>(expected.begin(), expected.end()) &&
+		all.n == 10 * expected.size() && first.n == (expected.empty() ? 0 : 10) &&
+		matches == 10 * single);
+}
+
+// Selectors covering all selector functions. The claim is limited to
+// trees; flat documents allocate their plans.
+static const char *allocationSelectors[] = {
+	"p > span, div a[href], .bb, td span:not([class=x])",
+	"* ~ span, p + span, [lang|=en], [title^=t], [title$=\"2\"], [href*=example], #foobar",
+	"li:first-child, li:last-child, :only-child, :only-of-type, :first-of-type, :last-of-type",
+	":nth-child(2n+1), :nth-last-child(2), p:nth-of-type(odd), :nth-last-of-type(1), :empty",
+	":root, :is(ul, table) > *, :where(.sp), html :text, :comment, ul > li ~ li",
+	"p:has(span), :has(> td), li:has(+ li, ~ li), :has(p span), table:has(* span)",
+	"p:contains(\"paragraph\"), :icontains('SPAN'), div:contains(\"hooray    ref\"), :has(> :contains(Span))",
+	NULL
+};
+
+
+// Checks sharing of prefixes, size limits and invalidation of query
+// caches
+static bool checkCache(const tree<htmlcxx::HTML::Node> &dom)
+{
+	hcxselect::QueryCache cache(dom, 4, 8);
+	if (cache.select(" p  span") != hcxselect::select(dom, "p span") || cache.size() != 2) {
+		return false;
+	}
+	const hcxselect::QueryCache::Statistics &stats = cache.statistics();
+	if (stats.misses != 1 || stats.prefixHits != 0 || stats.hits != 0 || stats.hitRate() != 0.0) {
+		return false;
+	}
+
+	// Normalized expressions and prefixes are shared
+	if (cache.select("p span ").size() != 2 || cache.select("p").size() != 3
+		|| cache.select("p>span") != hcxselect::select(dom, "p > span")
+		|| cache.select("p:not( [title] ) span").size() != 0) {
+		return false;
+	}
+	if (stats.hits != 2 || stats.prefixHits != 1 || stats.misses != 2 || stats.hitRate() != 0.6) {
+		return false;
+	}
+
+	// At most four results and eight nodes are kept
+	if (cache.size() != 4 || cache.nodes() != 5 || cache.select("*").size() != 19
+		|| cache.size() != 1 || stats.evictions != 5) {
+		return false;
+	}
+
+	cache.invalidate();
+	return (cache.size() == 0 && cache.nodes() == 0 && stats.invalidations == 1
+		&& cache.select("li").size() == 2 && stats.misses == 4);
+}
+
+// Checks that a rule set built from all test vectors reports the same
+// nodes for each rule as selecting it on its own
+static bool checkRuleSet(const tree<htmlcxx::HTML::Node> &dom)
+{
+	hcxselect::RuleSet rules;
+	vector<hcxselect::NodeSet> expected;
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(tvec); i++) {
+		try {
+			if (rules.add(vectors[i].s) != (int)expected.size()) {
+				return false;
+			}
+		} catch (hcxselect::ParseException &) {
+			if (vectors[i].n >= 0 || rules.size() != (int)expected.size()) {
+				return false;
+			}
+			continue;
+		}
+		expected.push_back(hcxselect::select(dom, vectors[i].s));
+	}
+
+	vector<hcxselect::RuleMatch> matches;
+	rules.select(dom, &matches);
+	vector<hcxselect::NodeSet> actual(expected.size());
+	for (size_t i = 0; i < matches.size(); i++) {
+		if (i > 0 && (matches[i].node == matches[i-1].node ? matches[i].rule <= matches[i-1].rule
+				: !hcxselect::NodeComp()(matches[i-1].node, matches[i].node))) {
+			return false;
+		}
+		actual[matches[i].rule].insert(matches[i].node);
+	}
+	return (actual == expected);
+}
+
+// Minimal custom document representation, mirroring an htmlcxx tree
+struct Element
+{
+	Element() : parent(NULL), first(NULL), next(NULL), prev(NULL), tag(false), comment(false), length(0), source(NULL) { }
+	~Element() { for (Element *e = first, *n; e; e = n) { n = e->next; delete e; } }
+
+	Element *parent, *first, *next, *prev;
+	bool tag, comment;
+	unsigned int length;
+	string name, text;
+	map<string, string> attributes;
+	hcxselect::Node *source;
+};
+
+struct ElementTraits : hcxselect::NodeTraits<ElementTraits, const Element *>
+{
+	static bool valid(const Element *e) { return e != NULL; }
+	static bool same(const Element *a, const Element *b) { return a == b; }
+	static const Element *parent(const Element *e) { return e->parent; }
+	static const Element *firstChild(const Element *e) { return e->first; }
+	static const Element *nextSibling(const Element *e) { return e->next; }
+	static const Element *prevSibling(const Element *e) { return e->prev; }
+	static bool isTag(const Element *e) { return e->tag; }
+	static bool isComment(const Element *e) { return e->comment; }
+	static unsigned int length(const Element *e) { return e->length; }
+	static const char *tagName(const Element *e) { return e->name.c_str(); }
+
+	static bool text(const Element *e, const char **text, size_t *length) {
+		*text = e->text.data();
+		*length = e->text.length();
+		return true;
+	}
+
+	static bool attribute(const Element *e, const string &name, const char **value, size_t *length) {
+		map<string, string>::const_iterator it = e->attributes.find(name);
+		if (it == e->attributes.end()) {
+			return false;
+		}
+		*value = it->second.c_str();
+		*length = it->second.length();
+		return true;
+	}
+};
+
+// Copies the subtree of a node into an element
+static Element *mirror(tree<htmlcxx::HTML::Node>::iterator_base node, Element *parent)
+{
+	Element *e = new Element();
+	e->parent = parent;
+	e->tag = node->isTag();
+	e->comment = node->isComment();
+	e->length = node->length();
+	e->name = node->tagName();
+	e->text = node->text();
+	node->parseAttributes();
+	e->attributes = node->attributes();
+	e->source = node.node;
+
+	Element *last = NULL;
+	for (tree<htmlcxx::HTML::Node>::sibling_iterator it = node.begin(); it != node.end(); ++it) {
+		Element *child = mirror(it, e);
+		child->prev = last;
+		(last ? last->next : e->first) = child;
+		last = child;
+	}
+	return e;
+}
+
+// Checks matching against a custom document representation through node
+// traits, and against the htmlcxx tree through the built-in tree access
+static bool checkTraits(const tree<htmlcxx::HTML::Node> &dom)
+{
+	Element *top = mirror(dom.begin(), NULL), *root = top;
+	while (root && strcasecmp(root->name.c_str(), "html")) {
+		root = (root->first ? root->first : root->next);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; ok && i < sizeof(vectors) / sizeof(tvec); i++) {
+		if (vectors[i].n < 0) {
+			continue;
+		}
+
+		hcxselect::CompiledSelector selector(vectors[i].s);
+		vector<const Element *> elements;
+		hcxselect::select<ElementTraits>(selector, root, &elements);
+		hcxselect::NodeSet actual;
+		for (size_t j = 0; j < elements.size(); j++) {
+			if (!hcxselect::matches<ElementTraits>(selector, elements[j])
+				|| (j > 0 && !hcxselect::NodeComp()(elements[j-1]->source, elements[j]->source))) {
+				ok = false;
+			}
+			actual.insert(elements[j]->source);
+		}
+		ok = ok && (actual == hcxselect::select(dom, selector));
+	}
+	delete top;
+	return ok;
+}
+
+// Checks whether an arena tree has the same shape, positions, tag names
+// and attributes as an htmlcxx tree
+static bool sameTree(tree<htmlcxx::HTML::Node>::iterator_base node, const hcxselect::ArenaNode *n)
+{
+	node->parseAttributes();
+	if (node->isTag() != n->isTag() || node->isComment() != n->isComment()
+		|| node->offset() != n->offset || node->length() != n->length
+		|| (node->isTag() && node->tagName() != n->tagName.str())) {
+		return false;
+	}
+	const map<string, string> &attrs = node->attributes();
+	for (map<string, string>::const_iterator it = attrs.begin(); it != attrs.end(); ++it) {
+		const hcxselect::StringRef *value = n->attribute(it->first);
+		if (!value || value->str() != it->second) {
+			return false;
+		}
+	}
+	for (unsigned int i = 0; i < n->attributeCount; i++) {
+		string name = n->attributes[i].name.str();
+		transform(name.begin(), name.end(), name.begin(), ::tolower);
+		if (attrs.find(name) == attrs.end()) {
+			return false;
+		}
+	}
+
+	const hcxselect::ArenaNode *child = n->firstChild;
+	for (tree<htmlcxx::HTML::Node>::sibling_iterator it = node.begin(); it != node.end(); ++it) {
+		if (!child || child->parent != n || !sameTree(it, child)) {
+			return false;
+		}
+		child = child->nextSibling;
+	}
+	return (child == NULL);
+}
+
+// Checks :contains() and :icontains() on long, nested text against
+// searching the concatenated text of every element, and that the text of
+// the document is scanned only once per query
+static bool checkContains()
+{
+	const char *words[] = {"ab", "Ab ", "aB", "b", " ", "\xe2\x82\xac", "ba", "AAB"};
+	string source = "<html><body><div><p>xy</p><p>z<b>w</b>v</p></div>";
+	unsigned int seed = 1;
+	for (int i = 0; i < 120; i++) {
+		source += (i % 4 ? "<span>" : "<p>");
+		for (int j = 0; j < 40; j++) {
+			seed = seed * 1103515245 + 12345;
+			source += words[(seed >> 16) % 8];
+			source += ((seed >> 8) % 13 ? "" : "<!-- ab --><b>a</b>");
+		}
+		source += (i % 4 ? "</span>" : "");
+		source += (i % 4 == 3 ? "</p>" : "");
+	}
+	source += "</body></html>";
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+
+	size_t total = 0;
+	for (tree<htmlcxx::HTML::Node>::iterator it = dom.begin(); it != dom.end(); ++it) {
+		total += (it->isTag() || it->isComment() ? 0 : it->length());
+	}
+	hcxselect::NodeSet elements = hcxselect::select(dom, "*");
+	vector<char> buffer(source.length());
+	for (int k = 0; k < 40; k++) {
+		seed = seed * 1103515245 + 12345;
+		string needle = (k < 8 ? string(words[k]) + words[(k + 3) % 8] : k == 8 ? string("yzwv")
+			: source.substr((seed >> 8) % (source.length() - 40), 1 + (seed >> 16) % 40));
+		string lower = needle;
+		transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+		hcxselect::NodeSet expected[2];
+		for (hcxselect::NodeSet::const_iterator it = elements.begin(); it != elements.end(); ++it) {
+			string text(&buffer[0], hcxselect::text(source.c_str(), *it, &buffer[0], buffer.size()));
+			if (text.find(needle) != string::npos) {
+				expected[0].insert(*it);
+			}
+			transform(text.begin(), text.end(), text.begin(), ::tolower);
+			if (text.find(lower) != string::npos) {
+				expected[1].insert(*it);
+			}
+		}
+
+		for (int i = 0; i < 2; i++) {
+			string quoted;
+			for (size_t j = 0; j < needle.length(); j++) {
+				quoted += (needle[j] == '"' || needle[j] == '\\' ? "" : string(1, needle[j]));
+			}
+			if (quoted != needle) {
+				break;
+			}
+			hcxselect::Statistics stats;
+			string expr = string(i ? "*:icontains(\"" : "*:contains(\"") + needle + "\")";
+			if (hcxselect::select(dom, expr, &stats) != expected[i] || stats.textBytes > total) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Checks that arena trees are built like the trees of ParserDom
+static bool checkArenaTree(const string &source)
+{
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	hcxselect::ArenaDocument doc;
+	doc.parse(source);
+	return (doc.top() && sameTree(dom.begin(), doc.top()) && doc.size() == (int)dom.size()
+		&& (doc.root() != NULL) == (hcxselect::select(dom, "html").size() > 0));
+}
+
+// Checks selection on an arena tree against the nodes selected from the
+// htmlcxx tree
+static bool checkArena(const hcxselect::ArenaDocument &doc, const char *expr, const hcxselect::NodeSet &expected)
+{
+	vector<const hcxselect::ArenaNode *> nodes;
+	doc.select(expr, &nodes);
+	if (nodes.size() != expected.size()) {
+		return false;
+	}
+	hcxselect::NodeSet::const_iterator it = expected.begin();
+	for (size_t i = 0; i < nodes.size(); i++, ++it) {
+		if (nodes[i]->offset != (*it)->data.offset() || nodes[i]->length != (*it)->data.length()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Checks that all kinds of documents report the expected number of nodes
+// for selectors on an unusual document
+static bool checkEngines(const string &source, const tvec *tests, size_t n)
+{
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	hcxselect::FlatDocument flat(dom);
+	hcxselect::SubtreeSummary summary(dom);
+	hcxselect::ArenaDocument arena;
+	arena.parse(source);
+	ostringstream out;
+	flat.save(out);
+	string data = out.str();
+	hcxselect::MappedDocument mapped;
+	if (!mapped.open(data.data(), data.length())) {
+		return false;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		hcxselect::NodeSet nodes = hcxselect::select(dom, tests[i].s);
+		if (nodes.size() != (size_t)tests[i].n || flat.select(tests[i].s) != nodes
+			|| summary.select(tests[i].s) != nodes || !checkMapped(mapped, tests[i].s, nodes)
+			|| !checkArena(arena, tests[i].s, nodes)) {
+			cerr << "{ " << tests[i].s << " } ";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Nested html elements, each of which is a root, and duplicate ids
+const char *nestedSource = "<html><body><div><html><p id=\"a\">x</p></html></div><p id=\"a\">y</p></body></html>";
+tvec nestedVectors[] = {
+	{"html > p", 1, ""},
+	{":root > p", 0, ""},
+	{":root > body > p", 1, ""},
+	{":root", 1, ""},
+	{"html p", 2, ""},
+	{"html > body > p", 1, ""},
+	{"html > body > div > html > p", 1, ""},
+	{"div > html", 1, ""},
+	{":first-child", 4, ""},
+	{"html:first-child", 1, ""},
+	{"html", 2, ""},
+	{"#a", 2, ""},
+	{"p#a", 2, ""},
+	{"[id=a]", 2, ""},
+	{"#a, p", 2, ""}
+};
+
+// Checks set operations and traversals of selections against equivalent
+// selectors
+static bool checkSelectionOps(const tree<htmlcxx::HTML::Node> &dom)
+{
+	using hcxselect::Selection;
+	Selection ps(dom, "p"), titled(dom, "[title]"), spans(dom, "span");
+	if (ps.intersect(titled) != hcxselect::select(dom, "p[title]")
+		|| ps.subtract(titled) != hcxselect::select(dom, "p:not([title])")
+		|| ps.unite(spans) != hcxselect::select(dom, "p, span")
+		|| Selection(dom, "*").filter("p > span") != hcxselect::select(dom, "p > span")) {
+		return false;
+	}
+
+	Selection sp(dom, ".sp");
+	if (!sp.is("td span") || sp.is("ul span") || Selection().is("*")) {
+		return false;
+	}
+	if (spans.closest("p") != hcxselect::select(dom, "p:has(span)") || spans.closest("span") != spans
+		|| sp.closest("table").unite(sp.closest("tr")) != hcxselect::select(dom, "p table, p tr")) {
+		return false;
+	}
+	if (sp.parents() != hcxselect::select(dom, ":has(.sp)")
+		|| spans.parents("p, html") != hcxselect::select(dom, "html, p:has(span)")) {
+		return false;
+	}
+	return (Selection(dom, "html").children("p") == ps
+		&& ps.children() == hcxselect::select(dom, "p > *")
+		&& ps.children() == ps.children("*") && ps.children(":not(span)") == ps.children().subtract(spans)
+		&& Selection(dom, "table").children().children("td") == hcxselect::select(dom, "td"));
+}
+
+// Checks the plans chosen for flat documents and the numbers reported by
+// explain() on a document with selective ids and classes
+static bool checkPlans()
+{
+	const char *plans[][2] = {
+		{"#h42", "seed from #h42"},
+		{"p.note", "seed from .note"},
+		{"#main p", "descendants of #main"},
+		{".s3 a", "join"},
+		{"li", "seed from li"},
+		{"*", "scan"}
+	};
+
+	string source = "<html><body>";
+	for (int i = 0; i < 200; i++) {
+		ostringstream ss;
+		ss << "<div class=\"s" << i % 10 << "\"><h2 id=\"h" << i << "\">T</h2>"
+			<< "<p class=\"text\">a<a href=\"x\">l</a></p><ul><li>1</li><li>2</li></ul></div>";
+		source += ss.str();
+	}
+	source += "<div id=\"main\"><p class=\"note\">n</p></div></body></html>";
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	hcxselect::FlatDocument flat(dom);
+
+	for (size_t i = 0; i < sizeof(plans) / sizeof(plans[0]); i++) {
+		string text = hcxselect::explain(plans[i][0], flat);
+		size_t chosen = text.find("selector 1: "), actual = text.find("  actual: ");
+		if (chosen == string::npos || actual == string::npos
+			|| text.compare(chosen + 12, strlen(plans[i][1]), plans[i][1])) {
+			cerr << "{ " << plans[i][0] << " } ";
+			return false;
+		}
+
+		// The actual number of matches is the size of the result
+		long examined = -1, matches = -1;
+		sscanf(text.c_str() + actual, "  actual: %ld nodes, %ld matches", &examined, &matches);
+		if (examined < matches || examined > flat.size()
+			|| matches != (long)flat.select(plans[i][0]).size()) {
+			cerr << "{ " << plans[i][0] << " } ";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Expected counters of runtime statistics
+struct svec {
+	const char *s;
+	unsigned long visited, predicates, ancestors, siblings, parses, text;
+	unsigned long steps[2];
+} statistics[] = {
+	{"p span", 9, 10, 1, 0, 0, 0, {1, 9}},
+	{"p > span", 9, 10, 1, 0, 0, 0, {1, 9}},
+	{"p ~ div", 9, 10, 0, 1, 0, 0, {1, 9}},
+	{"p + p", 9, 10, 0, 2, 0, 0, {1, 9}},
+	{"body *", 9, 12, 20, 0, 0, 0, {12, 9}},
+	{"[title]", 9, 9, 0, 0, 9, 0, {9, 0}},
+	{":contains(y)", 9, 9, 0, 0, 0, 3, {9, 0}}
+};
+
+// Checks the counters of runtime statistics on a small document. They
+// are only counted if the library and the test are compiled with
+// HCXSELECT_STATISTICS, and have to be zero otherwise.
+static bool checkStatistics()
+{
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> dom = parser.parseTree(
+		"<html><body><p class=\"a\">x</p><p>y<span title=\"t\">z</span></p><div></div></body></html>");
+	for (size_t i = 0; i < sizeof(statistics) / sizeof(svec); i++) {
+		svec e = statistics[i];
+#ifndef HCXSELECT_STATISTICS
+		svec zero = {e.s, 0, 0, 0, 0, 0, 0, {0, 0}};
+		e = zero;
+#endif
+		hcxselect::Statistics stats;
+		hcxselect::select(dom, e.s, &stats);
+		size_t n = stats.stepCalls.size();
+		if (stats.nodesVisited != e.visited || stats.predicateCalls != e.predicates
+			|| stats.ancestorSteps != e.ancestors || stats.siblingSteps != e.siblings
+			|| stats.attributeParses != e.parses || stats.textBytes != e.text
+			|| n < 1 || n > 2 || stats.stepCalls[0] != e.steps[0] || (n > 1 && stats.stepCalls[1] != e.steps[1])) {
+			cerr << "{ " << e.s << " } ";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the limit exceeded by compiling a selector and applying it to
+// a tree and a flat document, or -1
+static int exceeded(const tree<htmlcxx::HTML::Node> &dom, const char *expr, const hcxselect::Limits &limits)
+{
+	try {
+		hcxselect::CompiledSelector selector(expr, limits);
+		hcxselect::NodeSet nodes = hcxselect::select(dom, selector);
+		vector<int> indices;
+		hcxselect::FlatDocument(dom).select(selector, &indices);
+		if (nodes.size() != indices.size()) {
+			return -2;
+		}
+	} catch (const hcxselect::LimitException &e) {
+		return e.limit();
+	}
+	return -1;
+}
+
+// Cancels a token after visiting the first node
+struct Canceller : hcxselect::Visitor
+{
+	Canceller(hcxselect::CancellationToken *token) : token(token), n(0) { }
+	bool visit(hcxselect::Node *) { token->cancel(); ++n; return true; }
+	hcxselect::CancellationToken *token;
+	size_t n;
+};
+
+// Checks work limits and cancellation of queries
+static bool checkLimits(const tree<htmlcxx::HTML::Node> &dom)
+{
+	typedef hcxselect::LimitException E;
+	hcxselect::Limits limits;
+	limits.maxComplexity = 5;
+	if (exceeded(dom, "* * *", limits) != -1 || exceeded(dom, "* * * * * *", limits) != E::Complexity
+		|| exceeded(dom, "p:not(.a.b.c.d.e)", limits) != E::Complexity) {
+		return false;
+	}
+	limits.maxComplexity = 1;
+	if (exceeded(dom, "div", limits) != -1 || exceeded(dom, "div.one", limits) != E::Complexity) {
+		return false;
+	}
+
+	limits = hcxselect::Limits();
+	limits.maxNesting = 2;
+	if (exceeded(dom, ":not(:is(p, :not(div)))", limits) != E::Nesting
+		|| exceeded(dom, ":not(:is(p, div)), :has(> :not(a))", limits) != -1) {
+		return false;
+	}
+
+	limits = hcxselect::Limits();
+	limits.maxNodes = 5;
+	if (exceeded(dom, "p", limits) != E::Nodes) {
+		return false;
+	}
+	limits.maxNodes = 1000;
+	if (exceeded(dom, "span", limits) != -1) {
+		return false;
+	}
+
+	limits = hcxselect::Limits();
+	limits.maxPredicates = 30;
+	if (exceeded(dom, "* * * * * *", limits) != E::Predicates || exceeded(dom, "p", limits) != -1) {
+		return false;
+	}
+
+	// Cancel before and during queries on a large tree
+	hcxselect::CancellationToken token;
+	limits = hcxselect::Limits();
+	limits.token = &token;
+	if (exceeded(dom, "p", limits) != -1) {
+		return false;
+	}
+	token.cancel();
+	if (exceeded(dom, "p", limits) != E::Cancelled) {
+		return false;
+	}
+	token.reset();
+
+	string source = "<html>";
+	for (int i = 0; i < 10000; i++) {
+		source += "<p>Text</p>";
+	}
+	source += "</html>";
+	htmlcxx::HTML::ParserDom parser;
+	tree<htmlcxx::HTML::Node> large = parser.parseTree(source);
+	Canceller canceller(&token);
+	try {
+		hcxselect::select(large, hcxselect::CompiledSelector("p", limits), canceller);
+		return false;
+	} catch (const E &e) {
+		if (e.limit() != E::Cancelled || canceller.n > 1024) {
+			return false;
+		}
+	}
+	return true;
+}
+
 
 // Program entry point
 int main(int argc, char **argv)
@@ -205,8 +1136,27 @@ int main(int argc, char **argv)
 	string source(rawsource);
 	htmlcxx::HTML::ParserDom parser;
 	tree<htmlcxx::HTML::Node> dom = parser.parseTree(source);
+	hcxselect::FlatDocument flat(dom);
+	hcxselect::SubtreeSummary summary(dom);
+	hcxselect::QueryCache cache(dom);
 	cout << setfill('0');
 
+	// Mapped documents with and without indexes
+	ostringstream out1, out2;
+	flat.save(out1);
+	flat.save(out2, false);
+	string data1 = out1.str(), data2 = out2.str();
+	hcxselect::MappedDocument mapped, unindexed;
+	if (!mapped.open(data1.data(), data1.length()) || !unindexed.open(data2.data(), data2.length())) {
+		cerr << "Opening mapped documents failed" << endl;
+		return 1;
+	}
+	mapped.source = unindexed.source = source.c_str();
+
+	// Arena tree of the same source
+	hcxselect::ArenaDocument arena;
+	arena.parse(source);
+
 	for (size_t i = 0; i < sizeof(vectors) / sizeof(tvec); i++) {
 		stringstream ss;
 		hcxselect::Selector s(dom);
@@ -258,6 +1208,48 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
+		if (flat.select(vectors[i].s) != s) {
+			cerr << endl;
+			cerr << i << " { " << vectors[i].s << " } failed: " <<
+				"Different results for flat document" << endl;
+			return 1;
+		}
+
+		if (summary.select(vectors[i].s) != s) {
+			cerr << endl;
+			cerr << i << " { " << vectors[i].s << " } failed: " <<
+				"Different results for subtree summary" << endl;
+			return 1;
+		}
+
+		if (cache.select(vectors[i].s) != s || cache.select(vectors[i].s) != s) {
+			cerr << endl;
+			cerr << i << " { " << vectors[i].s << " } failed: " <<
+				"Different results for query cache" << endl;
+			return 1;
+		}
+
+		if (!checkMapped(mapped, vectors[i].s, s) || !checkMapped(unindexed, vectors[i].s, s)) {
+			cerr << endl;
+			cerr << i << " { " << vectors[i].s << " } failed: " <<
+				"Different results for mapped document" << endl;
+			return 1;
+		}
+
+		if (!checkArena(arena, vectors[i].s, s)) {
+			cerr << endl;
+			cerr << i << " { " << vectors[i].s << " } failed: " <<
+				"Different results for arena tree" << endl;
+			return 1;
+		}
+
+		if (!checkLive(dom, vectors[i].s, source.length())) {
+			cerr << endl;
+			cerr << i << " { " << vectors[i].s << " } failed: " <<
+				"Different results for live selection" << endl;
+			return 1;
+		}
+
 pass:
 		cout << setw(2) << hex << i;
 		cout << (i > 0 && (i+1) % 16 == 0 ? "\n" : " ");
@@ -265,6 +1257,76 @@ pass:
 	}
 	cout << endl;
 
+	if (!checkContains()) {
+		cerr << "Text pseudo-classes failed" << endl;
+		return 1;
+	}
+	if (!checkArenaTree(source)
+		|| !checkArenaTree("<!DOCTYPE html><html><body><div><p class=a CLASS='b'>x<br>y</div>"
+			"<ul><li>1<li title=\"2\">2</ul></i><img src=a.png /><!-- c --></body></html> z")
+		|| !checkArenaTree("<p>no root</p>") || !checkArenaTree("")) {
+		cerr << "Building arena trees failed" << endl;
+		return 1;
+	}
+	if (!checkExtract(dom, source)) {
+		cerr << "Extraction of source ranges failed" << endl;
+		return 1;
+	}
+	if (!checkMappedFile(flat, data1)) {
+		cerr << "Mapping saved documents failed" << endl;
+		return 1;
+	}
+	if (!checkEngines(nestedSource, nestedVectors, sizeof(nestedVectors) / sizeof(tvec))) {
+		cerr << "Nested root elements and duplicate ids failed" << endl;
+		return 1;
+	}
+	if (!checkCache(dom)) {
+		cerr << "Query cache failed" << endl;
+		return 1;
+	}
+	if (!checkRuleSet(dom)) {
+		cerr << "Rule set failed" << endl;
+		return 1;
+	}
+	if (!checkBatch()) {
+		cerr << "Batch evaluation failed" << endl;
+		return 1;
+	}
+	if (!checkTraits(dom)) {
+		cerr << "Node traits failed" << endl;
+		return 1;
+	}
+	if (!checkSelectionOps(dom)) {
+		cerr << "Selection operations failed" << endl;
+		return 1;
+	}
+	if (!checkLiveSiblings("h1:has(~ div .x)") || !checkLiveSiblings("h1:has(+ div span.x)")) {
+		cerr << "Live selection of :has() anchors failed" << endl;
+		return 1;
+	}
+	if (!checkPlans()) {
+		cerr << "Query plans failed" << endl;
+		return 1;
+	}
+	if (!checkStatistics()) {
+		cerr << "Runtime statistics failed" << endl;
+		return 1;
+	}
+	if (!checkLimits(dom)) {
+		cerr << "Selection limits failed" << endl;
+		return 1;
+	}
+	if (!checkPipeline()) {
+		cerr << "Pipelined selection failed" << endl;
+		return 1;
+	}
+	for (int i = 0; allocationSelectors[i]; i++) {
+		if (!checkAllocations(dom, allocationSelectors[i])) {
+			cerr << "Allocation-free selection failed" << endl;
+			return 1;
+		}
+	}
+
 	return 0;
 }
 